@@ -58,6 +58,7 @@ void setup() {
 
 void loop() {
 
+    mesh.loop();
 
     if (! mesh.connected())
         return;
@@ -92,6 +92,10 @@ ESP8266MQTTMesh mesh = ESP8266MQTTMesh::Builder(networks, network_password, mqtt
                      .setMeshPassword(mesh_password)
                      .build();
 
+//Microseconds the mesh may take out of each loop(), so that sampling stays regular
+#define MESH_LOOP_US 2000
+unsigned long meshTime = 0; //Microseconds spent in mesh.loop() since the last status
+
 bool relayState = false;
 bool stateChanged = false;
 int  heartbeat  = 60000;
@@ -135,6 +139,7 @@ void loop() {
     static unsigned long lastSend = 0;
     static bool needToSend = false;
 
+    meshTime += mesh.loop(MESH_LOOP_US);
     unsigned long now = millis();
 
 #if HAS_DS18B20
@@ -205,6 +210,7 @@ void loop() {
     if (needToSend) {
         lastSend = now;
         String data = build_json();
+        meshTime = 0;
 #if HAS_HLW8012
         power_sum = 0;
         current_sum = 0;
@@ -267,6 +273,7 @@ void callback(const char *topic, const char *msg) {
 String build_json() {
     String msg = "{";
     msg += " \"relay\":\"" + String(relayState ? "ON" : "OFF") + "\"";
+    msg += ", \"mesh_ms\":" + String(meshTime / 1000);
 #if HAS_DS18B20
         msg += ", \"temp\":" + String(temperature, 2);
 #endif
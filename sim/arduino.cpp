@@ -0,0 +1,370 @@
+// Simulated Arduino core: String, Serial, timing, MD5Builder and the ESP flash API
+#include "sim.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+using sim::World;
+using sim::Node;
+
+HardwareSerial Serial;
+EspClass ESP;
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t len) {
+    size_t slen = strlen(src);
+    if (len) {
+        size_t n = slen >= len ? len - 1 : slen;
+        memcpy(dst, src, n);
+        dst[n] = 0;
+    }
+    return slen;
+}
+#endif
+
+char *ultoa(unsigned long value, char *result, int base) {
+    char buf[sizeof(unsigned long) * 8 + 1];
+    int i = 0;
+    if (base < 2 || base > 36) {
+        *result = 0;
+        return result;
+    }
+    do {
+        int d = value % base;
+        buf[i++] = d < 10 ? '0' + d : 'a' + d - 10;
+        value /= base;
+    } while (value);
+    for (int j = 0; j < i; j++) {
+        result[j] = buf[i - 1 - j];
+    }
+    result[i] = 0;
+    return result;
+}
+
+char *ltoa(long value, char *result, int base) {
+    if (value < 0 && base == 10) {
+        result[0] = '-';
+        ultoa(-(unsigned long)value, result + 1, base);
+        return result;
+    }
+    return ultoa((unsigned long)value, result, base);
+}
+
+char *itoa(int value, char *result, int base) {
+    if (value < 0 && base == 10) {
+        return ltoa(value, result, base);
+    }
+    return ultoa((unsigned int)value, result, base);
+}
+
+char *utoa(unsigned int value, char *result, int base) {
+    return ultoa(value, result, base);
+}
+
+unsigned long millis() {
+    return World::get().now() / 1000;
+}
+
+unsigned long micros() {
+    return World::get().now();
+}
+
+void delay(unsigned long ms) {
+    World::get().consume(ms * 1000);
+}
+
+void yield() {
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+}
+
+int digitalRead(uint8_t pin) {
+    return LOW;
+}
+
+String::String(unsigned char value, unsigned char base) : String((unsigned long)value, base) {}
+String::String(int value, unsigned char base) : String((long)value, base) {}
+String::String(unsigned int value, unsigned char base) : String((unsigned long)value, base) {}
+
+String::String(long value, unsigned char base) {
+    char buf[2 + 8 * sizeof(long)];
+    if (base == 10) {
+        ltoa(value, buf, base);
+    } else {
+        ultoa((unsigned long)value, buf, base);
+    }
+    s = buf;
+}
+
+String::String(unsigned long value, unsigned char base) {
+    char buf[1 + 8 * sizeof(unsigned long)];
+    ultoa(value, buf, base);
+    s = buf;
+}
+
+String::String(float value, unsigned char decimalPlaces) : String((double)value, decimalPlaces) {}
+
+String::String(double value, unsigned char decimalPlaces) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, value);
+    s = buf;
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+    if (from > to) {
+        std::swap(from, to);
+    }
+    if (from >= s.length()) {
+        return String();
+    }
+    return String(s.substr(from, std::min((size_t)to, s.length()) - from));
+}
+
+int String::indexOf(char c, unsigned int from) const {
+    size_t pos = s.find(c, from);
+    return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::indexOf(const String &str, unsigned int from) const {
+    size_t pos = s.find(str.s, from);
+    return pos == std::string::npos ? -1 : (int)pos;
+}
+
+bool String::endsWith(const String &suffix) const {
+    return s.size() >= suffix.s.size() && s.compare(s.size() - suffix.s.size(), suffix.s.size(), suffix.s) == 0;
+}
+
+void String::toUpperCase() {
+    std::transform(s.begin(), s.end(), s.begin(), ::toupper);
+}
+
+void String::toLowerCase() {
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+}
+
+void String::trim() {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    size_t end = s.find_last_not_of(" \t\r\n");
+    s = start == std::string::npos ? "" : s.substr(start, end - start + 1);
+}
+
+static bool line_start = true;
+
+size_t HardwareSerial::print(const String &str) {
+    World &w = World::get();
+    if (! w.verbose) {
+        return str.length();
+    }
+    if (line_start) {
+        Node *n = w.current();
+        printf("%11.6f %-8s ", w.now() / 1000000.0, n ? n->name.c_str() : "-");
+        line_start = false;
+    }
+    fputs(str.c_str(), stdout);
+    return str.length();
+}
+
+size_t HardwareSerial::println(const String &str) {
+    size_t len = print(str);
+    if (World::get().verbose) {
+        fputs("\n", stdout);
+    }
+    line_start = true;
+    return len + 1;
+}
+
+//MD5 (RFC 1321)
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+void MD5Builder::begin() {
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+    count = 0;
+}
+
+void MD5Builder::transform(const uint8_t *block) {
+    World::get().consume(World::get().params.md5_cost);
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f, g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        uint32_t x = a + f + md5_k[i] + m[g];
+        b = b + ((x << md5_r[i]) | (x >> (32 - md5_r[i])));
+        a = tmp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void MD5Builder::add(const uint8_t *data, uint16_t len) {
+    size_t used = count % 64;
+    count += len;
+    while (len) {
+        size_t n = std::min((size_t)len, 64 - used);
+        memcpy(buffer + used, data, n);
+        used += n;
+        data += n;
+        len -= n;
+        if (used == 64) {
+            transform(buffer);
+            used = 0;
+        }
+    }
+}
+
+void MD5Builder::calculate() {
+    uint64_t bits = count * 8;
+    uint8_t pad = 0x80;
+    add(&pad, 1);
+    pad = 0;
+    while (count % 64 != 56) {
+        add(&pad, 1);
+    }
+    uint8_t len[8];
+    for (int i = 0; i < 8; i++) {
+        len[i] = bits >> (8 * i);
+    }
+    add(len, 8);
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            digest[i * 4 + j] = state[i] >> (8 * j);
+        }
+    }
+}
+
+void MD5Builder::getBytes(uint8_t *output) {
+    memcpy(output, digest, 16);
+}
+
+void MD5Builder::getChars(char *output) {
+    for (int i = 0; i < 16; i++) {
+        sprintf(output + i * 2, "%02x", digest[i]);
+    }
+}
+
+String MD5Builder::toString() {
+    char out[33];
+    getChars(out);
+    return String(out);
+}
+
+uint32_t EspClass::getChipId() {
+    return World::get().current()->chip_id;
+}
+
+uint32_t EspClass::getFlashChipSize() {
+    return World::get().params.flash_size;
+}
+
+uint32_t EspClass::getSketchSize() {
+    return World::get().params.sketch_size;
+}
+
+uint32_t EspClass::getFreeSketchSpace() {
+    sim::Params &p = World::get().params;
+    uint32_t freeSpaceStart = (p.sketch_size + FLASH_SECTOR_SIZE - 1) & (~(FLASH_SECTOR_SIZE - 1));
+    return p.spiffs_start - freeSpaceStart;
+}
+
+uint32_t EspClass::getFreeHeap() {
+    return World::get().params.heap_size;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector) {
+    World &w = World::get();
+    Node *n = w.current();
+    uint32_t addr = sector * FLASH_SECTOR_SIZE;
+    if (addr + FLASH_SECTOR_SIZE > w.params.flash_size) {
+        return false;
+    }
+    memset(n->flash_data() + addr, 0xff, FLASH_SECTOR_SIZE);
+    w.consume(w.params.flash_erase_cost);
+    n->stats.flash_erases++;
+    return true;
+}
+
+bool EspClass::flashWrite(uint32_t offset, uint32_t *data, size_t size) {
+    World &w = World::get();
+    Node *n = w.current();
+    //spi_flash_write() requires a word aligned address and length
+    if ((offset & 3) || (size & 3) || offset + size > w.params.flash_size) {
+        return false;
+    }
+    uint8_t *flash = n->flash_data() + offset;
+    const uint8_t *src = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++) {
+        //NOR flash can only clear bits
+        flash[i] &= src[i];
+    }
+    w.consume(size * w.params.flash_write_cost);
+    n->stats.flash_writes++;
+    return true;
+}
+
+bool EspClass::flashRead(uint32_t offset, uint32_t *data, size_t size) {
+    World &w = World::get();
+    Node *n = w.current();
+    if ((offset & 3) || (size & 3) || offset + size > w.params.flash_size) {
+        return false;
+    }
+    memcpy(data, n->flash_data() + offset, size);
+    w.consume(size / 32 * w.params.flash_read_cost);
+    return true;
+}
+
+void EspClass::restart() {
+    throw sim::Restart();
+}
+
+int eboot_command_write(struct eboot_command *cmd) {
+    Node *n = World::get().current();
+    n->eboot = *cmd;
+    n->eboot_pending = true;
+    return 0;
+}
+
+void eboot_command_clear() {
+    World::get().current()->eboot_pending = false;
+}
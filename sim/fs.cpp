@@ -0,0 +1,254 @@
+// Simulated SPIFFS.  Files live in the node's 'files' map.  SPIFFS has no directory
+// index, so every lookup is charged a base cost plus a per-file scan cost
+#include "sim.h"
+
+using sim::World;
+using sim::Node;
+
+FS SPIFFS;
+
+#define SPIFFS_OBJ_NAME_LEN 32
+
+static Node *node() {
+    return World::get().current();
+}
+
+static void lookup_cost(Node *n) {
+    World &w = World::get();
+    w.consume(w.params.fs_op_cost + n->files.size() * w.params.fs_file_cost);
+    n->stats.fs_ops++;
+}
+
+bool FS::begin() {
+    Node *n = node();
+    lookup_cost(n);
+    n->fs_mounted = true;
+    return true;
+}
+
+void FS::end() {
+    node()->fs_mounted = false;
+}
+
+bool FS::format() {
+    Node *n = node();
+    n->files.clear();
+    World::get().consume(1000000);
+    return true;
+}
+
+bool FS::info(FSInfo &info) {
+    Node *n = node();
+    size_t used = 0;
+    for (auto &it : n->files) {
+        used += ((it.second.size() + 255) / 256 + 1) * 256;
+    }
+    World &w = World::get();
+    info.totalBytes = w.params.flash_size - w.params.spiffs_start - 0x5000;
+    info.usedBytes = used;
+    info.blockSize = 4096;
+    info.pageSize = 256;
+    info.maxOpenFiles = 5;
+    info.maxPathLength = SPIFFS_OBJ_NAME_LEN;
+    return true;
+}
+
+File FS::open(const char *path, const char *mode) {
+    Node *n = node();
+    if (! n->fs_mounted || strlen(path) >= SPIFFS_OBJ_NAME_LEN) {
+        return File();
+    }
+    lookup_cost(n);
+    auto it = n->files.find(path);
+    if (mode[0] == 'r') {
+        if (it == n->files.end()) {
+            return File();
+        }
+        return File(n, String(path), mode[1] == '+');
+    }
+    if (mode[0] == 'w') {
+        n->files[path].clear();
+        return File(n, String(path), true);
+    }
+    if (mode[0] == 'a') {
+        File f(n, String(path), true);
+        n->files[path];
+        f.seek(0, SeekEnd);
+        return f;
+    }
+    return File();
+}
+
+bool FS::exists(const char *path) {
+    Node *n = node();
+    if (! n->fs_mounted) {
+        return false;
+    }
+    lookup_cost(n);
+    return n->files.count(path) != 0;
+}
+
+Dir FS::openDir(const char *path) {
+    Node *n = node();
+    lookup_cost(n);
+    return Dir(n, String(path));
+}
+
+bool FS::remove(const char *path) {
+    Node *n = node();
+    lookup_cost(n);
+    World &w = World::get();
+    w.consume(w.params.fs_write_cost);
+    n->stats.fs_writes++;
+    return n->files.erase(path) != 0;
+}
+
+bool FS::rename(const char *pathFrom, const char *pathTo) {
+    Node *n = node();
+    lookup_cost(n);
+    auto it = n->files.find(pathFrom);
+    if (it == n->files.end() || n->files.count(pathTo) || strlen(pathTo) >= SPIFFS_OBJ_NAME_LEN) {
+        return false;
+    }
+    World &w = World::get();
+    w.consume(w.params.fs_write_cost);
+    n->stats.fs_writes++;
+    n->files[pathTo] = it->second;
+    n->files.erase(pathFrom);
+    return true;
+}
+
+std::string *File::data() const {
+    if (! _node) {
+        return NULL;
+    }
+    auto it = _node->files.find(_path.c_str());
+    return it == _node->files.end() ? NULL : &it->second;
+}
+
+size_t File::write(const uint8_t *buf, size_t size) {
+    std::string *d = data();
+    if (! d || ! _write) {
+        return 0;
+    }
+    if (_pos > d->size()) {
+        _pos = d->size();
+    }
+    d->replace(_pos, std::min(size, d->size() - _pos), (const char *)buf, size);
+    _pos += size;
+    return size;
+}
+
+int File::available() {
+    std::string *d = data();
+    return d && _pos < d->size() ? d->size() - _pos : 0;
+}
+
+int File::read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int File::peek() {
+    std::string *d = data();
+    return d && _pos < d->size() ? (uint8_t)(*d)[_pos] : -1;
+}
+
+size_t File::read(uint8_t *buf, size_t size) {
+    std::string *d = data();
+    if (! d || _pos >= d->size()) {
+        return 0;
+    }
+    size_t len = std::min(size, d->size() - _pos);
+    memcpy(buf, d->data() + _pos, len);
+    _pos += len;
+    return len;
+}
+
+size_t File::readBytesUntil(char terminator, char *buf, size_t size) {
+    size_t len = 0;
+    while (len < size) {
+        int c = read();
+        if (c < 0 || c == terminator) {
+            break;
+        }
+        buf[len++] = c;
+    }
+    return len;
+}
+
+String File::readStringUntil(char terminator) {
+    String s;
+    int c;
+    while ((c = read()) >= 0 && c != terminator) {
+        s += (char)c;
+    }
+    return s;
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+    std::string *d = data();
+    if (! d) {
+        return false;
+    }
+    size_t base = mode == SeekSet ? 0 : mode == SeekCur ? _pos : d->size();
+    if (base + pos > d->size()) {
+        return false;
+    }
+    _pos = base + pos;
+    return true;
+}
+
+size_t File::size() const {
+    std::string *d = data();
+    return d ? d->size() : 0;
+}
+
+void File::close() {
+    if (_node && _write) {
+        World &w = World::get();
+        w.consume(w.params.fs_write_cost);
+        _node->stats.fs_writes++;
+    }
+    _node = NULL;
+}
+
+bool Dir::next() {
+    if (! _node) {
+        return false;
+    }
+    World &w = World::get();
+    w.consume(w.params.fs_file_cost);
+    const std::string prefix(_prefix.c_str());
+    auto it = _started ? _node->files.upper_bound(_current.c_str()) : _node->files.lower_bound(prefix);
+    _started = true;
+    if (it == _node->files.end() || it->first.compare(0, prefix.size(), prefix) != 0) {
+        _node = NULL;
+        return false;
+    }
+    _current = String(it->first);
+    return true;
+}
+
+String Dir::fileName() {
+    return _current;
+}
+
+size_t Dir::fileSize() {
+    if (! _node) {
+        return 0;
+    }
+    auto it = _node->files.find(_current.c_str());
+    return it == _node->files.end() ? 0 : it->second.size();
+}
+
+//SPIFFS opens the entry the directory walk is on by its object id, without scanning for the name
+File Dir::openFile(const char *mode) {
+    if (! _node || mode[0] != 'r') {
+        return SPIFFS.open(_current, mode);
+    }
+    World &w = World::get();
+    w.consume(w.params.fs_op_cost);
+    _node->stats.fs_ops++;
+    return File(_node, _current, mode[1] == '+');
+}
@@ -0,0 +1,272 @@
+// Compression benchmark for mesh payloads (see MeshLZ.h and ESP8266_COMPRESS_MIN).
+//
+// A simulated mesh runs the message patterns of the example sketches: every node publishes the
+// sensor sketch's status JSON, and the broker has the nodes send, save, read and list IR codes
+// like the IR remote sketch.  Every frame on the mesh links is captured, including the library's
+// own traffic, and its payload compressed the way the mesh would.  --image adds a firmware image
+// cut into OTA chunks.  Reports, per kind of message, the bytes saved and the host CPU time to
+// compress and decompress, and fails if any payload does not survive the round trip
+#include "scenario.h"
+#include "ESP8266MQTTMesh.h"
+#include "MeshLZ.h"
+#include "Base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+using namespace sim;
+
+struct Kind {
+    int msgs = 0;
+    int tried = 0;            //Messages long enough to compress
+    int packed = 0;           //Messages sent compressed
+    uint64_t bytes = 0;
+    uint64_t sent = 0;        //Bytes as the mesh would send them
+    double compress_ns = 0;   //Host CPU for the messages tried
+    double decompress_ns = 0; //and for those sent compressed
+};
+
+//A Pronto code for an NEC remote: 32 bits, then a repeat frame.  Learned codes jitter by a tick
+static std::string nec_pronto(uint32_t code, bool learned) {
+    std::string s = "0000 006D 0022 0002 0157 00AC";
+    char w[8];
+    for (int i = 0; i < 32; i++) {
+        int jitter = learned ? rand() % 3 - 1 : 0;
+        snprintf(w, sizeof(w), " %04X", 0x15 + jitter);
+        s += w;
+        snprintf(w, sizeof(w), " %04X", ((code >> (31 - i)) & 1 ? 0x41 : 0x16) + (learned ? rand() % 3 - 1 : 0));
+        s += w;
+    }
+    return s + " 0015 0689 0157 0056 0015 0E94";
+}
+
+//An air conditioner code: two 48 bit frames, about 1kB of text
+static std::string ac_pronto() {
+    std::string s = "0000 006D 0066 0000";
+    char w[8];
+    for (int f = 0; f < 2; f++) {
+        s += " 0080 0040";
+        for (int i = 0; i < 48; i++) {
+            snprintf(w, sizeof(w), " %04X", 0x10 + rand() % 3 - 1);
+            s += w;
+            snprintf(w, sizeof(w), " %04X", (rand() & 1 ? 0x30 : 0x10) + rand() % 3 - 1);
+            s += w;
+        }
+        s += f ? " 0010 0ACE" : " 0010 0180";
+    }
+    return s;
+}
+
+static std::string kind_of(const std::string &topic) {
+    if (topic.find(MESHMAP_SYNC_TOPIC) != std::string::npos) {
+        return "mesh map";
+    }
+    if (topic.find("/mesh_cmd") != std::string::npos || topic.find(MESH_REJOIN_TOPIC) != std::string::npos) {
+        return "mesh_cmd";
+    }
+    if (topic.find("/status") != std::string::npos) {
+        return "sensor json";
+    }
+    if (topic.find("/send") != std::string::npos || topic.find("/save/") != std::string::npos) {
+        return "ir code";
+    }
+    if (topic.find("/read/") != std::string::npos) {
+        return "ir read json";
+    }
+    if (topic.find("/list") != std::string::npos) {
+        return "ir list json";
+    }
+    return "other";
+}
+
+int main(int argc, char **argv) {
+    Scenario s;
+    s.topology = "tree";
+    s.nodes = 12;
+    std::vector<std::string> rest;
+    int min = 128;
+    std::string image;
+    bool ok = parse_args(s, argc, argv, rest);
+    for (size_t i = 0; ok && i < rest.size(); i++) {
+        bool has_val = i + 1 < rest.size();
+        if (rest[i] == "--min" && has_val) {
+            min = atoi(rest[++i].c_str());
+        } else if (rest[i] == "--image" && has_val) {
+            image = rest[++i];
+        } else {
+            ok = false;
+        }
+    }
+    if (! ok || min < 4) {
+        usage(argv[0]);
+        printf("  --min B                       Compress payloads of at least B bytes (default 128)\n");
+        printf("  --image FILE                  Also compress FILE as 768 byte OTA chunks, raw and base64\n");
+        return 2;
+    }
+    World &w = World::get();
+    build(s);
+
+    //Reassemble the frames on each link, resolving topic aliases as the receiver would
+    std::map<std::string, std::vector<std::string>> captured;
+    std::map<uint32_t, std::string> stream;
+    std::map<uint32_t, std::map<int, std::string>> aliases;
+    w.tcp_tap = [&] (uint32_t client, const std::string &data) {
+        std::string &buf = stream[client];
+        buf += data;
+        while (buf.size() >= MESH_FRAME_HEADER_LEN) {
+            const uint8_t *h = (const uint8_t *)buf.data();
+            size_t topic_len = h[3], payload_len = h[4] | (h[5] << 8);
+            size_t size = MESH_FRAME_HEADER_LEN + topic_len + 1 + payload_len + 1 + (h[2] & MESH_FLAG_ID ? 2 : 0);
+            if (buf.size() < size) {
+                break;
+            }
+            std::string topic = buf.substr(MESH_FRAME_HEADER_LEN, topic_len);
+            if (h[2] & MESH_FLAG_ALIAS) {
+                int alias = (uint8_t)topic[0];
+                if (topic_len > 1) {
+                    aliases[client][alias] = topic.substr(1);
+                }
+                topic = aliases[client][alias];
+            }
+            if (! (h[2] & MESH_FLAG_ACK) && payload_len) {
+                captured[kind_of(topic)].push_back(buf.substr(MESH_FRAME_HEADER_LEN + topic_len + 1, payload_len));
+            }
+            buf.erase(0, size);
+        }
+    };
+
+    //The sketches: a status report every second, and answers to 'list' and 'read/<file>'
+    srand(s.seed);
+    std::vector<std::string> codes;
+    for (int i = 0; i < 8; i++) {
+        codes.push_back(nec_pronto(0x20DF0000 | (rand() & 0xffff), i & 1));
+    }
+    codes.push_back(ac_pronto());
+    std::string list = "{ \"Commands\": {";
+    const char *names[] = { "tv_power", "tv_vol_up", "tv_vol_down", "tv_mute", "amp_power", "amp_input_1",
+                            "amp_input_2", "ac_cool_22", "ac_off", "fan_speed", "projector_on", "screen_down" };
+    for (int i = 0; i < 12; i++) {
+        list += std::string(i ? "," : "") + " \"" + names[i] + "\": " + std::to_string(300 + rand() % 700);
+    }
+    list += " }, \"Free\": 2871234}";
+    for (Node *n : w.nodes) {
+        n->on_message = [n, &codes, &list] (const char *topic, const char *msg) {
+            if (strcmp(topic, "list") == 0) {
+                n->mesh->publish("list", list.c_str());
+            } else if (strstr(topic, "read/") == topic) {
+                std::string json = "{ \"protocol\": \"pronto\" \"code\": \"" + codes[atoi(topic + 5) % codes.size()] +
+                                   "\" \"repeat\": \"3\" }";
+                n->mesh->publish(topic, json.c_str());
+            }
+        };
+    }
+    power_on_all();
+    std::vector<double> join_time;
+    if (! wait_joined(s, join_time)) {
+        printf("FAIL: not all nodes joined within %.0f seconds\n", s.time);
+        return 1;
+    }
+    usec_t start = w.now();
+    for (int t = 0; t < 20; t++) {
+        for (Node *n : w.nodes) {
+            w.at(start + t * 1000000 + n->id * 1000, n, [n, t] () {
+                char json[200];
+                snprintf(json, sizeof(json), "{ \"relay\":\"%s\", \"mesh_ms\":%d, \"temp\":%.2f, \"power\":%.3f, "
+                         "\"current\":%.3f, \"voltage\":%.3f, \"pf\":%.3f, \"energy\":%.3f}",
+                         t & 1 ? "ON" : "OFF", rand() % 40, 20 + rand() % 500 / 100.0, rand() % 200000 / 100.0,
+                         rand() % 9000 / 1000.0, 228 + rand() % 5000 / 1000.0, 90 + rand() % 1000 / 100.0, t * 0.137);
+                n->mesh->publish("status", json);
+            });
+        }
+        Node *n = w.nodes[t % w.nodes.size()];
+        std::string in = "esp8266-in/" + topic_name(n);
+        const std::string &code = codes[t % codes.size()];
+        w.broker.publish(in + "send", "repeat=" + std::to_string(t % 4) + ",code=" + code);
+        w.broker.publish(in + "save/code" + std::to_string(t % codes.size()), "code=" + code);
+        w.broker.publish(in + "read/" + std::to_string(t), "");
+        w.broker.publish(in + "list", "");
+        w.run_until(start + (t + 1) * 1000000);
+    }
+    w.run_until(w.now() + 2000000);
+    w.tcp_tap = nullptr;
+
+    if (! image.empty()) {
+        FILE *f = fopen(image.c_str(), "rb");
+        if (! f) {
+            printf("FAIL: can't read %s\n", image.c_str());
+            return 1;
+        }
+        char chunk[768], b64[1100];
+        size_t len;
+        while ((len = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            captured["ota raw"].push_back(std::string(chunk, len));
+            int b64len = base64_encode(b64, chunk, len);
+            captured["ota base64"].push_back(std::string(b64, b64len));
+        }
+        fclose(f);
+    }
+
+    //Compress each payload the way the mesh does, time it, and check it comes back
+    printf("%-13s %6s %8s %9s %8s %7s %10s %10s %9s\n", "kind", "msgs", "avg(B)", "compressed", "bytes", "saved",
+           "comp(us)", "decomp(us)", "comp MB/s");
+    const int reps = 20;
+    char packed[MQTT_MAX_PACKET_SIZE], unpacked[MQTT_MAX_PACKET_SIZE];
+    Kind total;
+    bool roundtrip = true;
+    for (auto &it : captured) {
+        Kind k;
+        uint64_t considered = 0;
+        for (const std::string &p : it.second) {
+            k.msgs++;
+            k.bytes += p.size();
+            if ((int)p.size() < min || p.size() >= MQTT_MAX_PACKET_SIZE) {
+                k.sent += p.size();
+                continue;
+            }
+            considered += p.size();
+            k.tried++;
+            size_t len = 0;
+            auto t0 = std::chrono::steady_clock::now();
+            for (int r = 0; r < reps; r++) {
+                len = lz_compress((const uint8_t *)p.data(), p.size(), (uint8_t *)packed, p.size() - 3);
+            }
+            auto t1 = std::chrono::steady_clock::now();
+            k.compress_ns += std::chrono::duration<double, std::nano>(t1 - t0).count() / reps;
+            if (! len) {
+                k.sent += p.size();
+                continue;
+            }
+            size_t out = 0;
+            t0 = std::chrono::steady_clock::now();
+            for (int r = 0; r < reps; r++) {
+                out = lz_decompress((const uint8_t *)packed, len, (uint8_t *)unpacked, sizeof(unpacked));
+            }
+            t1 = std::chrono::steady_clock::now();
+            k.decompress_ns += std::chrono::duration<double, std::nano>(t1 - t0).count() / reps;
+            if (out != p.size() || memcmp(unpacked, p.data(), out) != 0) {
+                printf("FAIL: %s payload of %zu bytes did not survive the round trip\n", it.first.c_str(), p.size());
+                roundtrip = false;
+            }
+            k.packed++;
+            k.sent += len + 2;
+        }
+        printf("%-13s %6d %8.0f %9d %8llu %6.1f%% %10.2f %10.2f %9.1f\n", it.first.c_str(), k.msgs,
+               (double)k.bytes / k.msgs, k.packed, (unsigned long long)k.sent, 100.0 * (k.bytes - k.sent) / k.bytes,
+               k.compress_ns / 1000 / (k.tried ? k.tried : 1), k.decompress_ns / 1000 / (k.packed ? k.packed : 1),
+               considered ? considered / (k.compress_ns / 1000) : 0.0);
+        if (it.first.compare(0, 4, "ota ") != 0) {
+            total.msgs += k.msgs;
+            total.bytes += k.bytes;
+            total.sent += k.sent;
+        }
+    }
+    printf("mesh traffic: %llu payload bytes in %d messages, %llu as sent with --min %d (%.1f%% saved)\n",
+           (unsigned long long)total.bytes, total.msgs, (unsigned long long)total.sent, min,
+           100.0 * (total.bytes - total.sent) / total.bytes);
+    if (! roundtrip) {
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
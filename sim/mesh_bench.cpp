@@ -0,0 +1,281 @@
+// Throughput and latency benchmark for the simulated mesh.
+//
+// For each depth 1..N one node at that depth is picked.  Upstream, the node calls
+// publish() at the offered rate and arrival times are taken at the broker.  Downstream,
+// the broker publishes to the node's inTopic and arrival is taken at the node's callback.
+// Every run reports delivered messages/second, p50/p99 latency, bytes on the air per hop
+// along the path, and host CPU spent per message by the nodes along the path
+#include "scenario.h"
+#include "ESP8266MQTTMesh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+
+using namespace sim;
+
+struct Result {
+    const char *dir;
+    double offered;
+    int depth;
+    int sent;
+    int delivered;
+    double rate;
+    double p50_ms, p99_ms;
+    double bytes_per_hop;
+    double air_bytes;         //All links, per delivered message (includes flooding)
+    double cpu_us;            //Host CPU of the nodes on the path, per delivered message
+};
+
+struct Bench {
+    int count = 200;          //Messages per run
+    double rate = 100;        //Offered messages/second
+    int size = 32;            //Payload bytes
+    bool sweep = false;       //Double the rate until messages are lost or latency explodes
+    bool csv = false;
+};
+
+static std::vector<Node *> path_to_router(Node *n) {
+    std::vector<Node *> path;
+    World &w = World::get();
+    for (; n; n = w.parent(n)) {
+        path.push_back(n);
+    }
+    return path;
+}
+
+static std::string make_payload(int seq, int size) {
+    std::string p = std::to_string(seq) + ":";
+    while ((int)p.size() < size) {
+        p += (char)('a' + p.size() % 26);
+    }
+    return p;
+}
+
+static double percentile(std::vector<usec_t> &v, double pct) {
+    if (v.empty()) {
+        return -1;
+    }
+    std::sort(v.begin(), v.end());
+    size_t idx = std::min(v.size() - 1, (size_t)(pct / 100.0 * v.size()));
+    return v[idx] / 1000.0;
+}
+
+static Result summarize(const char *dir, Node *n, const Bench &b, std::map<int, usec_t> &sent,
+                        std::vector<usec_t> &latency, usec_t first, usec_t last) {
+    World &w = World::get();
+    std::vector<Node *> path = path_to_router(n);
+    Result r;
+    r.dir = dir;
+    r.offered = b.rate;
+    r.depth = path.size();
+    r.sent = b.count;
+    r.delivered = latency.size();
+    r.rate = last > first ? r.delivered * 1000000.0 / (last - first) : 0;
+    r.p50_ms = percentile(latency, 50);
+    r.p99_ms = percentile(latency, 99);
+
+    uint64_t path_bytes = 0, air_bytes = 0, cpu_ns = 0;
+    for (size_t i = 0; i < path.size(); i++) {
+        int a = path[i]->id;
+        int up = i + 1 < path.size() ? path[i + 1]->id : w.link_id(path[i]->sta_ap);
+        for (auto &it : w.link_stats()) {
+            if ((it.first.first == a && it.first.second == up) || (it.first.first == up && it.first.second == a)) {
+                path_bytes += it.second.bytes;
+            }
+        }
+        cpu_ns += path[i]->stats.cpu_ns;
+    }
+    for (auto &it : w.link_stats()) {
+        air_bytes += it.second.bytes;
+    }
+    double d = r.delivered ? r.delivered : 1;
+    r.bytes_per_hop = path_bytes / d / path.size();
+    r.air_bytes = air_bytes / d;
+    r.cpu_us = cpu_ns / 1000.0 / d;
+    return r;
+}
+
+static Result run_upstream(Node *n, const Bench &b) {
+    World &w = World::get();
+    std::map<int, usec_t> sent;
+    std::vector<usec_t> latency;
+    usec_t last = 0;
+    std::string topic = "esp8266-out/" + topic_name(n) + "bench";
+    int observer = w.broker.observe(topic, [&] (const std::string &t, const std::string &payload) {
+        auto it = sent.find(atoi(payload.c_str()));
+        if (it != sent.end()) {
+            latency.push_back(w.now() - it->second);
+            last = w.now();
+            sent.erase(it);
+        }
+    });
+    w.reset_stats();
+    usec_t start = w.now() + 100000;
+    usec_t interval = (usec_t)(1000000 / b.rate);
+    for (int i = 0; i < b.count; i++) {
+        w.at(start + i * interval, n, [&sent, n, i, &b] () {
+            World &w = World::get();
+            std::string payload = make_payload(i, b.size);
+            sent[i] = w.now();
+            if (n->mesh) {
+                n->mesh->publish("bench", payload.c_str());
+            }
+        });
+    }
+    w.run_until(start + b.count * interval + 5000000);
+    w.broker.unobserve(observer);
+    return summarize("up", n, b, sent, latency, start, last);
+}
+
+static Result run_downstream(Node *n, const Bench &b) {
+    World &w = World::get();
+    std::map<int, usec_t> sent;
+    std::vector<usec_t> latency;
+    usec_t last = 0;
+    n->on_message = [&] (const char *topic, const char *msg) {
+        auto it = sent.find(atoi(msg));
+        if (it != sent.end() && strcmp(topic, "bench") == 0) {
+            latency.push_back(w.now() - it->second);
+            last = w.now();
+            sent.erase(it);
+        }
+    };
+    w.reset_stats();
+    std::string topic = "esp8266-in/" + topic_name(n) + "bench";
+    usec_t start = w.now() + 100000;
+    usec_t interval = (usec_t)(1000000 / b.rate);
+    for (int i = 0; i < b.count; i++) {
+        w.at(start + i * interval, NULL, [&sent, topic, i, &b] () {
+            World &w = World::get();
+            sent[i] = w.now();
+            w.broker.publish(topic, make_payload(i, b.size));
+        });
+    }
+    w.run_until(start + b.count * interval + 5000000);
+    n->on_message = NULL;
+    return summarize("down", n, b, sent, latency, start, last);
+}
+
+//Each run starts from the same joined mesh: the run executes in a forked copy of the
+//process, so a saturated run cannot leave queued or corrupted data behind for the next
+static Result run_isolated(bool upstream, Node *n, const Bench &b) {
+    Result r;
+    memset(&r, 0, sizeof(r));
+    int fds[2];
+    fflush(stdout);
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        r = upstream ? run_upstream(n, b) : run_downstream(n, b);
+        ssize_t len = write(fds[1], &r, sizeof(r));
+        _exit(len == sizeof(r) ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0 || read(fds[0], &r, sizeof(r)) != sizeof(r)) {
+        fprintf(stderr, "benchmark run failed\n");
+        exit(1);
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return r;
+}
+
+static void print(const Result &r, bool csv) {
+    if (csv) {
+        printf("%s,%d,%.0f,%d,%d,%.1f,%.3f,%.3f,%.1f,%.1f,%.2f\n", r.dir, r.depth, r.offered, r.sent, r.delivered, r.rate,
+               r.p50_ms, r.p99_ms, r.bytes_per_hop, r.air_bytes, r.cpu_us);
+    } else {
+        printf("%-5s %5d %8.0f %6d/%-6d %9.1f %9.3f %9.3f %10.1f %10.1f %9.2f\n", r.dir, r.depth, r.offered, r.delivered, r.sent,
+               r.rate, r.p50_ms, r.p99_ms, r.bytes_per_hop, r.air_bytes, r.cpu_us);
+    }
+}
+
+int main(int argc, char **argv) {
+    Scenario s;
+    Bench b;
+    std::vector<std::string> rest;
+    bool ok = parse_args(s, argc, argv, rest);
+    for (size_t i = 0; ok && i < rest.size(); i++) {
+        bool has_val = i + 1 < rest.size();
+        if (rest[i] == "--count" && has_val) {
+            b.count = atoi(rest[++i].c_str());
+        } else if (rest[i] == "--rate" && has_val) {
+            b.rate = atof(rest[++i].c_str());
+        } else if (rest[i] == "--size" && has_val) {
+            b.size = atoi(rest[++i].c_str());
+        } else if (rest[i] == "--sweep") {
+            b.sweep = true;
+        } else if (rest[i] == "--csv") {
+            b.csv = true;
+        } else {
+            ok = false;
+        }
+    }
+    if (! ok || b.count < 1 || b.rate <= 0 || b.size < 8 || b.size > 900) {
+        usage(argv[0]);
+        printf("  --count N                     Messages per run (default 200)\n");
+        printf("  --rate R                      Offered messages/second (default 100)\n");
+        printf("  --size B                      Payload bytes, 8..900 (default 32)\n");
+        printf("  --sweep                       Double the rate from --rate until the path saturates\n");
+        printf("  --csv                         Machine readable output\n");
+        return 2;
+    }
+    World &w = World::get();
+    build(s);
+    power_on_all();
+    std::vector<double> join_time;
+    if (! wait_joined(s, join_time)) {
+        printf("FAIL: not all nodes joined within %.0f seconds\n", s.time);
+        return 1;
+    }
+    w.run_until(w.now() + 2000000);
+
+    //One node per depth, lowest id first
+    std::map<int, Node *> by_depth;
+    for (Node *n : w.nodes) {
+        int d = w.depth(n);
+        if (d > 0 && ! by_depth.count(d)) {
+            by_depth[d] = n;
+        }
+    }
+    if (b.csv) {
+        printf("dir,depth,offered,sent,delivered,msgs_per_s,p50_ms,p99_ms,bytes_per_hop,air_bytes_per_msg,cpu_us_per_msg\n");
+    } else {
+        printf("%s, %d nodes, %d msgs of %d bytes per run\n", s.topology.c_str(), s.nodes, b.count, b.size);
+        printf("%-5s %5s %8s %13s %9s %9s %9s %10s %10s %9s\n", "dir", "depth", "offered", "delivered", "msg/s",
+               "p50(ms)", "p99(ms)", "bytes/hop", "air B/msg", "cpu us");
+    }
+    //In sweep mode a run counts as saturated once messages are lost or p99 latency
+    //exceeds 10x the unloaded p50
+    bool lost = false;
+    for (int dir = 0; dir < 2; dir++) {
+        for (auto &it : by_depth) {
+            Bench run = b;
+            double base_p50 = -1;
+            while (1) {
+                Result r = run_isolated(dir == 0, it.second, run);
+                print(r, b.csv);
+                if (base_p50 < 0) {
+                    base_p50 = r.p50_ms;
+                }
+                bool saturated = r.delivered != r.sent || r.p99_ms > 10 * base_p50;
+                if (! b.sweep) {
+                    lost = lost || saturated;
+                    break;
+                }
+                if (saturated || run.rate >= 12800) {
+                    break;
+                }
+                run.rate *= 2;
+            }
+        }
+    }
+    return lost ? 1 : 0;
+}
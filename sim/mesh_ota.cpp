@@ -0,0 +1,311 @@
+// Over-the-air update of the simulated mesh, driven the same way as utils/send_ota.py.
+//
+// A random firmware image is sent to every node by firmware ID: 'start', the image in
+// 768-byte binary chunks (--chunk, base64 with --base64), then 'check' and 'flash'.  By default chunks go out in windows; after each
+// window the nodes are asked which chunks they are 'missing', those are resent and the window
+// grows or shrinks with the loss.  --interval sends every chunk once at a fixed pace instead.
+// With --targets only some nodes run the firmware being updated.  The run passes once every
+// target reports 'MD5 Passed' and, after rebooting, has the image copied to the start of flash,
+// and no other node has rebooted
+#include "scenario.h"
+#include "ESP8266MQTTMesh.h"
+#include "Base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+#include <algorithm>
+#include <deque>
+
+using namespace sim;
+
+struct Ota {
+    int size = 200000;        //Firmware bytes
+    int chunk = 768;
+    double interval = 0;      //Seconds between chunks, 0 to pace from the 'missing' replies
+    double loss = 0;          //Fraction of chunks the sender drops
+    double settle = 0;        //Seconds to wait after 'start' before sending data
+    bool reorder = false;     //Send the chunks in random order
+    bool base64 = false;      //Encode the chunks as text like older senders
+    int targets = 0;          //Nodes running the firmware being updated, 0 for all
+};
+
+static std::string md5_base64(const std::string &data) {
+    MD5Builder md5;
+    md5.begin();
+    //MD5Builder::add() takes at most 64k at a time
+    for (size_t pos = 0; pos < data.size(); pos += 0x8000) {
+        md5.add((uint8_t *)data.data() + pos, std::min(data.size() - pos, (size_t)0x8000));
+    }
+    md5.calculate();
+    uint8_t digest[16];
+    md5.getBytes(digest);
+    char out[32];
+    out[base64_encode(out, (const char *)digest, 16)] = 0;
+    return out;
+}
+
+int main(int argc, char **argv) {
+    Scenario s;
+    Ota o;
+    std::vector<std::string> rest;
+    bool ok = parse_args(s, argc, argv, rest);
+    for (size_t i = 0; ok && i < rest.size(); i++) {
+        bool has_val = i + 1 < rest.size();
+        if (rest[i] == "--fw-size" && has_val) {
+            o.size = atoi(rest[++i].c_str());
+        } else if (rest[i] == "--chunk" && has_val) {
+            o.chunk = atoi(rest[++i].c_str());
+        } else if (rest[i] == "--interval" && has_val) {
+            o.interval = atof(rest[++i].c_str());
+        } else if (rest[i] == "--loss" && has_val) {
+            o.loss = atof(rest[++i].c_str());
+        } else if (rest[i] == "--settle" && has_val) {
+            o.settle = atof(rest[++i].c_str());
+        } else if (rest[i] == "--reorder") {
+            o.reorder = true;
+        } else if (rest[i] == "--targets" && has_val) {
+            o.targets = atoi(rest[++i].c_str());
+        } else if (rest[i] == "--base64") {
+            o.base64 = true;
+        } else {
+            ok = false;
+        }
+    }
+    if (! ok || o.size < 1 || o.chunk < OTA_MIN_CHUNK || o.chunk > OTA_DEFAULT_CHUNK || o.interval < 0 || o.loss < 0 || o.loss >= 1 || o.targets < 0 || o.targets > s.nodes) {
+        usage(argv[0]);
+        printf("  --fw-size B                   Firmware image bytes (default 200000)\n");
+        printf("  --chunk B                     Chunk bytes, %d..%d (default %d)\n", OTA_MIN_CHUNK, OTA_DEFAULT_CHUNK,
+               OTA_DEFAULT_CHUNK);
+        printf("  --interval S                  Send each chunk once, S seconds apart (default: paced by acks)\n");
+        printf("  --loss P                      Drop a fraction P of the chunks before they reach the broker\n");
+        printf("  --settle S                    Seconds to wait after 'start' (default 0)\n");
+        printf("  --reorder                     Send the chunks in random order\n");
+        printf("  --base64                      Send base64 chunks instead of binary\n");
+        printf("  --targets N                   Only N random nodes run the firmware being updated\n");
+        return 2;
+    }
+    World &w = World::get();
+    if (o.targets) {
+        std::vector<int> ids;
+        for (int i = 0; i < s.nodes; i++) {
+            ids.push_back(i);
+        }
+        std::shuffle(ids.begin(), ids.end(), std::mt19937(s.seed));
+        s.node_firmware.assign(s.nodes, s.firmware_id + 1);
+        for (int i = 0; i < o.targets; i++) {
+            s.node_firmware[ids[i]] = s.firmware_id;
+        }
+    }
+    auto is_target = [&s] (Node *n) {
+        return s.node_firmware.empty() || s.node_firmware[n->id] == s.firmware_id;
+    };
+    size_t targets = o.targets ? o.targets : s.nodes;
+    build(s);
+    power_on_all();
+    std::vector<double> join_time;
+    if (! wait_joined(s, join_time)) {
+        printf("FAIL: not all nodes joined within %.0f seconds\n", s.time);
+        return 1;
+    }
+    w.run_until(w.now() + 2000000);
+
+    std::mt19937 rng(s.seed);
+    std::string image(o.size, 0);
+    for (char &c : image) {
+        c = rng();
+    }
+    char id[16];
+    snprintf(id, sizeof(id), "%x", s.firmware_id);
+    std::string send_topic = std::string("esp8266-in/ota/") + id + "/";
+
+    std::map<std::string, std::string> check;
+    int progress = 0;
+    w.broker.observe("esp8266-out/+/check", [&check] (const std::string &topic, const std::string &payload) {
+        check[topic] = payload;
+    });
+    w.broker.observe("esp8266-out/+/ota/progress", [&progress] (const std::string &topic, const std::string &payload) {
+        progress++;
+    });
+    w.reset_stats();
+
+    std::map<std::string, std::string> missing;
+    w.broker.observe("esp8266-out/+/ota/missing", [&missing] (const std::string &topic, const std::string &payload) {
+        missing[topic] = payload;
+    });
+    std::uniform_real_distribution<double> lose(0, 1);
+    auto send_chunk = [&] (size_t pos) {
+        std::string chunk = image.substr(pos, o.chunk);
+        if (o.base64) {
+            char b64[base64_enc_len(o.chunk) + 1];
+            chunk.assign(b64, base64_encode(b64, chunk.data(), chunk.size()));
+        }
+        if (lose(rng) >= o.loss) {
+            w.broker.publish(send_topic + std::to_string(pos), chunk);
+        }
+    };
+
+    //While the image is sent every node publishes a probe now and then, to see how much the
+    //update delays other traffic
+    std::vector<usec_t> probe_latency;
+    bool probing = true;
+    w.broker.observe("esp8266-out/+/probe", [&w, &probe_latency] (const std::string &topic, const std::string &payload) {
+        probe_latency.push_back(w.now() - strtoull(payload.c_str(), NULL, 10));
+    });
+    std::function<void(Node *)> probe = [&w, &probing, &probe] (Node *n) {
+        if (! probing) {
+            return;
+        }
+        n->mesh->publish("probe", std::to_string(w.now()).c_str());
+        w.after(250000, n, [n, &probe] () { probe(n); });
+    };
+    for (Node *n : w.nodes) {
+        w.after(n->id * 250000 / w.nodes.size(), n, [n, &probe] () { probe(n); });
+    }
+
+    usec_t start = w.now();
+    w.broker.publish(send_topic + "start", "md5:" + md5_base64(image) + ",len:" + std::to_string(image.size()) +
+                     ",chunk:" + std::to_string(o.chunk) + (o.base64 ? "" : ",raw:1"));
+    std::deque<size_t> todo;
+    for (size_t pos = 0; pos < image.size(); pos += o.chunk) {
+        todo.push_back(pos);
+    }
+    if (o.reorder) {
+        std::shuffle(todo.begin(), todo.end(), rng);
+    }
+    int sent_chunks = 0, queries = 0;
+    if (o.interval > 0) {
+        usec_t t = start + (usec_t)(o.settle * 1000000);
+        for (size_t pos : todo) {
+            w.at(t, NULL, [&send_chunk, pos] () { send_chunk(pos); });
+            t += (usec_t)(o.interval * 1000000);
+        }
+        sent_chunks = todo.size();
+        w.run_until(t);
+    } else {
+        //Same algorithm as send_ota.py: the window grows while nothing is lost and halves on loss
+        w.run_until(start + (usec_t)(o.settle * 1000000));
+        size_t window = 4, known = 0;
+        size_t end = 0;
+        while (1) {
+            std::set<size_t> burst;
+            while (! todo.empty() && burst.size() < window) {
+                size_t pos = todo.front();
+                todo.pop_front();
+                send_chunk(pos);
+                burst.insert(pos);
+                end = std::max(end, std::min(pos + o.chunk, image.size()));
+            }
+            sent_chunks += burst.size();
+            missing.clear();
+            queries++;
+            w.broker.publish(send_topic + "missing", std::to_string(end));
+            //The first query also discovers the nodes taking part
+            usec_t limit = w.now() + (known ? 2000000 : 3000000);
+            w.run_until(limit, [&missing, &known] () { return known && missing.size() >= known; }, 1000);
+            known = std::max(known, missing.size());
+            std::set<size_t> again;
+            for (auto &it : missing) {
+                const char *p = it.second.c_str();
+                while (*p && strcmp(p, "none") != 0) {
+                    char *q;
+                    size_t first = strtoul(p, &q, 10), last = first;
+                    if (*q == '-') {
+                        last = strtoul(q + 1, &q, 10);
+                    }
+                    for (size_t pos = first; pos <= last; pos += o.chunk) {
+                        again.insert(pos);
+                    }
+                    p = *q ? q + 1 : q;
+                }
+            }
+            size_t lost = 0;
+            for (size_t pos : again) {
+                lost += burst.count(pos);
+            }
+            window = lost ? std::max((size_t)1, window / 2) : std::min((size_t)64, window + 2);
+            for (auto it = again.rbegin(); it != again.rend(); ++it) {
+                if (std::find(todo.begin(), todo.end(), *it) == todo.end()) {
+                    todo.push_front(*it);
+                }
+            }
+            if (todo.empty() && again.empty() && missing.size() >= known) {
+                break;
+            }
+        }
+    }
+    usec_t sent = w.now();
+    probing = false;
+    uint64_t air_bytes = 0;
+    for (auto &it : w.link_stats()) {
+        air_bytes += it.second.bytes;
+    }
+    uint64_t busy = 0;
+    for (Node *n : w.nodes) {
+        busy += n->stats.busy_us;
+    }
+    w.broker.publish(send_topic + "check", "");
+    w.run_until(w.now() + 60000000, [&check, targets] () { return check.size() == targets; }, 10000);
+    usec_t checked = w.now();
+    for (Node *n : w.nodes) {
+        busy -= n->stats.busy_us;
+    }
+    int passed = 0;
+    for (auto &it : check) {
+        passed += it.second == "MD5 Passed";
+    }
+
+    printf("%-8s %5s %8s %8s %10s %8s\n", "node", "depth", "erases", "writes", "busy(ms)", "check");
+    for (Node *n : w.nodes) {
+        auto it = check.find("esp8266-out/" + topic_name(n) + "check");
+        printf("%-8s %5d %8llu %8llu %10.1f %8s\n", n->name.c_str(), w.depth(n), (unsigned long long)n->stats.flash_erases,
+               (unsigned long long)n->stats.flash_writes, n->stats.busy_us / 1000.0,
+               ! is_target(n) ? "-" : it == check.end() ? "none" : it->second == "MD5 Passed" ? "passed" : "failed");
+    }
+    printf("%d bytes to %zu/%zu nodes: data sent in %.2fs, all checked after %.2fs, %d progress reports\n",
+           o.size, targets, w.nodes.size(), (sent - start) / 1000000.0, (checked - start) / 1000000.0, progress);
+    printf("%d chunks sent for %zu in the image, %d 'missing' queries, %.1fkB on the air\n", sent_chunks,
+           (image.size() + o.chunk - 1) / o.chunk, queries, air_bytes / 1024.0);
+    std::sort(probe_latency.begin(), probe_latency.end());
+    if (! probe_latency.empty()) {
+        printf("other traffic during the transfer: p50 %.1fms, p99 %.1fms, max %.1fms over %zu messages\n",
+               probe_latency[probe_latency.size() / 2] / 1000.0, probe_latency[probe_latency.size() * 99 / 100] / 1000.0,
+               probe_latency.back() / 1000.0, probe_latency.size());
+    }
+        printf("check: %.1fms, %.1fms blocking per node\n", (checked - sent) / 1000.0, -(int64_t)busy / 1000.0 / w.nodes.size());
+    if (passed != (int)targets) {
+        printf("FAIL: %d/%zu nodes passed the MD5 check\n", passed, targets);
+        return 1;
+    }
+
+    usec_t flash = w.now();
+    w.broker.publish(send_topic + "flash", "");
+    w.run_until(w.now() + 10000000, [&w, &is_target] () {
+        for (Node *n : w.nodes) {
+            if (is_target(n) && ! n->stats.restarts) {
+                return false;
+            }
+        }
+        return true;
+    }, 1000);
+    printf("flash: all nodes rebooted after %.1fms\n", (w.now() - flash) / 1000.0);
+    w.run_until(w.now() + 1000000);
+    int flashed = 0, others = 0;
+    for (Node *n : w.nodes) {
+        if (is_target(n)) {
+            flashed += n->stats.restarts > 0 && memcmp(n->flash_data(), image.data(), image.size()) == 0;
+        } else {
+            others += n->stats.restarts > 0;
+        }
+    }
+    if (flashed != (int)targets) {
+        printf("FAIL: %d/%zu nodes rebooted into the new image\n", flashed, targets);
+        return 1;
+    }
+    if (others) {
+        printf("FAIL: %d nodes running other firmware rebooted\n", others);
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,211 @@
+// Bring up a simulated mesh, then check that messages flow in both directions.
+//
+// Exits non-zero if any node fails to join or a message is lost, so it can be used as a
+// smoke test for changes to the library.  With --reboot the node with the most children is
+// then power-cycled (--brownout: every node at once), the time, traffic and filesystem writes
+// until the mesh recovers are reported, and the messages are checked again
+#include "scenario.h"
+#include "ESP8266MQTTMesh.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+using namespace sim;
+
+int main(int argc, char **argv) {
+    Scenario s;
+    std::vector<std::string> rest;
+    bool reboot = false, brownout = false;
+    uint8_t outageType = MSG_TYPE_NONE;
+    bool ok = parse_args(s, argc, argv, rest);
+    for (size_t i = 0; ok && i < rest.size(); i++) {
+        if (rest[i] == "--reboot") {
+            reboot = true;
+        } else if (rest[i] == "--brownout") {
+            brownout = true;
+        } else if (rest[i] == "--qos1") {
+            outageType = MSG_TYPE_QOS_1;
+        } else {
+            ok = false;
+        }
+    }
+    if (! ok) {
+        usage(argv[0]);
+        printf("  --reboot                      Power-cycle the node with the most children, then check again\n");
+        printf("  --brownout                    Power-cycle every node at once, then check again\n");
+        printf("  --qos1                        Publish the messages sent during a reboot with QoS 1\n");
+        return 2;
+    }
+    World &w = World::get();
+    build(s);
+
+    std::set<std::string> upstream;
+    w.broker.observe("esp8266-out/#", [&upstream] (const std::string &topic, const std::string &payload) {
+        if (payload == "hello") {
+            upstream.insert(topic);
+        }
+    });
+    int downstream = 0, addressed = 0;
+    for (Node *n : w.nodes) {
+        n->on_message = [&downstream, &addressed, n] (const char *topic, const char *msg) {
+            if (strcmp(topic, "ping") == 0) {
+                downstream++;
+            } else if (strcmp(topic, "hello") == 0 && n->name == msg) {
+                addressed++;
+            }
+        };
+    }
+
+    power_on_all();
+    std::vector<double> join_time;
+    bool joined = wait_joined(s, join_time);
+
+    printf("%-8s %-18s %5s %9s %9s %8s %7s %7s\n", "node", "ap bssid", "depth", "join(s)", "cpu(ms)", "events", "fs ops", "fs wr");
+    for (Node *n : w.nodes) {
+        printf("%-8s %-18s %5d %9.3f %9.3f %8llu %7llu %7llu\n", n->name.c_str(), n->mac_string(n->ap_mac).c_str(),
+               w.depth(n), join_time[n->id], n->stats.cpu_ns / 1000000.0,
+               (unsigned long long)n->stats.events, (unsigned long long)n->stats.fs_ops,
+               (unsigned long long)n->stats.fs_writes);
+    }
+    auto print_depth = [&w] () {
+        int sum = 0, max = 0;
+        for (Node *n : w.nodes) {
+            sum += w.depth(n);
+            max = std::max(max, w.depth(n));
+        }
+        printf("depth: mean %.2f, max %d\n", (double)sum / w.nodes.size(), max);
+    };
+    print_depth();
+    if (! joined) {
+        printf("FAIL: not all nodes joined within %.0f seconds\n", s.time);
+        return 1;
+    }
+    //Give the last nodes time to bring up their APs and settle
+    w.run_until(w.now() + 2000000);
+
+    auto check = [&] () {
+        upstream.clear();
+        downstream = addressed = 0;
+        for (Node *n : w.nodes) {
+            w.call(n, [n] () { n->mesh->publish("status", "hello"); });
+        }
+        w.broker.publish("esp8266-in/broadcast/ping", "1");
+        //And one message addressed to each node, which only travels down the node's own branch
+        for (Node *n : w.nodes) {
+            w.broker.publish("esp8266-in/" + topic_name(n) + "hello", n->name);
+        }
+        w.run_until(w.now() + 5000000);
+
+        printf("upstream: %zu/%zu delivered, downstream: %d/%zu delivered, addressed: %d/%zu delivered\n",
+               upstream.size(), w.nodes.size(), downstream, w.nodes.size(), addressed, w.nodes.size());
+        return upstream.size() == w.nodes.size() && downstream == (int)w.nodes.size() && addressed == (int)w.nodes.size();
+    };
+    if (! check()) {
+        printf("FAIL: messages lost\n");
+        return 1;
+    }
+
+    if (reboot || brownout) {
+        std::vector<Node *> victims = w.nodes;
+        int most = -1;
+        if (! brownout) {
+            for (Node *n : w.nodes) {
+                int children = 0;
+                for (Node *c : w.nodes) {
+                    children += w.parent(c) == n;
+                }
+                if (children > most) {
+                    victims.assign(1, n);
+                    most = children;
+                }
+            }
+        }
+        w.reset_stats();
+        usec_t start = w.now();
+        //Nodes that have to associate again, and messages published while the mesh recovers
+        std::map<Node *, uint32_t> sta_gen;
+        for (Node *n : w.nodes) {
+            sta_gen[n] = n->sta_gen;
+        }
+        int sent = 0, received = 0, duplicates = 0;
+        std::set<std::string> seen;
+        int handle = w.broker.observe("esp8266-out/#", [&] (const std::string &topic, const std::string &payload) {
+            if (payload.compare(0, 8, "outage #") == 0) {
+                received++;
+                duplicates += ! seen.insert(topic + payload).second;
+            }
+        });
+        if (! brownout) {
+            for (int i = 0; i < 20; i++) {
+                for (Node *n : w.nodes) {
+                    if (n == victims[0]) {
+                        continue;
+                    }
+                    w.at(start + i * 500000, n, [n, i, &sent, outageType] () {
+                        sent++;
+                        n->mesh->publish("status", ("outage #" + std::to_string(i)).c_str(), outageType);
+                    });
+                }
+            }
+        }
+        for (Node *n : victims) {
+            w.power_off(n);
+        }
+        w.run_until(start + 1000000);
+        if (brownout) {
+            power_on_all();
+        } else {
+            w.power_on(victims[0]);
+        }
+        //Give the children time to notice a lost parent, then wait for the mesh to come back
+        if (! brownout) {
+            w.run_until(start + w.params.beacon_timeout + w.params.tcp_abort_delay);
+        }
+        bool rejoined = w.run_until(start + (usec_t)(s.time * 1000000), [&w] () {
+            for (Node *n : w.nodes) {
+                if (! node_connected(n)) {
+                    return false;
+                }
+            }
+            return true;
+        });
+        usec_t recovered = w.now();
+        w.run_until(std::max(w.now(), start + 10000000) + 2000000);
+        w.broker.unobserve(handle);
+        int reassociated = 0;
+        for (Node *n : w.nodes) {
+            reassociated += n->sta_gen != sta_gen[n] && std::find(victims.begin(), victims.end(), n) == victims.end();
+        }
+        uint64_t mesh_bytes = 0, fs_writes = 0;
+        for (auto &it : w.link_stats()) {
+            if (it.first.first >= 0 && it.first.second >= 0) {
+                mesh_bytes += it.second.bytes;
+            }
+        }
+        for (Node *n : w.nodes) {
+            fs_writes += n->stats.fs_writes;
+        }
+        if (brownout) {
+            printf("brownout: ");
+        } else {
+            printf("reboot of %s (%d children): ", victims[0]->name.c_str(), most);
+        }
+        printf("rejoined after %.2fs, %.1fkB on mesh links, %llu fs writes\n",
+               (recovered - start) / 1000000.0, mesh_bytes / 1024.0, (unsigned long long)fs_writes);
+        if (! brownout) {
+            printf("%d other nodes associated again, %d/%d messages sent during the outage delivered (%d twice)\n",
+                   reassociated, received - duplicates, sent, duplicates);
+        }
+        print_depth();
+        if (! rejoined) {
+            printf("FAIL: not all nodes rejoined within %.0f seconds\n", s.time);
+            return 1;
+        }
+        if (! check()) {
+            printf("FAIL: messages lost after reboot\n");
+            return 1;
+        }
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,302 @@
+// Simulated AsyncMqttClient and the MQTT broker sitting behind the routers
+#include "sim.h"
+
+#include <algorithm>
+
+using sim::World;
+using sim::Node;
+using sim::usec_t;
+
+//Fixed header + topic length + packet id
+static size_t mqtt_overhead(const std::string &topic, uint8_t qos) {
+    return 2 + 2 + topic.size() + (qos ? 2 : 0);
+}
+
+static bool on_router(Node *n) {
+    return n->sta_ap && ! n->sta_ap->owner && n->sta_status == WL_CONNECTED;
+}
+
+AsyncMqttClient::AsyncMqttClient() {
+    World &w = World::get();
+    _node = w.current();
+    _id = w.register_mqtt(this);
+}
+
+AsyncMqttClient::~AsyncMqttClient() {
+    World &w = World::get();
+    w.broker.client_disconnect(this, false);
+    w.unregister_mqtt(this);
+}
+
+void AsyncMqttClient::connect() {
+    World &w = World::get();
+    if (_connected || _connecting) {
+        return;
+    }
+    _connecting = true;
+    uint32_t id = _id;
+    Node *n = _node;
+    if (! on_router(n)) {
+        w.after(1000000, n, [id] () {
+            AsyncMqttClient *c = World::get().mqtt(id);
+            if (! c || ! c->_connecting) {
+                return;
+            }
+            c->_connecting = false;
+            if (c->_onDisconnect) {
+                c->_onDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+            }
+        });
+        return;
+    }
+    //TCP handshake followed by CONNECT/CONNACK
+    usec_t rtt = 2 * (w.params.hop_latency + w.params.broker_latency);
+    w.after(2 * rtt, n, [id, n] () {
+        World &w = World::get();
+        AsyncMqttClient *c = w.mqtt(id);
+        if (! c || ! c->_connecting || ! on_router(n)) {
+            return;
+        }
+        c->_connecting = false;
+        c->_connected = true;
+        w.broker.client_connect(c);
+        if (c->_onConnect) {
+            c->_onConnect(false);
+        }
+    });
+}
+
+void AsyncMqttClient::disconnect(bool force) {
+    World &w = World::get();
+    _connecting = false;
+    if (! _connected) {
+        return;
+    }
+    w.broker.client_disconnect(this, false);
+    uint32_t id = _id;
+    w.after(0, _node, [id] () {
+        AsyncMqttClient *c = World::get().mqtt(id);
+        if (c && c->_onDisconnect) {
+            c->_onDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+        }
+    });
+}
+
+uint16_t AsyncMqttClient::subscribe(const char* topic, uint8_t qos) {
+    World &w = World::get();
+    if (! _connected) {
+        return 0;
+    }
+    uint16_t packetId = _nextPacketId++;
+    if (! _nextPacketId) {
+        _nextPacketId = 1;
+    }
+    std::string filter(topic);
+    uint32_t id = _id;
+    usec_t arrival = w.transmit(_node->id, w.link_id(_node->sta_ap), mqtt_overhead(filter, 1) + 1) + w.params.broker_latency;
+    w.at(arrival, NULL, [id, filter, packetId, qos] () {
+        World &w = World::get();
+        AsyncMqttClient *c = w.mqtt(id);
+        if (c) {
+            w.broker.client_subscribe(c, filter, packetId, qos);
+        }
+    });
+    return packetId;
+}
+
+uint16_t AsyncMqttClient::unsubscribe(const char* topic) {
+    return _connected ? _nextPacketId++ : 0;
+}
+
+uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, bool dup, uint16_t message_id) {
+    World &w = World::get();
+    if (! _connected) {
+        return 0;
+    }
+    std::string t(topic);
+    std::string p;
+    if (payload) {
+        p.assign(payload, length ? length : strlen(payload));
+    }
+    uint16_t packetId = 1;
+    if (qos) {
+        packetId = _nextPacketId++;
+        if (! _nextPacketId) {
+            _nextPacketId = 1;
+        }
+    }
+    //Large publishes are split into MSS-sized segments on the hop to the router
+    int from = _node->id;
+    int to = w.link_id(_node->sta_ap);
+    size_t remaining = mqtt_overhead(t, qos) + p.size();
+    usec_t arrival = 0;
+    while (remaining) {
+        size_t len = std::min(remaining, (size_t)w.params.mss);
+        arrival = w.transmit(from, to, len);
+        remaining -= len;
+    }
+    arrival += w.params.broker_latency;
+    uint32_t id = _id;
+    w.at(arrival, NULL, [id, t, p, retain, qos, packetId] () {
+        World &w = World::get();
+        AsyncMqttClient *c = w.mqtt(id);
+        if (c) {
+            w.broker.client_publish(c, t, p, retain, qos, packetId);
+        }
+    });
+    return packetId;
+}
+
+namespace sim {
+
+uint32_t World::register_mqtt(AsyncMqttClient *c) {
+    uint32_t id = _next_id++;
+    _mqtt[id] = c;
+    return id;
+}
+
+void World::unregister_mqtt(AsyncMqttClient *c) {
+    _mqtt.erase(c->_id);
+}
+
+AsyncMqttClient *World::mqtt(uint32_t id) const {
+    auto it = _mqtt.find(id);
+    return it == _mqtt.end() ? NULL : it->second;
+}
+
+bool Broker::match(const std::string &filter, const std::string &topic) {
+    size_t f = 0, t = 0;
+    while (f < filter.size()) {
+        if (filter[f] == '#') {
+            return true;
+        }
+        if (filter[f] == '+') {
+            while (t < topic.size() && topic[t] != '/') {
+                t++;
+            }
+            f++;
+            continue;
+        }
+        if (t >= topic.size() || filter[f] != topic[t]) {
+            return false;
+        }
+        f++;
+        t++;
+    }
+    return t == topic.size();
+}
+
+int Broker::observe(const std::string &filter, Observer fn) {
+    _observers[_next_observer] = std::make_pair(filter, fn);
+    return _next_observer++;
+}
+
+void Broker::unobserve(int handle) {
+    _observers.erase(handle);
+}
+
+void Broker::publish(const std::string &topic, const std::string &payload, bool retain) {
+    route(topic, payload, retain, World::get().now());
+}
+
+void Broker::client_connect(AsyncMqttClient *c) {
+    _subs[c->_id].clear();
+}
+
+void Broker::client_disconnect(AsyncMqttClient *c, bool notify) {
+    _subs.erase(c->_id);
+    c->_connected = false;
+}
+
+void Broker::client_subscribe(AsyncMqttClient *c, const std::string &filter, uint16_t packetId, uint8_t qos) {
+    World &w = World::get();
+    if (! c->_connected) {
+        return;
+    }
+    _subs[c->_id].push_back(filter);
+    uint32_t id = c->_id;
+    usec_t now = w.now();
+    w.at(w.transmit(w.link_id(c->_node->sta_ap), c->_node->id, 5, now + w.params.broker_latency), c->_node, [id, packetId, qos] () {
+        AsyncMqttClient *c = World::get().mqtt(id);
+        if (c && c->_connected && c->_onSubscribe) {
+            c->_onSubscribe(packetId, qos);
+        }
+    });
+    for (auto &it : _retained) {
+        if (match(filter, it.first)) {
+            deliver(id, it.first, it.second, true, now);
+        }
+    }
+}
+
+void Broker::client_publish(AsyncMqttClient *c, const std::string &topic, const std::string &payload, bool retain, uint8_t qos, uint16_t packetId) {
+    World &w = World::get();
+    messages++;
+    bytes += topic.size() + payload.size();
+    route(topic, payload, retain, w.now());
+    if (qos && c->_connected) {
+        uint32_t id = c->_id;
+        w.at(w.transmit(w.link_id(c->_node->sta_ap), c->_node->id, 4, w.now() + w.params.broker_latency), c->_node, [id, packetId] () {
+            AsyncMqttClient *c = World::get().mqtt(id);
+            if (c && c->_connected && c->_onPublish) {
+                c->_onPublish(packetId);
+            }
+        });
+    }
+}
+
+void Broker::route(const std::string &topic, const std::string &payload, bool retain, usec_t when) {
+    if (retain) {
+        if (payload.empty()) {
+            _retained.erase(topic);
+        } else {
+            _retained[topic] = payload;
+        }
+    }
+    for (auto &o : _observers) {
+        if (match(o.second.first, topic)) {
+            o.second.second(topic, payload);
+        }
+    }
+    for (auto &it : _subs) {
+        for (auto &filter : it.second) {
+            if (match(filter, topic)) {
+                deliver(it.first, topic, payload, false, when);
+                break;
+            }
+        }
+    }
+}
+
+void Broker::deliver(uint32_t id, const std::string &topic, const std::string &payload, bool retain, usec_t when) {
+    World &w = World::get();
+    AsyncMqttClient *c = w.mqtt(id);
+    if (! c || ! c->_connected || ! c->_node->sta_ap) {
+        return;
+    }
+    int from = w.link_id(c->_node->sta_ap);
+    int to = c->_node->id;
+    size_t remaining = mqtt_overhead(topic, 0) + payload.size();
+    usec_t start = when + w.params.broker_latency;
+    usec_t arrival = start;
+    while (remaining) {
+        size_t len = std::min(remaining, (size_t)w.params.mss);
+        arrival = w.transmit(from, to, len, start);
+        remaining -= len;
+    }
+    w.at(arrival, c->_node, [id, topic, payload, retain] () {
+        AsyncMqttClient *c = World::get().mqtt(id);
+        if (! c || ! c->_connected || ! c->_onMessage) {
+            return;
+        }
+        std::string t = topic;
+        std::string p = payload;
+        AsyncMqttClientMessageProperties props;
+        props.qos = 0;
+        props.dup = false;
+        props.retain = retain;
+        c->_onMessage(&t[0], &p[0], props, p.size(), 0, p.size());
+    });
+}
+
+} //namespace sim
@@ -0,0 +1,210 @@
+#include "scenario.h"
+#include "ESP8266MQTTMesh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <random>
+
+namespace sim {
+
+static const char *networks[] = {
+    "sim-router",
+    NULL,
+};
+static const char *network_password = "sim-password";
+static const char *mesh_password = "sim-mesh";
+
+void usage(const char *prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  --topology chain|tree|random  Node layout (default chain)\n");
+    printf("  --nodes N                     Number of mesh nodes (default 5)\n");
+    printf("  --fanout N                    Children per node for 'tree' (default 3)\n");
+    printf("  --spacing M                   Distance between nodes for 'random' (default 20)\n");
+    printf("  --rssi DBM                    Link RSSI for chain/tree (default -60)\n");
+    printf("  --seed N                      Random seed (default 1)\n");
+    printf("  --time S                      Simulated seconds to run (default 120)\n");
+    printf("  --no-prepopulate              Let nodes assign their own subdomains\n");
+    printf("  --bssid-files                 Pre-populate with the older /bssid/<MAC> files\n");
+    printf("  --loop-budget US              Time each node's sketch gives mesh.loop() (default: library default)\n");
+    printf("  --verbose                     Show the library's debug output\n");
+}
+
+bool parse_args(Scenario &s, int argc, char **argv, std::vector<std::string> &rest) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        bool has_val = i + 1 < argc;
+        if (arg == "--topology" && has_val) {
+            s.topology = argv[++i];
+        } else if (arg == "--nodes" && has_val) {
+            s.nodes = atoi(argv[++i]);
+        } else if (arg == "--fanout" && has_val) {
+            s.fanout = atoi(argv[++i]);
+        } else if (arg == "--spacing" && has_val) {
+            s.spacing = atof(argv[++i]);
+        } else if (arg == "--rssi" && has_val) {
+            s.rssi = atoi(argv[++i]);
+        } else if (arg == "--seed" && has_val) {
+            s.seed = strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--time" && has_val) {
+            s.time = atof(argv[++i]);
+        } else if (arg == "--no-prepopulate") {
+            s.prepopulate = false;
+        } else if (arg == "--bssid-files") {
+            s.bssid_files = true;
+        } else if (arg == "--loop-budget" && has_val) {
+            s.loop_budget = strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--verbose") {
+            s.verbose = true;
+        } else {
+            rest.push_back(arg);
+        }
+    }
+    if (s.topology != "chain" && s.topology != "tree" && s.topology != "random") {
+        fprintf(stderr, "Unknown topology '%s'\n", s.topology.c_str());
+        return false;
+    }
+    //Subdomains 4..255 are available
+    if (s.nodes < 1 || s.nodes > 252) {
+        fprintf(stderr, "--nodes must be between 1 and 252\n");
+        return false;
+    }
+    if (s.fanout < 1 || s.fanout > ESP8266_NUM_CLIENTS) {
+        fprintf(stderr, "--fanout must be between 1 and %d\n", ESP8266_NUM_CLIENTS);
+        return false;
+    }
+    return true;
+}
+
+void build(const Scenario &s) {
+    World &w = World::get();
+    w.verbose = s.verbose;
+    std::mt19937 rng(s.seed);
+
+    AccessPoint *router = w.add_router(networks[0], network_password, 0, 0);
+    //Random placement keeps every node within usable range of the router or an earlier node
+    double range = pow(10.0, (w.params.rssi_at_1m - (w.params.sensitivity + 10)) / (10.0 * w.params.path_loss_exp));
+    double side = s.spacing * sqrt((double)s.nodes);
+    std::uniform_real_distribution<double> pos(-side / 2, side / 2);
+    for (int i = 0; i < s.nodes; i++) {
+        double x = 0, y = 0;
+        while (s.topology == "random") {
+            x = pos(rng);
+            y = pos(rng);
+            bool reachable = hypot(x - router->x, y - router->y) <= range;
+            for (Node *n : w.nodes) {
+                reachable = reachable || hypot(x - n->x, y - n->y) <= range;
+            }
+            if (reachable) {
+                break;
+            }
+        }
+        w.add_node(x, y);
+    }
+    if (s.topology == "chain") {
+        for (int i = 0; i < s.nodes; i++) {
+            w.set_rssi(i, i ? i - 1 : router_id(0), s.rssi);
+        }
+    } else if (s.topology == "tree") {
+        //The first 'fanout' nodes hang off the router, every node k after that off node k/fanout - 1
+        for (int i = 0; i < s.nodes; i++) {
+            w.set_rssi(i, i < s.fanout ? router_id(0) : i / s.fanout - 1, s.rssi);
+        }
+    }
+
+    for (Node *n : w.nodes) {
+        n->create = [n, &s] () {
+            ESP8266MQTTMesh *mesh = ESP8266MQTTMesh::Builder(networks, network_password, "broker", 1883)
+                .setVersion(s.firmware_ver, n->id < (int)s.node_firmware.size() ? s.node_firmware[n->id] : s.firmware_id)
+                .setMeshPassword(mesh_password)
+                .buildptr();
+            mesh->setCallback([n] (const char *topic, const char *msg) {
+                n->stats.delivered++;
+                if (n->on_message) {
+                    n->on_message(topic, msg);
+                }
+            });
+            mesh->begin();
+            return mesh;
+        };
+        n->loop = [n, &s] () {
+            if (s.loop_budget) {
+                n->mesh->loop(s.loop_budget);
+            } else {
+                n->mesh->loop();
+            }
+        };
+    }
+    if (s.prepopulate) {
+        //The mesh map table: a header with epoch 1, then bssid_map_t records
+        std::string table = std::string("EMM") + (char)MESHMAP_VERSION + (char)1 + (char)0;
+        for (Node *n : w.nodes) {
+            String mac = n->mac_string(n->ap_mac);
+            std::string subdomain = std::to_string(4 + n->id);
+            if (s.bssid_files) {
+                for (Node *m : w.nodes) {
+                    m->files[std::string("/bssid/") + mac.c_str()] = subdomain + "\n";
+                }
+            }
+            bssid_map_t entry = {};
+            memcpy(entry.mac, n->ap_mac, 6);
+            entry.subdomain = 4 + n->id;
+            entry.version = 1 + n->id;
+            table += std::string((const char *)&entry, sizeof(entry));
+            w.broker.publish(std::string("esp8266-in/bssid/") + mac.c_str(), subdomain, true);
+        }
+        for (Node *m : w.nodes) {
+            if (! s.bssid_files) {
+                m->files[MESHMAP_FILE] = table;
+            }
+        }
+    }
+}
+
+void power_on_all(usec_t stagger) {
+    World &w = World::get();
+    usec_t t = w.now();
+    for (Node *n : w.nodes) {
+        w.power_on(n, t);
+        t += stagger;
+    }
+}
+
+bool node_connected(Node *n) {
+    bool connected = false;
+    if (n->mesh) {
+        World::get().call(n, [n, &connected] () {
+            connected = n->mesh->connected();
+        });
+    }
+    return connected;
+}
+
+bool wait_joined(const Scenario &s, std::vector<double> &join_time) {
+    World &w = World::get();
+    join_time.assign(w.nodes.size(), -1);
+    usec_t limit = w.now() + (usec_t)(s.time * 1000000);
+    return w.run_until(limit, [&] () {
+        bool all = true;
+        for (Node *n : w.nodes) {
+            if (join_time[n->id] < 0 && node_connected(n)) {
+                join_time[n->id] = w.now() / 1000000.0;
+            }
+            all = all && join_time[n->id] >= 0;
+        }
+        return all;
+    }, 50000);
+}
+
+std::string topic_name(Node *n) {
+    //The broker holds the definitive subdomain of every node
+    String mac = n->mac_string(n->ap_mac);
+    auto &retained = World::get().broker.retained();
+    auto it = retained.find(std::string("esp8266-in/bssid/") + mac.c_str());
+    if (it == retained.end()) {
+        return "";
+    }
+    return "mesh_esp8266-" + std::to_string(atoi(it->second.c_str())) + "/";
+}
+
+} //namespace sim
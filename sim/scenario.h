@@ -0,0 +1,47 @@
+// Common topology setup and command-line handling for the simulation programs
+#ifndef _SIM_SCENARIO_H_
+#define _SIM_SCENARIO_H_
+
+#include "sim.h"
+
+namespace sim {
+
+struct Scenario {
+    std::string topology = "chain";  //chain, tree or random
+    int    nodes = 5;
+    int    fanout = 3;
+    double spacing = 20.0;           //Metres between neighbours (random: mean spacing)
+    int    rssi = -60;               //Link RSSI for chain/tree
+    unsigned seed = 1;
+    double time = 120.0;             //Simulated seconds to run
+    bool   prepopulate = true;       //Pre-assign subdomains (see docs/Filesystem.md)
+    bool   bssid_files = false;      //Pre-populate /bssid/<MAC> files rather than the mesh map
+    bool   verbose = false;
+    unsigned loop_budget = 0;        //Microseconds per mesh.loop() call, 0 for the library default
+    unsigned firmware_id = 0x1337;
+    std::vector<unsigned> node_firmware;  //Per-node firmware ID overriding firmware_id, by node id
+    const char *firmware_ver = "1.0";
+};
+
+//Parse the options common to all simulation programs.  Unknown options are left in
+//'rest' for the caller.  Returns false on a malformed option
+bool parse_args(Scenario &s, int argc, char **argv, std::vector<std::string> &rest);
+void usage(const char *prog);
+
+//Create the router, nodes and RSSI map described by the scenario and prepare each
+//node's filesystem.  Nodes are not powered on
+void build(const Scenario &s);
+
+//Power every node on, staggered by 'stagger' microseconds
+void power_on_all(usec_t stagger = 10000);
+
+//Run until every node reports connected() or the scenario time runs out.
+//Fills join_time (seconds, -1 if never joined) per node
+bool wait_joined(const Scenario &s, std::vector<double> &join_time);
+
+bool node_connected(Node *n);
+std::string topic_name(Node *n);   //The node's mySSID (e.g. 'mesh_esp8266-5/')
+
+} //namespace sim
+
+#endif //_SIM_SCENARIO_H_
@@ -0,0 +1,309 @@
+// Discrete-event simulation of a group of ESP8266 nodes running ESP8266MQTTMesh.
+//
+// Every node owns a real ESP8266MQTTMesh instance.  The stand-in Arduino, WiFi, AsyncTCP,
+// AsyncMqttClient, Ticker and SPIFFS layers in sim/stubs act on whichever node is
+// currently executing an event, so the library code runs unmodified.  Time is virtual:
+// millis()/micros() report simulated time, and operations that would block the CPU on
+// real hardware (flash erase/write, SPIFFS access) are charged to the node, delaying
+// any further events for that node.
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <AsyncMqttClient.h>
+#include <Ticker.h>
+#include <FS.h>
+#include <user_interface.h>
+#include <eboot_command.h>
+
+#include <map>
+#include <set>
+#include <queue>
+#include <vector>
+#include <string>
+#include <memory>
+
+class ESP8266MQTTMesh;
+
+namespace sim {
+
+typedef uint64_t usec_t;
+
+struct Params {
+    //WiFi timing
+    usec_t scan_time       = 2200000;  //Active scan over all channels
+    usec_t assoc_time      = 300000;   //Auth + association + 4-way handshake
+    usec_t dhcp_time       = 200000;
+    usec_t beacon_timeout  = 3000000;  //Time for a station to notice its AP vanished
+    usec_t tcp_abort_delay = 2000000;  //Time for the far end of a dead link to notice
+    //Link model
+    usec_t hop_latency     = 1500;     //One-way latency of a WiFi hop
+    usec_t broker_latency  = 2000;     //Router <-> broker one-way latency
+    double link_bps        = 4000000;  //Effective 802.11 throughput of a hop
+    int    mss             = 1460;
+    int    snd_buf         = 2920;     //lwIP TCP_SND_BUF
+    int    frame_overhead  = 76;       //TCP/IP + 802.11 headers per segment
+    //Radio model (log-distance path loss)
+    int    rssi_at_1m      = -40;
+    double path_loss_exp   = 3.0;
+    int    sensitivity     = -85;
+    //Flash and filesystem cost model
+    usec_t fs_op_cost      = 1500;     //open/exists/remove base cost
+    usec_t fs_file_cost    = 250;      //additional lookup cost per file on the FS
+    usec_t fs_write_cost   = 8000;     //close of a modified file
+    usec_t flash_erase_cost= 30000;    //per 4k sector
+    usec_t flash_write_cost= 2;        //per byte
+    usec_t flash_read_cost = 1;        //per 32 bytes
+    usec_t md5_cost        = 40;       //per 64 byte block (ESP8266 ROM MD5, ~1.6MB/s)
+    //Flash layout (1M module, 256k SPIFFS)
+    uint32_t flash_size    = 0x100000;
+    uint32_t spiffs_start  = 0xBB000;
+    uint32_t sketch_size   = 300000;
+    uint32_t heap_size     = 40000;
+};
+
+struct LinkStats {
+    uint64_t bytes = 0;       //Bytes on the air, including per-segment overhead
+    uint64_t payload = 0;     //Application bytes carried
+    uint64_t segments = 0;
+};
+
+struct NodeStats {
+    uint64_t cpu_ns = 0;      //Host CPU time spent inside this node's callbacks
+    uint64_t events = 0;
+    uint64_t busy_us = 0;     //Modeled blocking time (flash, SPIFFS)
+    uint64_t fs_ops = 0;
+    uint64_t fs_writes = 0;
+    uint64_t flash_erases = 0;
+    uint64_t flash_writes = 0;
+    uint64_t restarts = 0;
+    uint64_t delivered = 0;   //Messages handed to the application callback
+};
+
+class Node;
+
+struct AccessPoint {
+    bool up = true;
+    std::string ssid;
+    std::string password;
+    uint8_t bssid[6];
+    bool hidden;
+    int channel;
+    int max_conn;
+    IPAddress ip;
+    double x, y;
+    Node *owner;                    //NULL for an infrastructure router
+    std::vector<Node *> stations;
+    uint8_t next_host = 100;
+};
+
+struct ScanResult {
+    std::string ssid;
+    uint8_t bssid[6];
+    int channel;
+    int rssi;
+    bool hidden;
+    std::vector<uint8_t> ie;
+};
+
+class Node {
+public:
+    Node(int id, double x, double y);
+    ~Node();
+
+    int id;
+    std::string name;
+    uint8_t sta_mac[6];
+    uint8_t ap_mac[6];
+    uint32_t chip_id;
+    double x, y;
+
+    //Application hooks (run in node context)
+    std::function<ESP8266MQTTMesh *()> create;
+    std::function<void(const char *topic, const char *msg)> on_message;
+    //The sketch's loop(), run whenever an event has left the node with work to do
+    std::function<void()> loop;
+
+    ESP8266MQTTMesh *mesh = 0;
+    bool powered = false;
+    uint32_t epoch = 0;
+    NodeStats stats;
+
+    //Radio state
+    WiFiMode_t mode = WIFI_STA;
+    wl_status_t sta_status = WL_IDLE_STATUS;
+    AccessPoint *sta_ap = 0;
+    IPAddress sta_ip;
+    uint32_t sta_gen = 0;
+    AccessPoint *ap = 0;
+    IPAddress ap_ip = IPAddress(192, 168, 4, 1);
+    IPAddress ap_gw = IPAddress(192, 168, 4, 1);
+    bool scanning = false;
+    bool scan_done = false;
+    std::vector<ScanResult> scan_results;
+    bool scan_ie_pending = false;
+    std::vector<uint8_t> user_ie;
+    user_ie_manufacturer_recv_cb_t user_ie_cb = NULL;
+    std::vector<std::weak_ptr<WiFiEventHandlerImpl<WiFiEventStationModeGotIP>>> got_ip_handlers;
+    std::vector<std::weak_ptr<WiFiEventHandlerImpl<WiFiEventStationModeDisconnected>>> disconnect_handlers;
+    std::vector<std::weak_ptr<WiFiEventHandlerImpl<WiFiEventSoftAPModeStationConnected>>> ap_connect_handlers;
+    std::vector<std::weak_ptr<WiFiEventHandlerImpl<WiFiEventSoftAPModeStationDisconnected>>> ap_disconnect_handlers;
+
+    //Storage
+    std::vector<uint8_t> flash;
+    std::map<std::string, std::string> files;
+    bool fs_mounted = false;
+    bool eboot_pending = false;
+    eboot_command eboot;
+
+    //Scheduling
+    usec_t busy_until = 0;
+    usec_t consumed = 0;
+    bool loop_pending = false;
+
+    String mac_string(const uint8_t *mac) const;
+    uint8_t *flash_data();
+};
+
+class Broker {
+public:
+    typedef std::function<void(const std::string &topic, const std::string &payload)> Observer;
+
+    //Harness access: observe everything the broker receives on a filter, or inject a message
+    int observe(const std::string &filter, Observer fn);
+    void unobserve(int handle);
+    void publish(const std::string &topic, const std::string &payload, bool retain = false);
+    const std::map<std::string, std::string> &retained() const { return _retained; }
+    static bool match(const std::string &filter, const std::string &topic);
+
+    //Called from the AsyncMqttClient stand-in
+    void client_connect(AsyncMqttClient *c);
+    void client_disconnect(AsyncMqttClient *c, bool notify);
+    void client_subscribe(AsyncMqttClient *c, const std::string &filter, uint16_t packetId, uint8_t qos);
+    void client_publish(AsyncMqttClient *c, const std::string &topic, const std::string &payload, bool retain, uint8_t qos, uint16_t packetId);
+
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+
+private:
+    void route(const std::string &topic, const std::string &payload, bool retain, usec_t when);
+    void deliver(uint32_t client, const std::string &topic, const std::string &payload, bool retain, usec_t when);
+    std::map<std::string, std::string> _retained;
+    std::map<int, std::pair<std::string, Observer>> _observers;
+    int _next_observer = 0;
+    std::map<uint32_t, std::vector<std::string>> _subs;
+};
+
+class World {
+public:
+    static World &get();
+    Params params;
+    Broker broker;
+    std::vector<Node *> nodes;
+    std::vector<AccessPoint *> routers;
+    bool verbose = false;
+
+    //Topology
+    AccessPoint *add_router(const char *ssid, const char *password, double x, double y, int channel = 6);
+    Node *add_node(double x, double y);
+    //Override the path-loss model for a pair of radios (node id, or -1 - router index for a router).
+    //Once any override is set, unlisted pairs are out of range
+    void set_rssi(int a, int b, int rssi);
+    int rssi(const Node *sta, const AccessPoint *ap) const;
+
+    //Power a node on (runs create() and begin()), or cut power without a clean shutdown
+    void power_on(Node *n, usec_t when = 0);
+    void power_off(Node *n);
+
+    //Run fn synchronously in the context of node n (for harness queries such as connected())
+    void call(Node *n, std::function<void()> fn);
+    //Parent of a node (NULL if none or a router), and hops to the router (-1 if detached)
+    Node *parent(const Node *n) const;
+    int depth(const Node *n) const;
+
+    //Event scheduling
+    usec_t now() const;
+    void at(usec_t when, Node *node, std::function<void()> fn);
+    void after(usec_t delay, Node *node, std::function<void()> fn) { at(now() + delay, node, fn); }
+    void run_until(usec_t t);
+    bool run_until(usec_t limit, std::function<bool()> done, usec_t poll = 100000);
+    Node *current() const { return _current; }
+    void consume(usec_t us);
+
+    const std::map<std::pair<int, int>, LinkStats> &link_stats() const { return _links; }
+    void reset_stats();
+    //Called with each segment a TCP client (a mesh link) sends, to capture the traffic
+    std::function<void(uint32_t client, const std::string &data)> tcp_tap;
+
+    //Internals used by the stand-in layers
+    void wifi_begin(Node *n, const char *ssid, const char *pass, int32_t channel, const uint8_t *bssid);
+    void wifi_disconnect(Node *n, WiFiDisconnectReason reason, bool notify);
+    void wifi_scan(Node *n, bool show_hidden);
+    void ap_start(Node *n, const char *ssid, const char *pass, int channel, bool hidden, int max_conn);
+    void ap_stop(Node *n, WiFiDisconnectReason reason, usec_t delay);
+
+    uint32_t register_client(AsyncClient *c);
+    void unregister_client(AsyncClient *c);
+    AsyncClient *client(uint32_t id) const;
+    bool tcp_connect(AsyncClient *c, IPAddress ip, uint16_t port);
+    void tcp_send(AsyncClient *c);
+    void tcp_close(AsyncClient *c, bool notify_local, bool graceful);
+    void server_listen(AsyncServer *s, bool listen);
+
+    uint32_t register_mqtt(AsyncMqttClient *c);
+    void unregister_mqtt(AsyncMqttClient *c);
+    AsyncMqttClient *mqtt(uint32_t id) const;
+
+    uint32_t register_ticker(Ticker *t);
+    void unregister_ticker(Ticker *t);
+    Ticker *ticker(uint32_t id) const;
+
+    //Queue one segment of 'payload' bytes on the hop from -> to (node or router ids),
+    //starting no earlier than 'start'.  Returns the arrival time at the far end
+    usec_t transmit(int from, int to, size_t payload, usec_t start = 0);
+    int link_id(const AccessPoint *ap) const;
+
+private:
+    World() {}
+    struct Event {
+        usec_t t;
+        uint64_t seq;
+        Node *node;
+        uint32_t epoch;
+        std::function<void()> fn;
+        bool loop;
+        bool operator>(const Event &rhs) const { return t != rhs.t ? t > rhs.t : seq > rhs.seq; }
+    };
+    void dispatch(Event &e);
+    void queue_loop(Node *n);
+    void drop_link(int sta, int ap, usec_t sta_delay, usec_t ap_delay);
+    void fire_disconnect(Node *n, const std::string &ssid, const uint8_t *bssid, WiFiDisconnectReason reason);
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> _events;
+    uint64_t _seq = 0;
+    usec_t _now = 0;
+    Node *_current = 0;
+    std::map<uint32_t, AsyncClient *> _clients;
+    std::map<uint32_t, AsyncMqttClient *> _mqtt;
+    std::map<uint32_t, Ticker *> _tickers;
+    std::vector<AccessPoint *> _node_aps;
+    std::vector<AsyncServer *> _servers;
+    std::map<std::pair<int, int>, usec_t> _link_busy;
+    std::map<std::pair<int, int>, LinkStats> _links;
+    std::map<std::pair<int, int>, int> _rssi;
+    uint32_t _next_id = 1;
+};
+
+//Delay value meaning 'never notify'
+static const usec_t NEVER = ~(usec_t)0;
+
+//Thrown by ESP.restart() to unwind the node's stack back to the event loop
+struct Restart {};
+
+//Node id used for a router in link statistics
+inline int router_id(int idx) { return -1 - idx; }
+
+} //namespace sim
+
+#endif //_SIM_H_
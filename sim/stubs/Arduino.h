@@ -0,0 +1,181 @@
+// Host stand-in for the parts of the ESP8266 Arduino core used by ESP8266MQTTMesh.
+// Everything here that touches hardware is routed to the currently running
+// simulated node (see sim/sim.h)
+#ifndef _SIM_ARDUINO_H_
+#define _SIM_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <functional>
+
+#include "pgmspace.h"
+
+typedef uint8_t  byte;
+typedef bool     boolean;
+typedef uint8_t  uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t   sint8;
+typedef int16_t  sint16;
+typedef int32_t  sint32;
+
+#define HEX 16
+#define DEC 10
+#define OCT 8
+#define BIN 2
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT  0x00
+#define OUTPUT 0x01
+#define LED_BUILTIN 2
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+
+#define FLASH_SECTOR_SIZE 0x1000
+
+//Marks this as a 2.4.0+ core, which ESP8266MQTTMesh requires
+#ifndef pgm_read_with_offset
+  #define pgm_read_with_offset(addr, res) (res) = *(addr)
+#endif
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t len);
+#endif
+
+char *itoa(int value, char *result, int base);
+char *ltoa(long value, char *result, int base);
+char *utoa(unsigned int value, char *result, int base);
+char *ultoa(unsigned long value, char *result, int base);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+class String {
+public:
+    String(const char *cstr = "") : s(cstr ? cstr : "") {}
+    String(const std::string &str) : s(str) {}
+    String(const String &str) = default;
+    explicit String(char c) : s(1, c) {}
+    explicit String(unsigned char value, unsigned char base = 10);
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(float value, unsigned char decimalPlaces = 2);
+    explicit String(double value, unsigned char decimalPlaces = 2);
+    String &operator=(const String &rhs) = default;
+
+    const char *c_str() const { return s.c_str(); }
+    unsigned int length() const { return s.length(); }
+    char charAt(unsigned int idx) const { return idx < s.length() ? s[idx] : 0; }
+    char operator[](unsigned int idx) const { return charAt(idx); }
+    String substring(unsigned int from) const { return from < s.length() ? String(s.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const;
+    int indexOf(char c, unsigned int from = 0) const;
+    int indexOf(const String &str, unsigned int from = 0) const;
+    bool startsWith(const String &prefix) const { return s.compare(0, prefix.s.length(), prefix.s) == 0; }
+    bool endsWith(const String &suffix) const;
+    long toInt() const { return strtol(s.c_str(), NULL, 10); }
+    void toUpperCase();
+    void toLowerCase();
+    void trim();
+
+    bool equals(const String &rhs) const { return s == rhs.s; }
+    bool operator==(const String &rhs) const { return s == rhs.s; }
+    bool operator==(const char *rhs) const { return s == (rhs ? rhs : ""); }
+    bool operator!=(const String &rhs) const { return s != rhs.s; }
+    bool operator!=(const char *rhs) const { return !(*this == rhs); }
+
+    String &operator+=(const String &rhs) { s += rhs.s; return *this; }
+    String &operator+=(const char *rhs) { if (rhs) s += rhs; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    String &operator+=(int v) { return *this += String(v); }
+    String &operator+=(unsigned int v) { return *this += String(v); }
+    String &operator+=(long v) { return *this += String(v); }
+    String &operator+=(unsigned long v) { return *this += String(v); }
+
+    friend String operator+(const String &lhs, const String &rhs) { String r(lhs); r += rhs; return r; }
+    friend String operator+(const String &lhs, const char *rhs) { String r(lhs); r += rhs; return r; }
+    friend String operator+(const char *lhs, const String &rhs) { String r(lhs); r += rhs; return r; }
+    friend String operator+(const String &lhs, char c) { String r(lhs); r += c; return r; }
+    friend String operator+(const String &lhs, int v) { String r(lhs); r += v; return r; }
+    friend String operator+(const String &lhs, unsigned int v) { String r(lhs); r += v; return r; }
+    friend String operator+(const String &lhs, long v) { String r(lhs); r += v; return r; }
+    friend String operator+(const String &lhs, unsigned long v) { String r(lhs); r += v; return r; }
+    friend String operator+(const String &lhs, float v) { return lhs + String(v); }
+    friend String operator+(const String &lhs, double v) { return lhs + String(v); }
+
+private:
+    std::string s;
+};
+
+class HardwareSerial {
+public:
+    void begin(unsigned long baud) {}
+    void setDebugOutput(bool) {}
+    size_t print(const String &s);
+    size_t print(const char *s) { return print(String(s)); }
+    size_t print(char c) { return print(String(c)); }
+    size_t print(int v, int base = DEC) { return print(String(v, base)); }
+    size_t print(unsigned int v, int base = DEC) { return print(String(v, base)); }
+    size_t print(long v, int base = DEC) { return print(String(v, base)); }
+    size_t print(unsigned long v, int base = DEC) { return print(String(v, base)); }
+    size_t print(double v, int digits = 2) { return print(String(v, digits)); }
+    size_t println(const String &s);
+    size_t println(const char *s = "") { return println(String(s)); }
+    size_t println(char c) { return println(String(c)); }
+    size_t println(int v, int base = DEC) { return println(String(v, base)); }
+    size_t println(unsigned int v, int base = DEC) { return println(String(v, base)); }
+    size_t println(long v, int base = DEC) { return println(String(v, base)); }
+    size_t println(unsigned long v, int base = DEC) { return println(String(v, base)); }
+    size_t println(double v, int digits = 2) { return println(String(v, digits)); }
+};
+extern HardwareSerial Serial;
+
+class MD5Builder {
+public:
+    void begin();
+    void add(const uint8_t *data, uint16_t len);
+    void add(const char *data) { add((const uint8_t *)data, strlen(data)); }
+    void add(const String &data) { add(data.c_str()); }
+    void calculate();
+    void getBytes(uint8_t *output);
+    void getChars(char *output);
+    String toString();
+private:
+    void transform(const uint8_t *block);
+    uint32_t state[4];
+    uint64_t count;
+    uint8_t  buffer[64];
+    uint8_t  digest[16];
+};
+
+class EspClass {
+public:
+    uint32_t getChipId();
+    uint32_t getFlashChipId() { return 0x1640ef; }
+    uint32_t getFlashChipSize();
+    uint32_t getSketchSize();
+    uint32_t getFreeSketchSpace();
+    uint32_t getFreeHeap();
+    uint32_t getCycleCount() { return micros() * 80; }
+    bool flashEraseSector(uint32_t sector);
+    bool flashWrite(uint32_t offset, uint32_t *data, size_t size);
+    bool flashRead(uint32_t offset, uint32_t *data, size_t size);
+    void restart() __attribute__((noreturn));
+    void reset() __attribute__((noreturn)) { restart(); }
+};
+extern EspClass ESP;
+
+#endif //_SIM_ARDUINO_H_
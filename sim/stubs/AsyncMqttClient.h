@@ -0,0 +1,83 @@
+// Host stand-in for AsyncMqttClient.  Talks directly to the simulated broker (sim::Broker)
+// once the node is associated with a router
+#ifndef _SIM_ASYNCMQTTCLIENT_H_
+#define _SIM_ASYNCMQTTCLIENT_H_
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+enum class AsyncMqttClientDisconnectReason : int8_t {
+    TCP_DISCONNECTED = 0,
+    MQTT_UNACCEPTABLE_PROTOCOL_VERSION = 1,
+    MQTT_IDENTIFIER_REJECTED = 2,
+    MQTT_SERVER_UNAVAILABLE = 3,
+    MQTT_MALFORMED_CREDENTIALS = 4,
+    MQTT_NOT_AUTHORIZED = 5,
+    ESP8266_NOT_ENOUGH_SPACE = 6,
+    TLS_BAD_FINGERPRINT = 7
+};
+
+struct AsyncMqttClientMessageProperties {
+    uint8_t qos;
+    bool dup;
+    bool retain;
+};
+
+namespace AsyncMqttClientInternals {
+typedef std::function<void(bool sessionPresent)> OnConnectUserCallback;
+typedef std::function<void(AsyncMqttClientDisconnectReason reason)> OnDisconnectUserCallback;
+typedef std::function<void(uint16_t packetId, uint8_t qos)> OnSubscribeUserCallback;
+typedef std::function<void(uint16_t packetId)> OnUnsubscribeUserCallback;
+typedef std::function<void(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)> OnMessageUserCallback;
+typedef std::function<void(uint16_t packetId)> OnPublishUserCallback;
+}
+
+namespace sim { class Node; class Broker; class World; }
+
+class AsyncMqttClient {
+public:
+    AsyncMqttClient();
+    ~AsyncMqttClient();
+
+    AsyncMqttClient& setKeepAlive(uint16_t keepAlive) { return *this; }
+    AsyncMqttClient& setClientId(const char* clientId) { return *this; }
+    AsyncMqttClient& setCleanSession(bool cleanSession) { return *this; }
+    AsyncMqttClient& setMaxTopicLength(uint16_t maxTopicLength) { return *this; }
+    AsyncMqttClient& setCredentials(const char* username, const char* password = nullptr) { return *this; }
+    AsyncMqttClient& setWill(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0) { return *this; }
+    AsyncMqttClient& setServer(IPAddress ip, uint16_t port) { _port = port; return *this; }
+    AsyncMqttClient& setServer(const char* host, uint16_t port) { _port = port; return *this; }
+
+    AsyncMqttClient& onConnect(AsyncMqttClientInternals::OnConnectUserCallback callback) { _onConnect = callback; return *this; }
+    AsyncMqttClient& onDisconnect(AsyncMqttClientInternals::OnDisconnectUserCallback callback) { _onDisconnect = callback; return *this; }
+    AsyncMqttClient& onSubscribe(AsyncMqttClientInternals::OnSubscribeUserCallback callback) { _onSubscribe = callback; return *this; }
+    AsyncMqttClient& onUnsubscribe(AsyncMqttClientInternals::OnUnsubscribeUserCallback callback) { _onUnsubscribe = callback; return *this; }
+    AsyncMqttClient& onMessage(AsyncMqttClientInternals::OnMessageUserCallback callback) { _onMessage = callback; return *this; }
+    AsyncMqttClient& onPublish(AsyncMqttClientInternals::OnPublishUserCallback callback) { _onPublish = callback; return *this; }
+
+    bool connected() const { return _connected; }
+    void connect();
+    void disconnect(bool force = false);
+    uint16_t subscribe(const char* topic, uint8_t qos);
+    uint16_t unsubscribe(const char* topic);
+    uint16_t publish(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0, bool dup = false, uint16_t message_id = 0);
+
+private:
+    friend class sim::Broker;
+    friend class sim::World;
+    AsyncMqttClientInternals::OnConnectUserCallback     _onConnect;
+    AsyncMqttClientInternals::OnDisconnectUserCallback  _onDisconnect;
+    AsyncMqttClientInternals::OnSubscribeUserCallback   _onSubscribe;
+    AsyncMqttClientInternals::OnUnsubscribeUserCallback _onUnsubscribe;
+    AsyncMqttClientInternals::OnMessageUserCallback     _onMessage;
+    AsyncMqttClientInternals::OnPublishUserCallback     _onPublish;
+
+    sim::Node *_node;
+    uint32_t  _id;
+    uint16_t  _port = 1883;
+    uint16_t  _nextPacketId = 1;
+    bool      _connected = false;
+    bool      _connecting = false;
+};
+
+#endif //_SIM_ASYNCMQTTCLIENT_H_
@@ -0,0 +1,134 @@
+// Host stand-in for ESP8266WiFi.  All calls act on the currently running simulated node
+#ifndef _SIM_ESP8266WIFI_H_
+#define _SIM_ESP8266WIFI_H_
+
+#include <Arduino.h>
+#include <memory>
+
+class IPAddress {
+public:
+    IPAddress() : addr(0) {}
+    IPAddress(uint32_t address) : addr(address) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) :
+        addr(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+    operator uint32_t() const { return addr; }
+    uint8_t operator[](int idx) const { return (addr >> (8 * idx)) & 0xff; }
+    bool operator==(const IPAddress &rhs) const { return addr == rhs.addr; }
+    bool operator!=(const IPAddress &rhs) const { return addr != rhs.addr; }
+    String toString() const;
+private:
+    uint32_t addr;
+};
+
+typedef enum {
+    WL_NO_SHIELD     = 255,
+    WL_IDLE_STATUS   = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_SCAN_COMPLETED= 2,
+    WL_CONNECTED     = 3,
+    WL_CONNECT_FAILED= 4,
+    WL_CONNECTION_LOST=5,
+    WL_DISCONNECTED  = 6
+} wl_status_t;
+
+typedef enum WiFiMode {
+    WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3
+} WiFiMode_t;
+
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED  (-2)
+
+enum WiFiDisconnectReason {
+    WIFI_DISCONNECT_REASON_UNSPECIFIED              = 1,
+    WIFI_DISCONNECT_REASON_AUTH_EXPIRE              = 2,
+    WIFI_DISCONNECT_REASON_AUTH_LEAVE               = 3,
+    WIFI_DISCONNECT_REASON_ASSOC_EXPIRE             = 4,
+    WIFI_DISCONNECT_REASON_ASSOC_TOOMANY            = 5,
+    WIFI_DISCONNECT_REASON_ASSOC_LEAVE              = 8,
+    WIFI_DISCONNECT_REASON_4WAY_HANDSHAKE_TIMEOUT   = 15,
+    WIFI_DISCONNECT_REASON_BEACON_TIMEOUT           = 200,
+    WIFI_DISCONNECT_REASON_NO_AP_FOUND              = 201,
+    WIFI_DISCONNECT_REASON_AUTH_FAIL                = 202,
+    WIFI_DISCONNECT_REASON_ASSOC_FAIL               = 203,
+    WIFI_DISCONNECT_REASON_HANDSHAKE_TIMEOUT        = 204,
+};
+
+struct WiFiEventStationModeGotIP {
+    IPAddress ip;
+    IPAddress mask;
+    IPAddress gw;
+};
+
+struct WiFiEventStationModeDisconnected {
+    String ssid;
+    uint8 bssid[6];
+    WiFiDisconnectReason reason;
+};
+
+struct WiFiEventSoftAPModeStationConnected {
+    uint8 mac[6];
+    uint8 aid;
+};
+
+struct WiFiEventSoftAPModeStationDisconnected {
+    uint8 mac[6];
+    uint8 aid;
+};
+
+class WiFiEventHandlerOpaque {
+public:
+    virtual ~WiFiEventHandlerOpaque() {}
+};
+typedef std::shared_ptr<WiFiEventHandlerOpaque> WiFiEventHandler;
+
+template <typename T>
+class WiFiEventHandlerImpl : public WiFiEventHandlerOpaque {
+public:
+    WiFiEventHandlerImpl(std::function<void(const T&)> f) : f(f) {}
+    std::function<void(const T&)> f;
+};
+
+class ESP8266WiFiClass {
+public:
+    wl_status_t begin(const char *ssid, const char *passphrase = NULL, int32_t channel = 0,
+                      const uint8_t *bssid = NULL, bool connect = true);
+    bool disconnect(bool wifioff = false);
+    bool isConnected();
+    wl_status_t status();
+    bool mode(WiFiMode_t m);
+    WiFiMode_t getMode();
+    int32_t channel();
+
+    IPAddress localIP();
+    IPAddress gatewayIP();
+    IPAddress subnetMask();
+    String macAddress();
+    String SSID();
+    String BSSIDstr();
+    int32_t RSSI();
+
+    int8_t scanNetworks(bool async = false, bool show_hidden = false);
+    int8_t scanComplete();
+    void scanDelete();
+    String SSID(uint8_t networkItem);
+    int32_t RSSI(uint8_t networkItem);
+    uint8_t *BSSID(uint8_t networkItem);
+    String BSSIDstr(uint8_t networkItem);
+    int32_t channel(uint8_t networkItem);
+    bool isHidden(uint8_t networkItem);
+
+    bool softAP(const char *ssid, const char *passphrase = NULL, int channel = 1, int ssid_hidden = 0, int max_connection = 4);
+    bool softAPConfig(IPAddress local_ip, IPAddress gateway, IPAddress subnet);
+    bool softAPdisconnect(bool wifioff = false);
+    uint8_t softAPgetStationNum();
+    IPAddress softAPIP();
+    String softAPmacAddress();
+
+    WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> f);
+    WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> f);
+    WiFiEventHandler onSoftAPModeStationConnected(std::function<void(const WiFiEventSoftAPModeStationConnected&)> f);
+    WiFiEventHandler onSoftAPModeStationDisconnected(std::function<void(const WiFiEventSoftAPModeStationDisconnected&)> f);
+};
+extern ESP8266WiFiClass WiFi;
+
+#endif //_SIM_ESP8266WIFI_H_
@@ -0,0 +1,115 @@
+// Host stand-in for ESPAsyncTCP.  Connections are carried over the simulated WiFi links
+// with per-hop latency, serialization delay and a bounded send buffer like lwIP's
+#ifndef _SIM_ESPASYNCTCP_H_
+#define _SIM_ESPASYNCTCP_H_
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#ifndef ASYNC_TCP_SSL_ENABLED
+  #define ASYNC_TCP_SSL_ENABLED 0
+#endif
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+#define ASYNC_WRITE_FLAG_MORE 0x02
+
+class AsyncClient;
+struct tcp_pcb;
+
+typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
+typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void*, AsyncClient*, int8_t error)> AcErrorHandler;
+typedef std::function<void(void*, AsyncClient*, void *data, size_t len)> AcDataHandler;
+typedef std::function<void(void*, AsyncClient*, uint32_t time)> AcTimeoutHandler;
+
+namespace sim { class Node; class World; }
+
+class AsyncClient {
+public:
+    AsyncClient(tcp_pcb *pcb = 0);
+    ~AsyncClient();
+
+    bool connect(IPAddress ip, uint16_t port);
+    void close(bool now = false);
+    void stop() { close(false); }
+    int8_t abort();
+    bool free() { return !_connected; }
+
+    bool canSend() { return space() > 0; }
+    size_t space();
+    size_t add(const char *data, size_t size, uint8_t apiflags = 0);
+    bool send();
+    size_t write(const char *data);
+    size_t write(const char *data, size_t size, uint8_t apiflags = 0);
+
+    uint8_t state() { return _connected ? 4 : 0; }
+    bool connecting() { return _connecting; }
+    bool connected() { return _connected; }
+    bool disconnecting() { return false; }
+    bool disconnected() { return !_connected && !_connecting; }
+    bool freeable() { return !_connected; }
+
+    void setRxTimeout(uint32_t timeout) {}
+    void setAckTimeout(uint32_t timeout) {}
+    void setNoDelay(bool nodelay) { _nodelay = nodelay; }
+    bool getNoDelay() { return _nodelay; }
+
+    IPAddress remoteIP() { return _remote_ip; }
+    uint16_t remotePort() { return _remote_port; }
+    IPAddress localIP() { return _local_ip; }
+
+    void onConnect(AcConnectHandler cb, void *arg = 0)    { _connect_cb = cb; _connect_cb_arg = arg; }
+    void onDisconnect(AcConnectHandler cb, void *arg = 0) { _discard_cb = cb; _discard_cb_arg = arg; }
+    void onAck(AcAckHandler cb, void *arg = 0)            { _sent_cb = cb; _sent_cb_arg = arg; }
+    void onError(AcErrorHandler cb, void *arg = 0)        { _error_cb = cb; _error_cb_arg = arg; }
+    void onData(AcDataHandler cb, void *arg = 0)          { _recv_cb = cb; _recv_cb_arg = arg; }
+    void onTimeout(AcTimeoutHandler cb, void *arg = 0)    { _timeout_cb = cb; _timeout_cb_arg = arg; }
+    void onPoll(AcConnectHandler cb, void *arg = 0)       { _poll_cb = cb; _poll_cb_arg = arg; }
+
+private:
+    friend class sim::World;
+    AcConnectHandler _connect_cb;  void *_connect_cb_arg = 0;
+    AcConnectHandler _discard_cb;  void *_discard_cb_arg = 0;
+    AcAckHandler     _sent_cb;     void *_sent_cb_arg = 0;
+    AcErrorHandler   _error_cb;    void *_error_cb_arg = 0;
+    AcDataHandler    _recv_cb;     void *_recv_cb_arg = 0;
+    AcTimeoutHandler _timeout_cb;  void *_timeout_cb_arg = 0;
+    AcConnectHandler _poll_cb;     void *_poll_cb_arg = 0;
+
+    sim::Node  *_node;
+    uint32_t   _id;
+    uint32_t   _peer;
+    int        _link_sta;   //Node id of the station side of the WiFi link carrying this connection
+    int        _link_ap;    //Node id of the AP side (-1 for a router)
+    bool       _connected = false;
+    bool       _connecting = false;
+    bool       _nodelay = false;
+    IPAddress  _local_ip;
+    IPAddress  _remote_ip;
+    uint16_t   _remote_port = 0;
+    size_t     _unacked = 0;
+    std::string _pending;
+};
+
+class AsyncServer {
+public:
+    AsyncServer(uint16_t port);
+    AsyncServer(IPAddress addr, uint16_t port);
+    ~AsyncServer();
+    void onClient(AcConnectHandler cb, void *arg) { _connect_cb = cb; _connect_cb_arg = arg; }
+    void begin();
+    void end();
+    void setNoDelay(bool nodelay) { _nodelay = nodelay; }
+    bool getNoDelay() { return _nodelay; }
+    uint8_t status() { return _listening ? 1 : 0; }
+
+private:
+    friend class sim::World;
+    AcConnectHandler _connect_cb;  void *_connect_cb_arg = 0;
+    sim::Node *_node;
+    uint16_t   _port;
+    bool       _nodelay = false;
+    bool       _listening = false;
+};
+
+#endif //_SIM_ESPASYNCTCP_H_
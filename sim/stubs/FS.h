@@ -0,0 +1,99 @@
+// Host stand-in for the SPIFFS filesystem.  Each simulated node has its own set of files,
+// and lookups are charged against the node's CPU time like a linear SPIFFS scan
+#ifndef _SIM_FS_H_
+#define _SIM_FS_H_
+
+#include <Arduino.h>
+
+namespace sim { class Node; }
+
+enum SeekMode {
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+class File {
+public:
+    File() : _node(0), _pos(0), _write(false) {}
+    File(sim::Node *node, const String &path, bool write) : _node(node), _path(path), _pos(0), _write(write) {}
+
+    operator bool() const { return _node != 0; }
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t size);
+    size_t print(const String &s) { return write((const uint8_t *)s.c_str(), s.length()); }
+    size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(int v) { return print(String(v)); }
+    size_t print(unsigned int v) { return print(String(v)); }
+    size_t print(long v) { return print(String(v)); }
+    size_t print(unsigned long v) { return print(String(v)); }
+    size_t println(const String &s) { return print(s) + print("\n"); }
+    size_t println(const char *s = "") { return print(s) + print("\n"); }
+    int available();
+    int read();
+    int peek();
+    size_t read(uint8_t *buf, size_t size);
+    size_t readBytes(char *buf, size_t size) { return read((uint8_t *)buf, size); }
+    size_t readBytesUntil(char terminator, char *buf, size_t size);
+    size_t readBytesUntil(char terminator, uint8_t *buf, size_t size) { return readBytesUntil(terminator, (char *)buf, size); }
+    String readStringUntil(char terminator);
+    bool seek(uint32_t pos, SeekMode mode = SeekSet);
+    size_t position() const { return _pos; }
+    size_t size() const;
+    void flush() {}
+    void close();
+    const char *name() const { return _path.c_str(); }
+
+private:
+    std::string *data() const;
+    sim::Node *_node;
+    String _path;
+    size_t _pos;
+    bool _write;
+};
+
+class Dir {
+public:
+    Dir() : _node(0), _started(false) {}
+    Dir(sim::Node *node, const String &path) : _node(node), _prefix(path), _started(false) {}
+    bool next();
+    String fileName();
+    size_t fileSize();
+    File openFile(const char *mode);
+
+private:
+    sim::Node *_node;
+    String _prefix;
+    String _current;
+    bool _started;
+};
+
+struct FSInfo {
+    size_t totalBytes;
+    size_t usedBytes;
+    size_t blockSize;
+    size_t pageSize;
+    size_t maxOpenFiles;
+    size_t maxPathLength;
+};
+
+class FS {
+public:
+    bool begin();
+    void end();
+    bool format();
+    bool info(FSInfo &info);
+    File open(const char *path, const char *mode);
+    File open(const String &path, const char *mode) { return open(path.c_str(), mode); }
+    bool exists(const char *path);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    Dir openDir(const char *path);
+    Dir openDir(const String &path) { return openDir(path.c_str()); }
+    bool remove(const char *path);
+    bool remove(const String &path) { return remove(path.c_str()); }
+    bool rename(const char *pathFrom, const char *pathTo);
+    bool rename(const String &pathFrom, const String &pathTo) { return rename(pathFrom.c_str(), pathTo.c_str()); }
+};
+extern FS SPIFFS;
+
+#endif //_SIM_FS_H_
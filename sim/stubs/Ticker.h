@@ -0,0 +1,48 @@
+// Host stand-in for the ESP8266 Ticker.  Callbacks run as simulator events on the
+// node that armed the Ticker
+#ifndef _SIM_TICKER_H_
+#define _SIM_TICKER_H_
+
+#include <Arduino.h>
+
+namespace sim { class Node; }
+
+class Ticker {
+public:
+    typedef void (*callback_t)(void);
+    typedef void (*callback_with_arg_t)(void*);
+
+    Ticker();
+    ~Ticker();
+
+    void attach(float seconds, callback_t callback) { _attach((uint32_t)(seconds * 1000), true, [callback] () { callback(); }); }
+    void attach_ms(uint32_t ms, callback_t callback) { _attach(ms, true, [callback] () { callback(); }); }
+    template<typename TArg>
+    void attach(float seconds, void (*callback)(TArg), TArg arg) { _attach((uint32_t)(seconds * 1000), true, [callback, arg] () { callback(arg); }); }
+    template<typename TArg>
+    void attach_ms(uint32_t ms, void (*callback)(TArg), TArg arg) { _attach(ms, true, [callback, arg] () { callback(arg); }); }
+
+    void once(float seconds, callback_t callback) { _attach((uint32_t)(seconds * 1000), false, [callback] () { callback(); }); }
+    void once_ms(uint32_t ms, callback_t callback) { _attach(ms, false, [callback] () { callback(); }); }
+    template<typename TArg>
+    void once(float seconds, void (*callback)(TArg), TArg arg) { _attach((uint32_t)(seconds * 1000), false, [callback, arg] () { callback(arg); }); }
+    template<typename TArg>
+    void once_ms(uint32_t ms, void (*callback)(TArg), TArg arg) { _attach(ms, false, [callback, arg] () { callback(arg); }); }
+
+    void detach();
+    bool active() { return _armed; }
+
+private:
+    void _attach(uint32_t ms, bool repeat, std::function<void()> fn);
+    void _fire(uint32_t gen);
+
+    sim::Node *_node;
+    uint32_t  _id;
+    uint32_t  _gen = 0;
+    uint32_t  _ms = 0;
+    bool      _repeat = false;
+    bool      _armed = false;
+    std::function<void()> _fn;
+};
+
+#endif //_SIM_TICKER_H_
@@ -0,0 +1,22 @@
+#ifndef _SIM_EBOOT_COMMAND_H_
+#define _SIM_EBOOT_COMMAND_H_
+
+#include <stdint.h>
+
+enum action_t {
+    ACTION_COPY_RAW = 0x00000001,
+    ACTION_LOAD_APP = 0xffffffff
+};
+
+struct eboot_command {
+    uint32_t magic;
+    enum action_t action;
+    uint32_t args[29];
+    uint32_t crc32;
+};
+
+//The simulator applies the copy when the node is restarted
+int eboot_command_write(struct eboot_command *cmd);
+void eboot_command_clear();
+
+#endif //_SIM_EBOOT_COMMAND_H_
@@ -0,0 +1,46 @@
+#ifndef _SIM_USER_INTERFACE_H_
+#define _SIM_USER_INTERFACE_H_
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+struct ip_addr {
+    uint32_t addr;
+};
+
+struct station_info {
+    STAILQ_ENTRY(station_info) next;
+    uint8_t bssid[6];
+    struct ip_addr ip;
+};
+
+typedef enum {
+    USER_IE_BEACON = 0,
+    USER_IE_PROBE_REQ,
+    USER_IE_PROBE_RESP,
+    USER_IE_ASSOC_REQ,
+    USER_IE_ASSOC_RESP,
+    USER_IE_MAX
+} user_ie_type;
+
+//user_ie is the whole vendor element: id, length, OUI, then the data
+typedef void (*user_ie_manufacturer_recv_cb_t)(user_ie_type type, const uint8_t sa[6], const uint8_t m_oui[3],
+                                               uint8_t *user_ie, uint8_t user_ie_len, int32_t rssi);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+//Returns the stations associated to the current node's soft-AP.
+//The list remains valid until the next call
+struct station_info *wifi_softap_get_station_info(void);
+void wifi_softap_free_station_info(void);
+//Vendor IEs are carried in the current node's soft-AP beacons and probe responses (the sim
+//does not tell the two apart), and delivered to scanning nodes when their scan completes
+bool wifi_set_user_ie(bool enable, uint8_t *m_oui, user_ie_type type, uint8_t *user_ie, uint8_t len);
+int wifi_register_user_ie_manufacturer_recv_cb(user_ie_manufacturer_recv_cb_t cb);
+void wifi_unregister_user_ie_manufacturer_recv_cb(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif //_SIM_USER_INTERFACE_H_
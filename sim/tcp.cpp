@@ -0,0 +1,352 @@
+// Simulated ESPAsyncTCP.  A connection is a pair of AsyncClients on the two ends of a
+// WiFi association (station node -> AP node).  Writes are split into MSS-sized segments,
+// serialized on the hop, and acknowledged once the receiver has processed them.
+#include "sim.h"
+
+#include <algorithm>
+
+using sim::World;
+using sim::Node;
+using sim::usec_t;
+
+#define ERR_CONN (-13)
+
+AsyncClient::AsyncClient(tcp_pcb *pcb) {
+    World &w = World::get();
+    _node = w.current();
+    _id = w.register_client(this);
+    _peer = 0;
+    _link_sta = _link_ap = 0;
+}
+
+AsyncClient::~AsyncClient() {
+    World &w = World::get();
+    //Unlike ESPAsyncTCP, destruction does not invoke our own onDisconnect handler
+    w.tcp_close(this, false, true);
+    w.unregister_client(this);
+}
+
+bool AsyncClient::connect(IPAddress ip, uint16_t port) {
+    return World::get().tcp_connect(this, ip, port);
+}
+
+void AsyncClient::close(bool now) {
+    World::get().tcp_close(this, true, ! now);
+}
+
+int8_t AsyncClient::abort() {
+    World::get().tcp_close(this, true, false);
+    return -10; //ERR_ABRT
+}
+
+size_t AsyncClient::space() {
+    if (! _connected) {
+        return 0;
+    }
+    size_t used = _unacked + _pending.size();
+    size_t buf = World::get().params.snd_buf;
+    return used >= buf ? 0 : buf - used;
+}
+
+size_t AsyncClient::add(const char *data, size_t size, uint8_t apiflags) {
+    size_t room = space();
+    size_t len = std::min(room, size);
+    _pending.append(data, len);
+    return len;
+}
+
+bool AsyncClient::send() {
+    if (! _connected) {
+        return false;
+    }
+    World::get().tcp_send(this);
+    return true;
+}
+
+size_t AsyncClient::write(const char *data) {
+    return write(data, strlen(data));
+}
+
+size_t AsyncClient::write(const char *data, size_t size, uint8_t apiflags) {
+    size_t len = add(data, size, apiflags);
+    if (! len || ! send()) {
+        return 0;
+    }
+    return len;
+}
+
+AsyncServer::AsyncServer(uint16_t port) : _port(port) {
+    _node = World::get().current();
+}
+
+AsyncServer::AsyncServer(IPAddress addr, uint16_t port) : _port(port) {
+    _node = World::get().current();
+}
+
+AsyncServer::~AsyncServer() {
+    end();
+}
+
+void AsyncServer::begin() {
+    World::get().server_listen(this, true);
+}
+
+void AsyncServer::end() {
+    World::get().server_listen(this, false);
+}
+
+namespace sim {
+
+uint32_t World::register_client(AsyncClient *c) {
+    uint32_t id = _next_id++;
+    _clients[id] = c;
+    return id;
+}
+
+void World::unregister_client(AsyncClient *c) {
+    _clients.erase(c->_id);
+}
+
+AsyncClient *World::client(uint32_t id) const {
+    auto it = _clients.find(id);
+    return it == _clients.end() ? NULL : it->second;
+}
+
+void World::server_listen(AsyncServer *s, bool listen) {
+    _servers.erase(std::remove(_servers.begin(), _servers.end(), s), _servers.end());
+    s->_listening = listen;
+    if (listen) {
+        _servers.push_back(s);
+    }
+}
+
+bool World::tcp_connect(AsyncClient *c, IPAddress ip, uint16_t port) {
+    Node *n = c->_node;
+    if (c->_connected || c->_connecting || ! n->sta_ap || n->sta_status != WL_CONNECTED) {
+        return false;
+    }
+    AccessPoint *ap = n->sta_ap;
+    c->_connecting = true;
+    c->_link_sta = n->id;
+    c->_link_ap = link_id(ap);
+    c->_local_ip = n->sta_ip;
+    c->_remote_ip = ip;
+    c->_remote_port = port;
+    c->_unacked = 0;
+    c->_pending.clear();
+    c->_peer = 0;
+
+    AsyncServer *server = NULL;
+    if (ap->owner && ap->ip == ip) {
+        for (AsyncServer *s : _servers) {
+            if (s->_node == ap->owner && s->_port == port && s->_listening) {
+                server = s;
+            }
+        }
+    }
+    uint32_t cid = c->_id;
+    if (server) {
+        Node *owner = ap->owner;
+        IPAddress local_ip = n->sta_ip;
+        //SYN -> accept on the server, whose SYN/ACK then completes the connect on the client
+        at(transmit(n->id, owner->id, 0), owner, [this, cid, server, n, owner, local_ip, ip, port] () {
+            AsyncClient *c = client(cid);
+            if (! c || ! c->_connecting ||
+                std::find(_servers.begin(), _servers.end(), server) == _servers.end()) {
+                return;
+            }
+            AsyncClient *s = new AsyncClient();
+            s->_connected = true;
+            s->_link_sta = c->_link_sta;
+            s->_link_ap = c->_link_ap;
+            s->_local_ip = ip;
+            s->_remote_ip = local_ip;
+            s->_remote_port = port;
+            s->_nodelay = server->_nodelay;
+            s->_peer = cid;
+            c->_peer = s->_id;
+            at(transmit(owner->id, n->id, 0), n, [this, cid] () {
+                AsyncClient *c = client(cid);
+                if (! c || ! c->_connecting || ! c->_peer) {
+                    return;
+                }
+                c->_connecting = false;
+                c->_connected = true;
+                if (c->_connect_cb) {
+                    c->_connect_cb(c->_connect_cb_arg, c);
+                }
+            });
+            if (server->_connect_cb) {
+                server->_connect_cb(server->_connect_cb_arg, s);
+            }
+        });
+    } else {
+        at(now() + 2 * params.hop_latency, n, [this, cid] () {
+            AsyncClient *c = client(cid);
+            if (! c || ! c->_connecting) {
+                return;
+            }
+            c->_connecting = false;
+            if (c->_error_cb) {
+                c->_error_cb(c->_error_cb_arg, c, ERR_CONN);
+            }
+            c = client(cid);
+            if (c && c->_discard_cb) {
+                c->_discard_cb(c->_discard_cb_arg, c);
+            }
+        });
+    }
+    return true;
+}
+
+void World::tcp_send(AsyncClient *c) {
+    if (! c->_connected || c->_pending.empty()) {
+        return;
+    }
+    if (! c->_nodelay && c->_unacked && (int)c->_pending.size() < params.mss) {
+        //Nagle: hold small segments until outstanding data is acknowledged
+        return;
+    }
+    AsyncClient *peer = client(c->_peer);
+    if (! peer) {
+        c->_pending.clear();
+        return;
+    }
+    int from = c->_node->id;
+    int to = peer->_node->id;
+    uint32_t cid = c->_id;
+    uint32_t pid = peer->_id;
+    while (! c->_pending.empty()) {
+        size_t len = std::min((size_t)params.mss, c->_pending.size());
+        std::string seg = c->_pending.substr(0, len);
+        c->_pending.erase(0, len);
+        if (tcp_tap) {
+            tcp_tap(cid, seg);
+        }
+        c->_unacked += len;
+        usec_t sent = now();
+        usec_t arrival = transmit(from, to, len);
+        at(arrival, peer->_node, [this, cid, pid, seg, from, to, sent] () {
+            AsyncClient *p = client(pid);
+            if (! p || ! p->_connected) {
+                return;
+            }
+            if (p->_recv_cb) {
+                p->_recv_cb(p->_recv_cb_arg, p, (void *)seg.data(), seg.size());
+            }
+            //The ACK leaves once the segment has been consumed
+            AsyncClient *c = client(cid);
+            if (! c) {
+                return;
+            }
+            usec_t ack = transmit(to, from, 0);
+            size_t len = seg.size();
+            at(ack, c->_node, [this, cid, len, sent] () {
+                AsyncClient *c = client(cid);
+                if (! c || ! c->_connected) {
+                    return;
+                }
+                c->_unacked -= std::min(len, c->_unacked);
+                if (c->_sent_cb) {
+                    c->_sent_cb(c->_sent_cb_arg, c, len, (now() - sent) / 1000);
+                }
+                c = client(cid);
+                if (c && ! c->_pending.empty()) {
+                    tcp_send(c);
+                }
+            });
+        });
+    }
+}
+
+void World::tcp_close(AsyncClient *c, bool notify_local, bool graceful) {
+    if (! c->_connected && ! c->_connecting) {
+        return;
+    }
+    if (graceful && c->_connected) {
+        //Data already written still reaches the peer ahead of the FIN
+        c->_nodelay = true;
+        tcp_send(c);
+    }
+    c->_connected = false;
+    c->_connecting = false;
+    c->_pending.clear();
+    uint32_t cid = c->_id;
+    AsyncClient *peer = client(c->_peer);
+    if (peer && peer->_connected) {
+        uint32_t pid = peer->_id;
+        if (! graceful) {
+            peer->_connected = false;
+        }
+        at(transmit(c->_node->id, peer->_node->id, 0), peer->_node, [this, pid] () {
+            AsyncClient *p = client(pid);
+            if (p && p->_connected) {
+                p->_connected = false;
+                p->_pending.clear();
+            }
+            if (p && p->_discard_cb) {
+                p->_discard_cb(p->_discard_cb_arg, p);
+            }
+        });
+    }
+    if (notify_local) {
+        at(now(), c->_node, [this, cid] () {
+            AsyncClient *c = client(cid);
+            if (c && c->_discard_cb) {
+                c->_discard_cb(c->_discard_cb_arg, c);
+            }
+        });
+    }
+}
+
+void World::drop_link(int sta, int ap, usec_t sta_delay, usec_t ap_delay) {
+    std::vector<uint32_t> dead;
+    for (auto &it : _clients) {
+        AsyncClient *c = it.second;
+        if (c->_link_sta == sta && c->_link_ap == ap && (c->_connected || c->_connecting)) {
+            dead.push_back(it.first);
+        }
+    }
+    for (uint32_t id : dead) {
+        AsyncClient *c = _clients[id];
+        c->_connected = false;
+        c->_connecting = false;
+        c->_pending.clear();
+        usec_t delay = c->_node->id == sta ? sta_delay : ap_delay;
+        if (delay == NEVER) {
+            continue;
+        }
+        at(now() + delay, c->_node, [this, id] () {
+            AsyncClient *c = client(id);
+            if (c && c->_discard_cb) {
+                c->_discard_cb(c->_discard_cb_arg, c);
+            }
+        });
+    }
+    if (ap < 0 && sta >= 0) {
+        //Station lost its router: MQTT goes with it
+        std::vector<uint32_t> mqtt_dead;
+        for (auto &it : _mqtt) {
+            AsyncMqttClient *m = it.second;
+            if (m->_node->id == sta && (m->_connected || m->_connecting)) {
+                mqtt_dead.push_back(it.first);
+            }
+        }
+        for (uint32_t id : mqtt_dead) {
+            AsyncMqttClient *m = _mqtt[id];
+            broker.client_disconnect(m, false);
+            m->_connecting = false;
+            if (sta_delay == NEVER) {
+                continue;
+            }
+            at(now() + sta_delay, m->_node, [this, id] () {
+                AsyncMqttClient *m = mqtt(id);
+                if (m && m->_onDisconnect) {
+                    m->_onDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+                }
+            });
+        }
+    }
+}
+
+} //namespace sim
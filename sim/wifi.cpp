@@ -0,0 +1,483 @@
+// Simulated ESP8266WiFi: scanning, station association/DHCP and the soft-AP
+#include "sim.h"
+
+#include <algorithm>
+
+using sim::World;
+using sim::Node;
+using sim::AccessPoint;
+
+ESP8266WiFiClass WiFi;
+
+String IPAddress::toString() const {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+    return String(buf);
+}
+
+static Node *node() {
+    return World::get().current();
+}
+
+template <typename T>
+static void fire(std::vector<std::weak_ptr<WiFiEventHandlerImpl<T>>> &handlers, const T &event) {
+    auto copy = handlers;
+    for (auto &w : copy) {
+        auto h = w.lock();
+        if (h) {
+            h->f(event);
+        }
+    }
+}
+
+template <typename T>
+static WiFiEventHandler add_handler(std::vector<std::weak_ptr<WiFiEventHandlerImpl<T>>> &handlers, std::function<void(const T&)> f) {
+    auto h = std::make_shared<WiFiEventHandlerImpl<T>>(f);
+    handlers.push_back(h);
+    return h;
+}
+
+namespace sim {
+
+void World::fire_disconnect(Node *n, const std::string &ssid, const uint8_t *bssid, WiFiDisconnectReason reason) {
+    WiFiEventStationModeDisconnected event;
+    event.ssid = String(ssid);
+    memcpy(event.bssid, bssid, 6);
+    event.reason = reason;
+    at(now(), n, [n, event] () {
+        fire(n->disconnect_handlers, event);
+    });
+}
+
+void World::wifi_scan(Node *n, bool show_hidden) {
+    n->scanning = true;
+    n->scan_done = false;
+    n->scan_results.clear();
+    at(now() + params.scan_time, n, [this, n, show_hidden] () {
+        std::vector<AccessPoint *> aps = routers;
+        aps.insert(aps.end(), _node_aps.begin(), _node_aps.end());
+        for (AccessPoint *ap : aps) {
+            if (! ap->up || ap->owner == n || (ap->hidden && ! show_hidden)) {
+                continue;
+            }
+            int r = rssi(n, ap);
+            if (r < params.sensitivity) {
+                continue;
+            }
+            ScanResult res;
+            res.ssid = ap->hidden ? "" : ap->ssid;
+            memcpy(res.bssid, ap->bssid, 6);
+            res.channel = ap->channel;
+            res.rssi = r;
+            res.hidden = ap->hidden;
+            if (ap->owner) {
+                res.ie = ap->owner->user_ie;
+            }
+            n->scan_results.push_back(res);
+        }
+        n->scanning = false;
+        n->scan_done = true;
+        n->scan_ie_pending = true;
+    });
+}
+
+void World::wifi_begin(Node *n, const char *_ssid, const char *_pass, int32_t channel, const uint8_t *_bssid) {
+    if (n->sta_ap) {
+        wifi_disconnect(n, WIFI_DISCONNECT_REASON_ASSOC_LEAVE, true);
+    }
+    uint32_t gen = ++n->sta_gen;
+    n->sta_status = WL_DISCONNECTED;
+    std::string ssid = _ssid ? _ssid : "";
+    std::string pass = _pass ? _pass : "";
+    bool match_bssid = _bssid != NULL;
+    uint8_t bssid[6] = {0};
+    if (_bssid) {
+        memcpy(bssid, _bssid, 6);
+    }
+    at(now() + params.assoc_time, n, [this, n, gen, ssid, pass, channel, match_bssid, bssid] () {
+        if (n->sta_gen != gen) {
+            return;
+        }
+        std::vector<AccessPoint *> aps = routers;
+        aps.insert(aps.end(), _node_aps.begin(), _node_aps.end());
+        AccessPoint *best = NULL;
+        int best_rssi = -1000;
+        for (AccessPoint *ap : aps) {
+            if (! ap->up || ap->owner == n || ap->ssid != ssid) {
+                continue;
+            }
+            if ((match_bssid && memcmp(bssid, ap->bssid, 6) != 0) || (channel && channel != ap->channel)) {
+                continue;
+            }
+            int r = rssi(n, ap);
+            if (r >= params.sensitivity && r > best_rssi) {
+                best = ap;
+                best_rssi = r;
+            }
+        }
+        WiFiDisconnectReason reason;
+        if (! best) {
+            n->sta_status = WL_NO_SSID_AVAIL;
+            reason = WIFI_DISCONNECT_REASON_NO_AP_FOUND;
+        } else if (best->password != pass) {
+            n->sta_status = WL_CONNECT_FAILED;
+            reason = WIFI_DISCONNECT_REASON_AUTH_FAIL;
+        } else if ((int)best->stations.size() >= best->max_conn) {
+            n->sta_status = WL_CONNECT_FAILED;
+            reason = WIFI_DISCONNECT_REASON_ASSOC_TOOMANY;
+        } else {
+            best->stations.push_back(n);
+            n->sta_ap = best;
+            if (best->owner) {
+                Node *owner = best->owner;
+                WiFiEventSoftAPModeStationConnected event;
+                memcpy(event.mac, n->sta_mac, 6);
+                event.aid = best->stations.size();
+                at(now() + params.hop_latency, owner, [owner, event] () {
+                    fire(owner->ap_connect_handlers, event);
+                });
+            }
+            at(now() + params.dhcp_time, n, [this, n, gen, best] () {
+                if (n->sta_gen != gen || n->sta_ap != best) {
+                    return;
+                }
+                n->sta_ip = IPAddress(best->ip[0], best->ip[1], best->ip[2], best->next_host++);
+                n->sta_status = WL_CONNECTED;
+                WiFiEventStationModeGotIP event;
+                event.ip = n->sta_ip;
+                event.mask = IPAddress(255, 255, 255, 0);
+                event.gw = best->ip;
+                fire(n->got_ip_handlers, event);
+            });
+            return;
+        }
+        fire_disconnect(n, ssid, bssid, reason);
+    });
+}
+
+void World::wifi_disconnect(Node *n, WiFiDisconnectReason reason, bool notify) {
+    n->sta_gen++;
+    AccessPoint *ap = n->sta_ap;
+    if (! ap) {
+        if (n->sta_status != WL_CONNECTED) {
+            n->sta_status = WL_DISCONNECTED;
+        }
+        return;
+    }
+    ap->stations.erase(std::remove(ap->stations.begin(), ap->stations.end(), n), ap->stations.end());
+    if (ap->owner) {
+        Node *owner = ap->owner;
+        WiFiEventSoftAPModeStationDisconnected event;
+        memcpy(event.mac, n->sta_mac, 6);
+        event.aid = 0;
+        at(now() + params.hop_latency, owner, [owner, event] () {
+            fire(owner->ap_disconnect_handlers, event);
+        });
+    }
+    drop_link(n->id, link_id(ap), 0, params.tcp_abort_delay);
+    n->sta_ap = NULL;
+    n->sta_ip = IPAddress();
+    n->sta_status = WL_DISCONNECTED;
+    if (notify) {
+        fire_disconnect(n, ap->ssid, ap->bssid, reason);
+    }
+}
+
+void World::ap_start(Node *n, const char *ssid, const char *pass, int channel, bool hidden, int max_conn) {
+    if (n->ap) {
+        ap_stop(n, WIFI_DISCONNECT_REASON_AUTH_LEAVE, params.hop_latency);
+    }
+    AccessPoint *ap = new AccessPoint();
+    ap->ssid = ssid ? ssid : "";
+    ap->password = pass ? pass : "";
+    memcpy(ap->bssid, n->ap_mac, 6);
+    ap->hidden = hidden;
+    ap->channel = channel;
+    ap->max_conn = max_conn;
+    ap->ip = n->ap_ip;
+    ap->x = n->x;
+    ap->y = n->y;
+    ap->owner = n;
+    n->ap = ap;
+    _node_aps.push_back(ap);
+}
+
+void World::ap_stop(Node *n, WiFiDisconnectReason reason, usec_t delay) {
+    AccessPoint *ap = n->ap;
+    if (! ap) {
+        return;
+    }
+    ap->up = false;
+    n->ap = NULL;
+    _node_aps.erase(std::remove(_node_aps.begin(), _node_aps.end(), ap), _node_aps.end());
+    std::vector<Node *> stations = ap->stations;
+    ap->stations.clear();
+    for (Node *s : stations) {
+        drop_link(s->id, n->id, delay, 0);
+        at(now() + delay, s, [this, s, ap, reason] () {
+            if (s->sta_ap != ap) {
+                return;
+            }
+            s->sta_gen++;
+            s->sta_ap = NULL;
+            s->sta_ip = IPAddress();
+            s->sta_status = WL_DISCONNECTED;
+            fire_disconnect(s, ap->ssid, ap->bssid, reason);
+        });
+    }
+    //AccessPoint objects are never freed so that stale references held by stations stay valid
+}
+
+} //namespace sim
+
+wl_status_t ESP8266WiFiClass::begin(const char *ssid, const char *passphrase, int32_t channel, const uint8_t *bssid, bool connect) {
+    Node *n = node();
+    n->mode = (WiFiMode_t)(n->mode | WIFI_STA);
+    if (connect) {
+        World::get().wifi_begin(n, ssid, passphrase, channel, bssid);
+    }
+    return n->sta_status;
+}
+
+bool ESP8266WiFiClass::disconnect(bool wifioff) {
+    Node *n = node();
+    World::get().wifi_disconnect(n, WIFI_DISCONNECT_REASON_ASSOC_LEAVE, true);
+    if (wifioff) {
+        n->mode = (WiFiMode_t)(n->mode & ~WIFI_STA);
+    }
+    return true;
+}
+
+bool ESP8266WiFiClass::isConnected() {
+    return status() == WL_CONNECTED;
+}
+
+wl_status_t ESP8266WiFiClass::status() {
+    return node()->sta_status;
+}
+
+bool ESP8266WiFiClass::mode(WiFiMode_t m) {
+    Node *n = node();
+    World &w = World::get();
+    if (! (m & WIFI_AP) && n->ap) {
+        w.ap_stop(n, WIFI_DISCONNECT_REASON_AUTH_LEAVE, w.params.hop_latency);
+    }
+    if (! (m & WIFI_STA) && n->sta_ap) {
+        w.wifi_disconnect(n, WIFI_DISCONNECT_REASON_ASSOC_LEAVE, true);
+    }
+    n->mode = m;
+    return true;
+}
+
+WiFiMode_t ESP8266WiFiClass::getMode() {
+    return node()->mode;
+}
+
+int32_t ESP8266WiFiClass::channel() {
+    Node *n = node();
+    if (n->sta_ap) {
+        return n->sta_ap->channel;
+    }
+    return n->ap ? n->ap->channel : 1;
+}
+
+IPAddress ESP8266WiFiClass::localIP() {
+    return node()->sta_ip;
+}
+
+IPAddress ESP8266WiFiClass::gatewayIP() {
+    Node *n = node();
+    return n->sta_ap && n->sta_status == WL_CONNECTED ? n->sta_ap->ip : IPAddress();
+}
+
+IPAddress ESP8266WiFiClass::subnetMask() {
+    return IPAddress(255, 255, 255, 0);
+}
+
+String ESP8266WiFiClass::macAddress() {
+    Node *n = node();
+    return n->mac_string(n->sta_mac);
+}
+
+String ESP8266WiFiClass::SSID() {
+    Node *n = node();
+    return n->sta_ap ? String(n->sta_ap->ssid) : String();
+}
+
+String ESP8266WiFiClass::BSSIDstr() {
+    Node *n = node();
+    return n->sta_ap ? n->mac_string(n->sta_ap->bssid) : String();
+}
+
+int32_t ESP8266WiFiClass::RSSI() {
+    Node *n = node();
+    return n->sta_ap ? World::get().rssi(n, n->sta_ap) : 31;
+}
+
+int8_t ESP8266WiFiClass::scanNetworks(bool async, bool show_hidden) {
+    Node *n = node();
+    World &w = World::get();
+    if (n->scanning) {
+        return WIFI_SCAN_RUNNING;
+    }
+    w.wifi_scan(n, show_hidden);
+    if (async) {
+        return WIFI_SCAN_RUNNING;
+    }
+    //A blocking scan: run the clock forward on this node
+    w.consume(w.params.scan_time);
+    return WIFI_SCAN_FAILED;
+}
+
+int8_t ESP8266WiFiClass::scanComplete() {
+    Node *n = node();
+    if (n->scanning) {
+        return WIFI_SCAN_RUNNING;
+    }
+    if (n->scan_done) {
+        if (n->scan_ie_pending) {
+            //The SDK reports vendor IEs as beacons arrive; here they all arrive with the results
+            n->scan_ie_pending = false;
+            for (sim::ScanResult &res : n->scan_results) {
+                if (n->user_ie_cb && res.ie.size() >= 5) {
+                    n->user_ie_cb(USER_IE_BEACON, res.bssid, &res.ie[2], res.ie.data(), res.ie.size(), res.rssi);
+                }
+            }
+        }
+        return n->scan_results.size();
+    }
+    return WIFI_SCAN_FAILED;
+}
+
+void ESP8266WiFiClass::scanDelete() {
+    Node *n = node();
+    n->scan_results.clear();
+    n->scan_done = false;
+}
+
+String ESP8266WiFiClass::SSID(uint8_t i) {
+    Node *n = node();
+    return i < n->scan_results.size() ? String(n->scan_results[i].ssid) : String();
+}
+
+int32_t ESP8266WiFiClass::RSSI(uint8_t i) {
+    Node *n = node();
+    return i < n->scan_results.size() ? n->scan_results[i].rssi : 0;
+}
+
+uint8_t *ESP8266WiFiClass::BSSID(uint8_t i) {
+    Node *n = node();
+    return i < n->scan_results.size() ? n->scan_results[i].bssid : NULL;
+}
+
+String ESP8266WiFiClass::BSSIDstr(uint8_t i) {
+    Node *n = node();
+    return i < n->scan_results.size() ? n->mac_string(n->scan_results[i].bssid) : String();
+}
+
+int32_t ESP8266WiFiClass::channel(uint8_t i) {
+    Node *n = node();
+    return i < n->scan_results.size() ? n->scan_results[i].channel : 0;
+}
+
+bool ESP8266WiFiClass::isHidden(uint8_t i) {
+    Node *n = node();
+    return i < n->scan_results.size() ? n->scan_results[i].hidden : false;
+}
+
+bool ESP8266WiFiClass::softAP(const char *ssid, const char *passphrase, int channel, int ssid_hidden, int max_connection) {
+    Node *n = node();
+    n->mode = (WiFiMode_t)(n->mode | WIFI_AP);
+    World::get().ap_start(n, ssid, passphrase, channel, ssid_hidden, max_connection);
+    return true;
+}
+
+bool ESP8266WiFiClass::softAPConfig(IPAddress local_ip, IPAddress gateway, IPAddress subnet) {
+    Node *n = node();
+    n->ap_ip = local_ip;
+    n->ap_gw = gateway;
+    return true;
+}
+
+bool ESP8266WiFiClass::softAPdisconnect(bool wifioff) {
+    Node *n = node();
+    World &w = World::get();
+    w.ap_stop(n, WIFI_DISCONNECT_REASON_AUTH_LEAVE, w.params.hop_latency);
+    if (wifioff) {
+        n->mode = (WiFiMode_t)(n->mode & ~WIFI_AP);
+    }
+    return true;
+}
+
+uint8_t ESP8266WiFiClass::softAPgetStationNum() {
+    Node *n = node();
+    return n->ap ? n->ap->stations.size() : 0;
+}
+
+IPAddress ESP8266WiFiClass::softAPIP() {
+    return node()->ap_ip;
+}
+
+String ESP8266WiFiClass::softAPmacAddress() {
+    Node *n = node();
+    return n->mac_string(n->ap_mac);
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> f) {
+    return add_handler(node()->got_ip_handlers, f);
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> f) {
+    return add_handler(node()->disconnect_handlers, f);
+}
+
+WiFiEventHandler ESP8266WiFiClass::onSoftAPModeStationConnected(std::function<void(const WiFiEventSoftAPModeStationConnected&)> f) {
+    return add_handler(node()->ap_connect_handlers, f);
+}
+
+WiFiEventHandler ESP8266WiFiClass::onSoftAPModeStationDisconnected(std::function<void(const WiFiEventSoftAPModeStationDisconnected&)> f) {
+    return add_handler(node()->ap_disconnect_handlers, f);
+}
+
+extern "C" struct station_info *wifi_softap_get_station_info(void) {
+    static struct station_info list[16];
+    Node *n = node();
+    if (! n->ap || n->ap->stations.empty()) {
+        return NULL;
+    }
+    size_t count = std::min(n->ap->stations.size(), sizeof(list) / sizeof(list[0]));
+    for (size_t i = 0; i < count; i++) {
+        Node *s = n->ap->stations[i];
+        memcpy(list[i].bssid, s->sta_mac, 6);
+        list[i].ip.addr = s->sta_ip;
+        list[i].next.stqe_next = i + 1 < count ? &list[i + 1] : NULL;
+    }
+    return list;
+}
+
+extern "C" bool wifi_set_user_ie(bool enable, uint8_t *m_oui, user_ie_type type, uint8_t *user_ie, uint8_t len) {
+    Node *n = node();
+    if (type != USER_IE_BEACON && type != USER_IE_PROBE_RESP) {
+        return true;
+    }
+    n->user_ie.clear();
+    if (enable) {
+        n->user_ie.push_back(0xdd);
+        n->user_ie.push_back(3 + len);
+        n->user_ie.insert(n->user_ie.end(), m_oui, m_oui + 3);
+        n->user_ie.insert(n->user_ie.end(), user_ie, user_ie + len);
+    }
+    return true;
+}
+
+extern "C" int wifi_register_user_ie_manufacturer_recv_cb(user_ie_manufacturer_recv_cb_t cb) {
+    node()->user_ie_cb = cb;
+    return 0;
+}
+
+extern "C" void wifi_unregister_user_ie_manufacturer_recv_cb(void) {
+    node()->user_ie_cb = NULL;
+}
+
+extern "C" void wifi_softap_free_station_info(void) {
+}
@@ -0,0 +1,393 @@
+// Event loop, topology and radio model for the ESP8266MQTTMesh host simulation
+#include "sim.h"
+#include "ESP8266MQTTMesh.h"
+
+#include <chrono>
+#include <algorithm>
+
+namespace sim {
+
+World &World::get() {
+    static World world;
+    return world;
+}
+
+Node::Node(int id, double x, double y) : id(id), x(x), y(y) {
+    static const uint8_t oui[3] = {0x5C, 0xCF, 0x7F};
+    memcpy(sta_mac, oui, 3);
+    sta_mac[3] = 0xA0;
+    sta_mac[4] = (id >> 8) & 0xff;
+    sta_mac[5] = id & 0xff;
+    memcpy(ap_mac, sta_mac, 6);
+    ap_mac[0] |= 0x02;   //The soft-AP uses the locally administered variant of the station MAC
+    chip_id = (sta_mac[3] << 16) | (sta_mac[4] << 8) | sta_mac[5];
+    char buf[16];
+    snprintf(buf, sizeof(buf), "node%d", id);
+    name = buf;
+}
+
+Node::~Node() {
+}
+
+String Node::mac_string(const uint8_t *mac) const {
+    char buf[18];
+    snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return String(buf);
+}
+
+uint8_t *Node::flash_data() {
+    if (flash.empty()) {
+        flash.assign(World::get().params.flash_size, 0xff);
+    }
+    return flash.data();
+}
+
+AccessPoint *World::add_router(const char *ssid, const char *password, double x, double y, int channel) {
+    AccessPoint *ap = new AccessPoint();
+    ap->ssid = ssid;
+    ap->password = password;
+    ap->bssid[0] = 0x00; ap->bssid[1] = 0x1A; ap->bssid[2] = 0x2B;
+    ap->bssid[3] = 0x00; ap->bssid[4] = 0x00; ap->bssid[5] = routers.size() + 1;
+    ap->hidden = false;
+    ap->channel = channel;
+    ap->max_conn = 64;
+    ap->ip = IPAddress(10, 0, routers.size(), 1);
+    ap->x = x;
+    ap->y = y;
+    ap->owner = NULL;
+    routers.push_back(ap);
+    return ap;
+}
+
+Node *World::add_node(double x, double y) {
+    Node *n = new Node(nodes.size(), x, y);
+    nodes.push_back(n);
+    return n;
+}
+
+void World::set_rssi(int a, int b, int rssi) {
+    _rssi[std::make_pair(std::min(a, b), std::max(a, b))] = rssi;
+}
+
+int World::link_id(const AccessPoint *ap) const {
+    if (ap->owner) {
+        return ap->owner->id;
+    }
+    for (size_t i = 0; i < routers.size(); i++) {
+        if (routers[i] == ap) {
+            return router_id(i);
+        }
+    }
+    return router_id(0);
+}
+
+int World::rssi(const Node *sta, const AccessPoint *ap) const {
+    if (! _rssi.empty()) {
+        int a = sta->id;
+        int b = link_id(ap);
+        auto it = _rssi.find(std::make_pair(std::min(a, b), std::max(a, b)));
+        return it == _rssi.end() ? -120 : it->second;
+    }
+    double d = std::max(1.0, hypot(sta->x - ap->x, sta->y - ap->y));
+    return (int)lround(params.rssi_at_1m - 10.0 * params.path_loss_exp * log10(d));
+}
+
+Node *World::parent(const Node *n) const {
+    if (! n->sta_ap || n->sta_status != WL_CONNECTED) {
+        return NULL;
+    }
+    return n->sta_ap->owner;
+}
+
+int World::depth(const Node *n) const {
+    int hops = 0;
+    while (n) {
+        if (! n->sta_ap || n->sta_status != WL_CONNECTED || hops > (int)nodes.size()) {
+            return -1;
+        }
+        hops++;
+        n = n->sta_ap->owner;
+    }
+    return hops;
+}
+
+usec_t World::now() const {
+    return _now + (_current ? _current->consumed : 0);
+}
+
+void World::consume(usec_t us) {
+    if (_current) {
+        _current->consumed += us;
+        _current->stats.busy_us += us;
+    }
+}
+
+void World::at(usec_t when, Node *node, std::function<void()> fn) {
+    Event e;
+    e.t = std::max(when, now());
+    e.seq = _seq++;
+    e.node = node;
+    e.epoch = node ? node->epoch : 0;
+    e.fn = fn;
+    e.loop = false;
+    _events.push(e);
+}
+
+//Run the node's loop() once it is free.  Arduino runs loop() continuously between system
+//tasks; calling it only after an event, and again while it keeps finding work, is equivalent
+void World::queue_loop(Node *n) {
+    if (n->loop_pending) {
+        return;
+    }
+    n->loop_pending = true;
+    Event e;
+    e.t = std::max(n->busy_until, _now);
+    e.seq = _seq++;
+    e.node = n;
+    e.epoch = n->epoch;
+    e.fn = [n] () {
+        n->loop_pending = false;
+        n->loop();
+    };
+    e.loop = true;
+    _events.push(e);
+}
+
+void World::call(Node *n, std::function<void()> fn) {
+    Node *prev = _current;
+    _current = n;
+    fn();
+    _current = prev;
+}
+
+void World::dispatch(Event &e) {
+    Node *n = e.node;
+    if (n) {
+        if (e.epoch != n->epoch) {
+            //Scheduled before the node lost power
+            return;
+        }
+        if (n->busy_until > e.t) {
+            //The node is still blocked by earlier work.  Keep the original sequence so ordering is preserved
+            e.t = n->busy_until;
+            _events.push(e);
+            return;
+        }
+    }
+    _now = e.t;
+    _current = n;
+    if (n) {
+        n->consumed = 0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool restart = false;
+    try {
+        e.fn();
+    } catch (Restart &) {
+        restart = true;
+    }
+    if (n) {
+        n->stats.cpu_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        n->stats.events++;
+        usec_t used = n->consumed;
+        n->busy_until = _now + n->consumed;
+        n->consumed = 0;
+        if (! restart && n->loop && n->powered && (! e.loop || used)) {
+            queue_loop(n);
+        }
+        if (restart) {
+            n->stats.restarts++;
+            _now = n->busy_until;
+            power_off(n);
+            if (n->eboot_pending) {
+                uint8_t *flash = n->flash_data();
+                if (n->eboot.action == ACTION_COPY_RAW && n->eboot.args[0] + n->eboot.args[2] <= params.flash_size) {
+                    memmove(flash + n->eboot.args[1], flash + n->eboot.args[0], n->eboot.args[2]);
+                }
+                n->eboot_pending = false;
+            }
+            power_on(n, _now + 500000);
+        }
+    }
+    _current = NULL;
+}
+
+void World::run_until(usec_t t) {
+    while (! _events.empty() && _events.top().t <= t) {
+        Event e = _events.top();
+        _events.pop();
+        dispatch(e);
+    }
+    if (_now < t) {
+        _now = t;
+    }
+}
+
+bool World::run_until(usec_t limit, std::function<bool()> done, usec_t poll) {
+    while (_now < limit) {
+        if (done()) {
+            return true;
+        }
+        run_until(std::min(limit, _now + poll));
+    }
+    return done();
+}
+
+void World::power_on(Node *n, usec_t when) {
+    at(when, n, [this, n] () {
+        n->powered = true;
+        n->loop_pending = false;
+        n->mode = WIFI_STA;
+        n->sta_status = WL_IDLE_STATUS;
+        n->busy_until = 0;
+        if (n->create) {
+            n->mesh = n->create();
+        }
+    });
+}
+
+void World::power_off(Node *n) {
+    Node *prev = _current;
+    _current = n;
+    ap_stop(n, WIFI_DISCONNECT_REASON_BEACON_TIMEOUT, params.beacon_timeout);
+    if (n->sta_ap) {
+        AccessPoint *ap = n->sta_ap;
+        ap->stations.erase(std::remove(ap->stations.begin(), ap->stations.end(), n), ap->stations.end());
+        drop_link(n->id, link_id(ap), NEVER, params.tcp_abort_delay);
+        n->sta_ap = NULL;
+    }
+    n->sta_status = WL_IDLE_STATUS;
+    n->sta_gen++;
+    n->scanning = false;
+    n->scan_done = false;
+    n->scan_ie_pending = false;
+    n->user_ie.clear();
+    n->user_ie_cb = NULL;
+    n->fs_mounted = false;
+    n->powered = false;
+    n->epoch++;
+    if (n->mesh) {
+        delete n->mesh;
+        n->mesh = NULL;
+    }
+    //ESP8266MQTTMesh does not own its AsyncClients, so reclaim whatever is left
+    std::vector<AsyncClient *> leftover;
+    for (auto &it : _clients) {
+        if (it.second->_node == n) {
+            leftover.push_back(it.second);
+        }
+    }
+    for (AsyncClient *c : leftover) {
+        delete c;
+    }
+    n->got_ip_handlers.clear();
+    n->disconnect_handlers.clear();
+    n->ap_connect_handlers.clear();
+    n->ap_disconnect_handlers.clear();
+    _current = prev;
+}
+
+void World::reset_stats() {
+    _links.clear();
+    broker.messages = 0;
+    broker.bytes = 0;
+    for (Node *n : nodes) {
+        n->stats = NodeStats();
+    }
+}
+
+usec_t World::transmit(int from, int to, size_t payload, usec_t start) {
+    if (start < now()) {
+        start = now();
+    }
+    std::pair<int, int> key(from, to);
+    usec_t &busy = _link_busy[key];
+    if (busy > start) {
+        start = busy;
+    }
+    size_t bytes = payload + params.frame_overhead;
+    usec_t airtime = (usec_t)(bytes * 8 * 1000000.0 / params.link_bps);
+    busy = start + airtime;
+    LinkStats &stats = _links[key];
+    stats.bytes += bytes;
+    stats.payload += payload;
+    stats.segments++;
+    return busy + params.hop_latency;
+}
+
+uint32_t World::register_ticker(Ticker *t) {
+    uint32_t id = _next_id++;
+    _tickers[id] = t;
+    return id;
+}
+
+void World::unregister_ticker(Ticker *t) {
+    for (auto it = _tickers.begin(); it != _tickers.end(); ++it) {
+        if (it->second == t) {
+            _tickers.erase(it);
+            return;
+        }
+    }
+}
+
+Ticker *World::ticker(uint32_t id) const {
+    auto it = _tickers.find(id);
+    return it == _tickers.end() ? NULL : it->second;
+}
+
+} //namespace sim
+
+Ticker::Ticker() {
+    sim::World &w = sim::World::get();
+    _node = w.current();
+    _id = w.register_ticker(this);
+}
+
+Ticker::~Ticker() {
+    sim::World::get().unregister_ticker(this);
+}
+
+void Ticker::detach() {
+    _armed = false;
+    _gen++;
+}
+
+void Ticker::_attach(uint32_t ms, bool repeat, std::function<void()> fn) {
+    sim::World &w = sim::World::get();
+    if (! _node) {
+        _node = w.current();
+    }
+    _gen++;
+    _armed = true;
+    _ms = ms;
+    _repeat = repeat;
+    _fn = fn;
+    uint32_t id = _id;
+    uint32_t gen = _gen;
+    w.after((sim::usec_t)ms * 1000, _node, [id, gen] () {
+        Ticker *t = sim::World::get().ticker(id);
+        if (t) {
+            t->_fire(gen);
+        }
+    });
+}
+
+void Ticker::_fire(uint32_t gen) {
+    if (gen != _gen || ! _armed) {
+        return;
+    }
+    //Keep a copy: the callback may re-arm this Ticker and replace _fn
+    std::function<void()> fn = _fn;
+    if (_repeat) {
+        uint32_t id = _id;
+        sim::World::get().after((sim::usec_t)_ms * 1000, _node, [id, gen] () {
+            Ticker *t = sim::World::get().ticker(id);
+            if (t) {
+                t->_fire(gen);
+            }
+        });
+    } else {
+        _armed = false;
+    }
+    fn();
+}
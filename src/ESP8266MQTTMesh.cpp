@@ -17,9 +17,10 @@
 
 #include "ESP8266MQTTMesh.h"
 
-#define MESH_API_VER "001"
+#define MESH_API_VER "002"
 
 #include "Base64.h"
+#include "MeshLZ.h"
 #include "eboot_command.h"
 
 #include <limits.h>
@@ -58,6 +59,57 @@ size_t mesh_strlcat (char *dst, const char *src, size_t len) {
 }
 #define strlcat mesh_strlcat
 
+//Copy len bytes starting offset bytes into the queue out of the ring
+static void queue_copy(const send_queue_t *q, size_t offset, void *dst, size_t len) {
+    size_t pos = (q->head + offset) % ESP8266_SEND_QUEUE_LEN;
+    size_t chunk = ESP8266_SEND_QUEUE_LEN - pos < len ? ESP8266_SEND_QUEUE_LEN - pos : len;
+    memcpy(dst, q->buf + pos, chunk);
+    memcpy((char *)dst + chunk, q->buf, len - chunk);
+}
+
+//The SDK reports vendor IEs without saying to whom, so they go to the table of the instance that
+//is scanning.  It is NULL between scans
+static mesh_ie_table_t *ieTable = NULL;
+
+static void mesh_ie_recv(user_ie_type type, const uint8 sa[6], const uint8 m_oui[3], uint8 *ie, uint8 len, sint32 rssi) {
+    static const uint8_t oui[3] = MESH_IE_OUI;
+    mesh_ie_table_t *t = ieTable;
+    //ie is the whole element: id, length, OUI, then our data
+    if (! t || len < 5 + MESH_IE_LEN || memcmp(m_oui, oui, 3) != 0 || ie[5] != 'E' || ie[6] != 'M') {
+        return;
+    }
+    int i;
+    for (i = 0; i < t->len; i++) {
+        if (memcmp(t->ie[i].bssid, sa, 6) == 0) {
+            break;
+        }
+    }
+    if (i == t->len) {
+        if (t->len == t->size) {
+            //Grown as mesh APs are heard, and freed once the scan has been ranked
+            mesh_ie_t *grown = t->size < MESH_IE_MAX ? (mesh_ie_t *)realloc(t->ie, (t->size + 8) * sizeof(mesh_ie_t)) : NULL;
+            if (! grown) {
+                return;
+            }
+            t->ie = grown;
+            t->size += 8;
+        }
+        t->len++;
+        memcpy(t->ie[i].bssid, sa, 6);
+    }
+    t->ie[i].depth = ie[7];
+    t->ie[i].children = ie[8];
+    t->ie[i].free = ie[9];
+}
+
+static const mesh_ie_t *find_ie(const mesh_ie_table_t *t, const uint8_t *bssid) {
+    for (int i = 0; i < t->len; i++) {
+        if (memcmp(t->ie[i].bssid, bssid, 6) == 0) {
+            return &t->ie[i];
+        }
+    }
+    return NULL;
+}
 
 
 ESP8266MQTTMesh::ESP8266MQTTMesh(const wifi_conn *networks, const char *network_password,
@@ -176,10 +228,12 @@ void ESP8266MQTTMesh::begin() {
         die();
       }
     }
-    Dir dir = SPIFFS.openDir("/bssid/");
-    while(dir.next()) {
-      dbgPrintln(EMMDBG_FS, " ==> '" + dir.fileName() + "'");
-    }
+    load_bssids();
+    load_parent();
+    load_outbox();
+    //Start message IDs somewhere new each boot, so the gateway doesn't take them for copies of
+    //messages we sent before
+    nextMsgId = ESP.getCycleCount() ^ ESP.getChipId();
     WiFi.disconnect();
     // In the ESP8266 2.3.0 API, there seems to be a bug which prevents a node configured as
     // WIFI_AP_STA from openning a TCP connection to it's gateway if the gateway is also
@@ -191,6 +245,7 @@ void ESP8266MQTTMesh::begin() {
     //wifiDHCPTimeoutHandler = WiFi.onStationModeDHCPTimeout(      [this] () {                                                  this->onDHCPTimeout();     });
     wifiAPConnectHandler   = WiFi.onSoftAPModeStationConnected(  [this] (const WiFiEventSoftAPModeStationConnected& ip) {     this->onAPConnect(ip);     });
     wifiAPDisconnectHandler= WiFi.onSoftAPModeStationDisconnected([this] (const WiFiEventSoftAPModeStationDisconnected& ip) { this->onAPDisconnect(ip);  });
+    wifi_register_user_ie_manufacturer_recv_cb(mesh_ie_recv);
 
     espClient[0]->setNoDelay(true);
     espClient[0]->onConnect(   [this](void * arg, AsyncClient *c)                           { this->onConnect(c);         }, this);
@@ -260,16 +315,80 @@ void ESP8266MQTTMesh::getMAC(IPAddress ip, uint8 *mac) {
     memset(mac, 0, 6);
 }
 
+//Arm timer 'id' to run fn 'seconds' from now (and every 'seconds' after that if 'repeat'),
+//replacing whatever the timer was armed with
+void ESP8266MQTTMesh::start_timer(int id, float seconds, void (*fn)(ESP8266MQTTMesh *e), bool repeat) {
+    mesh_timer_t *t = &timers[id];
+    uint32_t ms = seconds * 1000;
+    t->fn = fn;
+    t->due = millis() + ms;
+    t->period = repeat && ms ? ms : 0;
+    t->armed = true;
+    if (! timersRunning) {
+        arm_timers();
+    }
+}
+
+void ESP8266MQTTMesh::timer_cancel(int id) {
+    timers[id].armed = false;
+    if (! timersRunning) {
+        arm_timers();
+    }
+}
+
+//Set the Ticker for the earliest armed timer.  There are only a handful, so a scan is cheaper
+//than keeping them sorted
+void ESP8266MQTTMesh::arm_timers() {
+    uint32_t now = millis();
+    int32_t next = INT32_MAX;
+    for (int i = 0; i < TIMER_LAST; i++) {
+        if (timers[i].armed && (int32_t)(timers[i].due - now) < next) {
+            next = timers[i].due - now;
+        }
+    }
+    if (next == INT32_MAX) {
+        schedule.detach();
+        return;
+    }
+    schedule.once_ms(next > 0 ? next : 0, run_timers, this);
+}
+
+bool ESP8266MQTTMesh::timer_due() {
+    uint32_t now = millis();
+    for (int i = 0; i < TIMER_LAST; i++) {
+        if (timers[i].armed && (int32_t)(now - timers[i].due) >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ESP8266MQTTMesh::run_timers() {
+    timersRunning = true;
+    for (int i = 0; i < TIMER_LAST; i++) {
+        mesh_timer_t *t = &timers[i];
+        if (! t->armed || (int32_t)(millis() - t->due) < 0) {
+            continue;
+        }
+        if (t->period) {
+            //Skip runs we were too busy to make rather than firing them back to back
+            t->due = millis() + t->period;
+        } else {
+            t->armed = false;
+        }
+        t->fn(this);
+    }
+    timersRunning = false;
+    arm_timers();
+}
+
 bool ESP8266MQTTMesh::connected() {
     return wifiConnected() && ((meshConnect && espClient[0] && espClient[0]->connected()) || mqttClient.connected());
 }
 
 bool ESP8266MQTTMesh::match_bssid(const char *bssid) {
-    char filename[32];
     dbgPrintln(EMMDBG_WIFI, "Trying to match known BSSIDs for " + String(bssid));
-    strlcpy(filename, "/bssid/", sizeof(filename));
-    strlcat(filename, bssid, sizeof(filename));
-    return SPIFFS.exists(filename);
+    return get_subdomain(bssid) != -1;
 }
 
 void ESP8266MQTTMesh::scan() {
@@ -280,18 +399,44 @@ void ESP8266MQTTMesh::scan() {
             ap[i].ssid_idx = NETWORK_LAST_INDEX;
         }
         ap_idx = 0;
+        retry_connect = 1;
+        parentConnect = false;
+        refreshing = false;
         WiFi.disconnect();
-        WiFi.mode(WIFI_STA);
+        if (! AP_ready) {
+            WiFi.mode(WIFI_STA);
+        }
         dbgPrintln(EMMDBG_WIFI, "Scanning for networks");
-        WiFi.scanDelete();
-        WiFi.scanNetworks(true,true);
+        start_scan();
         scanning = true;
     }
-    int numberOfNetworksFound = WiFi.scanComplete();
+    int numberOfNetworksFound = scan_complete();
     if (numberOfNetworksFound < 0) {
         return;
     }
     scanning = false;
+    rank_aps(numberOfNetworksFound);
+}
+
+void ESP8266MQTTMesh::start_scan() {
+    WiFi.scanDelete();
+    seenIE.len = 0;
+    ieTable = &seenIE;
+    WiFi.scanNetworks(true,true);
+}
+
+int ESP8266MQTTMesh::scan_complete() {
+    //The IEs may also be reported as the results are read
+    ieTable = &seenIE;
+    return WiFi.scanComplete();
+}
+
+//Fill ap[] with the usable APs from the last scan, cheapest first
+void ESP8266MQTTMesh::rank_aps(int numberOfNetworksFound) {
+    for(int i = 0; i < LAST_AP; i++) {
+        ap[i].rssi = -99999;
+        ap[i].ssid_idx = NETWORK_LAST_INDEX;
+    }
     dbgPrintln(EMMDBG_WIFI, "Found: " + String(numberOfNetworksFound));
     int ssid_idx;
     for(int i = 0; i < numberOfNetworksFound; i++) {
@@ -300,36 +445,228 @@ void ESP8266MQTTMesh::scan() {
         int rssi = WiFi.RSSI(i);
         dbgPrintln(EMMDBG_WIFI, "Found SSID: '" + WiFi.SSID(i) + "' BSSID '" + WiFi.BSSIDstr(i) + "'" + "RSSI: " + String(rssi));
         if (IS_GATEWAY) {
-            network_idx = match_networks(WiFi.SSID().c_str(), WiFi.BSSIDstr(i).c_str());
+            network_idx = match_networks(WiFi.SSID(i).c_str(), WiFi.BSSIDstr(i).c_str());
         }
         if(network_idx == NETWORK_MESH_NODE) {
-            if (! WiFi.SSID(i).length()) {
+            if (WiFi.SSID(i).length()) {
                 dbgPrintln(EMMDBG_WIFI, "Did not match SSID list");
                 continue;
             } else {
-                if (! match_bssid(WiFi.BSSIDstr(i).c_str())) {
+                int subdomain = get_subdomain(WiFi.BSSID(i));
+                if (subdomain == -1) {
                     dbgPrintln(EMMDBG_WIFI, "Failed to match BSSID");
                     continue;
                 }
+                if (AP_ready && get_route(subdomain)) {
+                    //Our AP is up, so nodes below us are still attached
+                    dbgPrintln(EMMDBG_WIFI, "Node is in our subtree");
+                    continue;
+                }
             }
         }
-        //sort by RSSI
+        //A network is depth 0.  Prefer shallow parents with few children unless their signal is
+        //much weaker
+        uint8_t apDepth = 0;
+        int cost = -rssi;
+        if (network_idx == NETWORK_MESH_NODE) {
+            const mesh_ie_t *ie = find_ie(&seenIE, WiFi.BSSID(i));
+            apDepth = ie ? ie->depth : MESH_DEPTH_UNKNOWN;
+            cost += ESP8266_HOP_COST * (apDepth == MESH_DEPTH_UNKNOWN ? MESH_UNKNOWN_HOPS : apDepth);
+            if (ie) {
+                cost += ESP8266_LOAD_COST * ie->children + (ie->free ? 0 : MESH_FULL_COST);
+            }
+        }
+        dbgPrintln(EMMDBG_WIFI_EXTRA, "Depth: " + String(apDepth) + " Cost: " + String(cost));
+        //sort by cost
         for(int j = 0; j < LAST_AP; j++) {
-            if(ap[j].ssid_idx == NETWORK_LAST_INDEX ||
-               (network_idx >= 0 &&
-                  (ap[j].ssid_idx == NETWORK_MESH_NODE || rssi > ap[j].rssi)) ||
-               (network_idx == NETWORK_MESH_NODE && ap[j].ssid_idx == NETWORK_MESH_NODE && rssi > ap[j].rssi))
-            {
+            if(ap[j].ssid_idx == NETWORK_LAST_INDEX || cost < ap[j].cost) {
                 for(int k = LAST_AP -1; k > j; k--) {
                     ap[k] = ap[k-1];
                 }
                 ap[j].rssi = rssi;
                 ap[j].ssid_idx = network_idx;
+                ap[j].channel = WiFi.channel(i);
+                ap[j].depth = apDepth;
+                ap[j].cost = cost;
                 strlcpy(ap[j].bssid, WiFi.BSSIDstr(i).c_str(), sizeof(ap[j].bssid));
                 break;
             }
         }
     }
+    if (ieTable == &seenIE) {
+        ieTable = NULL;
+    }
+    free(seenIE.ie);
+    seenIE = {};
+}
+
+//While we are connected, rescan now and then without dropping our link, so that ap[] holds the
+//best alternatives to our parent if we lose it
+void ESP8266MQTTMesh::refresh_aps() {
+    if (connecting || scanning || failover || ! WiFi.isConnected()) {
+        //connect() has the scanner
+        refreshing = false;
+        return;
+    }
+    if (! refreshing) {
+        dbgPrintln(EMMDBG_WIFI, "Standby scan");
+        start_scan();
+        refreshing = true;
+    }
+    int numberOfNetworksFound = scan_complete();
+    if (numberOfNetworksFound < 0) {
+        timer_once(TIMER_SCAN_POLL, 0.5, refresh_aps);
+        return;
+    }
+    refreshing = false;
+    //Our parent stays first, followed by the alternatives
+    ap_t parent = ap[ap_idx];
+    rank_aps(numberOfNetworksFound);
+    int i;
+    for (i = 0; i < LAST_AP - 1; i++) {
+        if (ap[i].ssid_idx == NETWORK_LAST_INDEX || strcmp(ap[i].bssid, parent.bssid) == 0) {
+            break;
+        }
+    }
+    memmove(&ap[1], &ap[0], i * sizeof(ap_t));
+    ap[0] = parent;
+    ap_idx = 0;
+    parentConnect = false;
+}
+
+//Our upstream link is gone.  Rather than shut down our AP, which would send our whole subtree
+//looking for new parents, keep it up and hold what the subtree sends upstream in sendQueue[0]
+//until we have a new parent (see rejoin())
+void ESP8266MQTTMesh::start_failover() {
+    if (failover || ! AP_ready) {
+        return;
+    }
+    dbgPrintln(EMMDBG_WIFI, "Lost upstream, keeping our AP up");
+    failover = true;
+    failoverStart = millis();
+    depth = MESH_DEPTH_UNKNOWN;
+    advertise_AP();
+    send_queue_t *q = &sendQueue[0];
+    if (! q->buf) {
+        open_queue(0);
+    }
+    //What the old connection was given is lost, including the start of a frame
+    q->head = (q->head + q->partial) % ESP8266_SEND_QUEUE_LEN;
+    q->len -= q->partial;
+    q->partial = 0;
+    q->inflight = 0;
+    unalias_queue();
+}
+
+//We have a new parent and our AP stayed up.  Pass on what the subtree sent in the meantime, then
+//have it announce itself to its new ancestors
+void ESP8266MQTTMesh::rejoin() {
+    dbgPrintln(EMMDBG_WIFI, "Rejoined after " + String(millis() - failoverStart) + "ms");
+    failover = false;
+    connecting = false;
+    if (meshConnect) {
+        send_queued(0);
+        request_bssids();
+    } else {
+        send_queue_t *q = &sendQueue[0];
+        char *buf = alloc_recv_buf();
+        while (buf && q->len >= MESH_FRAME_HEADER_LEN) {
+            uint8_t header[MESH_FRAME_HEADER_LEN];
+            queue_copy(q, 0, header, sizeof(header));
+            size_t size = frame_size(header);
+            queue_copy(q, 0, buf, size);
+            q->head = (q->head + size) % ESP8266_SEND_QUEUE_LEN;
+            q->len -= size;
+            mesh_frame_t frame;
+            if (parse_frame((const uint8_t *)buf, size, &frame) > 0) {
+                relay_publish(&frame);
+            }
+        }
+        if (buf) {
+            free_recv_buf(buf);
+        }
+        close_queue(0);
+    }
+    announce_AP();
+}
+
+//Make the AP we were last connected through the only candidate, so that we can go straight to
+//it without a scan.  Returns false if there is none, or it is no longer usable
+bool ESP8266MQTTMesh::use_parent() {
+    if (! lastParent.channel) {
+        return false;
+    }
+    char bssid[19];
+    const uint8_t *mac = lastParent.bssid;
+    snprintf(bssid, sizeof(bssid), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    int network_idx = NETWORK_MESH_NODE;
+    if (lastParent.mesh) {
+        if (get_subdomain(mac) == -1) {
+            return false;
+        }
+    } else {
+        if (IS_GATEWAY) {
+            network_idx = match_networks(lastParent.ssid, bssid);
+        }
+        if (network_idx == NETWORK_MESH_NODE) {
+            return false;
+        }
+    }
+    for(int i = 0; i < LAST_AP; i++) {
+        ap[i].rssi = -99999;
+        ap[i].ssid_idx = NETWORK_LAST_INDEX;
+    }
+    ap[0].rssi = 0;
+    ap[0].ssid_idx = network_idx;
+    ap[0].channel = lastParent.channel;
+    ap[0].depth = lastParent.mesh ? lastParent.depth : 0;
+    strlcpy(ap[0].bssid, bssid, sizeof(ap[0].bssid));
+    ap_idx = 0;
+    retry_connect = 1;
+    parentConnect = true;
+    return true;
+}
+
+void ESP8266MQTTMesh::load_parent() {
+    File f = SPIFFS.open(PARENT_FILE, "r");
+    if (! f) {
+        return;
+    }
+    if (f.read((uint8_t *)&lastParent, sizeof(lastParent)) != sizeof(lastParent)) {
+        memset(&lastParent, 0, sizeof(lastParent));
+    }
+    lastParent.ssid[sizeof(lastParent.ssid) - 1] = 0;
+    f.close();
+}
+
+//Remember the AP we just connected through.  Called from the WiFi event, so the file is
+//written later from loop() (see drain_work())
+void ESP8266MQTTMesh::note_parent() {
+    parent_t parent = {};
+    if (! parse_mac(ap[ap_idx].bssid, parent.bssid)) {
+        return;
+    }
+    parent.channel = WiFi.channel();
+    parent.depth = ap[ap_idx].depth;
+    parent.mesh = meshConnect;
+    strlcpy(parent.ssid, WiFi.SSID().c_str(), sizeof(parent.ssid));
+    if (memcmp(&parent, &lastParent, sizeof(parent)) == 0) {
+        return;
+    }
+    lastParent = parent;
+    parentChanged = true;
+    if (! loopCalled) {
+        timer_once(TIMER_WORK, 0.0, drain_work);
+    }
+}
+
+void ESP8266MQTTMesh::save_parent() {
+    parentChanged = false;
+    File f = SPIFFS.open(PARENT_FILE, "w");
+    if (! f || f.write((const uint8_t *)&lastParent, sizeof(lastParent)) != sizeof(lastParent)) {
+        dbgPrintln(EMMDBG_MSG, "Failed to write " PARENT_FILE);
+    }
+    f.close();
 }
 
 int ESP8266MQTTMesh::match_networks(const char *ssid, const char *bssid)
@@ -366,8 +703,15 @@ int ESP8266MQTTMesh::match_networks(const char *ssid, const char *bssid)
 }
 
 void ESP8266MQTTMesh::schedule_connect(float delay) {
+#if HAS_OTA
+    if (ota.reboot_at) {
+        //A new image is waiting to be flashed, there is no point in reconnecting
+        ota_reboot();
+        return;
+    }
+#endif
     dbgPrintln(EMMDBG_WIFI, "Scheduling reconnect for " + String(delay,2)+ " seconds from now");
-    schedule.once(delay, connect, this);
+    timer_once(TIMER_CONNECT, delay, connect);
 }
 
 void ESP8266MQTTMesh::connect() {
@@ -376,8 +720,16 @@ void ESP8266MQTTMesh::connect() {
         return;
     }
     connecting = false;
-    retry_connect = 1;
     lastReconnect = millis();
+    if (failover && millis() - failoverStart > ESP8266_FAILOVER_TIME * 1000UL) {
+        dbgPrintln(EMMDBG_WIFI, "No new parent found, shutting down our AP");
+        shutdown_AP();
+    }
+    if (! scanning && parentTries && (ap_idx >= LAST_AP || ap[ap_idx].ssid_idx == NETWORK_LAST_INDEX || parentConnect)) {
+        //Try the AP we last connected through before paying for a scan
+        parentTries--;
+        use_parent();
+    }
     if (scanning || ap_idx >= LAST_AP ||  ap[ap_idx].ssid_idx == NETWORK_LAST_INDEX) {
         scan();
         if (ap_idx >= LAST_AP) {
@@ -396,21 +748,24 @@ void ESP8266MQTTMesh::connect() {
     for (int i = 0; i < LAST_AP; i++) {
         if (ap[i].ssid_idx == NETWORK_LAST_INDEX)
             break;
-        dbgPrintln(EMMDBG_WIFI, String(i) + String(i == ap_idx ? " * " : "   ") + String(ap[i].bssid) + " " + String(ap[i].rssi));
+        dbgPrintln(EMMDBG_WIFI, String(i) + String(i == ap_idx ? " * " : "   ") + String(ap[i].bssid) + " " + String(ap[i].rssi) + " " + String(ap[i].cost));
     }
     char ssid[64];
     if (ap[ap_idx].ssid_idx == NETWORK_MESH_NODE) {
         //This is a mesh node
         char subdomain_c[8];
-        char filename[32];
-        strlcpy(filename, "/bssid/", sizeof(filename));
-        strlcat(filename, ap[ap_idx].bssid, sizeof(filename));
-        int subdomain = read_subdomain(filename);
+        int subdomain = get_subdomain(ap[ap_idx].bssid);
         if (subdomain == -1) {
             ap_idx++;
             schedule_connect();
             return;
         }
+        if (AP_ready && get_route(subdomain)) {
+            //It joined our subtree since we last scanned
+            ap_idx++;
+            schedule_connect(0.0);
+            return;
+        }
         itoa(subdomain, subdomain_c, 10);
         strlcpy(ssid, base_ssid, sizeof(ssid));
         strlcat(ssid, subdomain_c, sizeof(ssid));
@@ -425,48 +780,31 @@ void ESP8266MQTTMesh::connect() {
     }
     dbgPrintln(EMMDBG_WIFI, "Connecting to SSID : '" + String(ssid) + "' BSSID '" + String(ap[ap_idx].bssid) + "'");
     const char *password = meshConnect ? mesh_password : network_password;
-    //WiFi.begin(ssid.c_str(), password.c_str(), 0, WiFi.BSSID(best_match), true);
-    WiFi.begin(ssid, password);
+    //Going to the BSSID and channel we found spares the SDK its own scan
+    uint8_t bssid[6];
+    if (ap[ap_idx].channel && parse_mac(ap[ap_idx].bssid, bssid)) {
+        WiFi.begin(ssid, password, ap[ap_idx].channel, bssid);
+    } else {
+        WiFi.begin(ssid, password);
+    }
     connecting = true;
     lastStatus = lastReconnect;
 }
 
-void ESP8266MQTTMesh::parse_message(const char *topic, const char *msg) {
+void ESP8266MQTTMesh::parse_message(const char *topic, const char *msg, int msgLen) {
   int inTopicLen = strlen(inTopic);
   if (strstr(topic, inTopic) != topic) {
       return;
   }
   const char *subtopic = topic + inTopicLen;
   if (strstr(subtopic,"bssid/") == subtopic) {
-      const char *bssid = subtopic + 6;
-      char filename[32];
-      strlcpy(filename, "/bssid/", sizeof(filename));
-      strlcat(filename, bssid, sizeof(filename));
-      int idx = strtoul(msg, NULL, 10);
-      int subdomain = read_subdomain(filename);
-      if (subdomain == idx) {
-          // The new value matches the stored value
-          return;
-      }
-      File f = SPIFFS.open(filename, "w");
-      if (! f) {
-          dbgPrintln(EMMDBG_MQTT, "Failed to write /" + String(bssid));
-          return;
-      }
-      f.print(msg);
-      f.print("\n");
-      f.close();
-
-      if (strcmp(WiFi.softAPmacAddress().c_str(), bssid) == 0) {
-          shutdown_AP();
-          setup_AP();
-      }
+      receive_bssid(subtopic + 6, msg);
       return;
   }
   else if (strstr(subtopic ,"ota/") == subtopic) {
 #if HAS_OTA
       const char *cmd = subtopic + 4;
-      handle_ota(cmd, msg);
+      handle_ota(cmd, msg, msgLen < 0 ? strlen(msg) : msgLen);
 #endif
       return;
   }
@@ -497,16 +835,200 @@ void ESP8266MQTTMesh::connect_mqtt() {
 
 
 void ESP8266MQTTMesh::publish(const char *subtopic, const char *msg, uint8_t msgType) {
+    if (! can_publish()) {
+        if (hold_message(subtopic, msg, msgType)) {
+            save_outbox();
+        }
+        return;
+    }
+    //Stay behind whatever is still held, and hold what the upstream link has no room for.  Messages
+    //to be acked are kept in the outbox until they are
+    bool idle = ! outboxLen;
+    if (! idle || needs_ack(msgType) || ! send_publish(subtopic, msg, msgType)) {
+        hold_message(subtopic, msg, msgType);
+        start_replay();
+        if (idle && needs_ack(msgType)) {
+            replay_outbox();
+        }
+    }
+}
+
+//Whether our messages can go upstream now: we know our subdomain and have a parent or the broker
+bool ESP8266MQTTMesh::can_publish() {
+    if (! AP_ready || failover) {
+        return false;
+    }
+    return meshConnect ? espClient[0] && espClient[0]->connected() : mqttClient.connected();
+}
+
+//Returns 0 if the message could not be sent, otherwise the MQTT packet ID on the gateway
+uint16_t ESP8266MQTTMesh::send_publish(const char *subtopic, const char *msg, uint8_t msgType, int msgLen, uint16_t id) {
     char topic[64];
     strlcpy(topic, outTopic, sizeof(topic));
     strlcat(topic, mySSID, sizeof(topic));
     strlcat(topic, subtopic, sizeof(topic));
     dbgPrintln(EMMDBG_MQTT_EXTRA, "Sending: " + String(topic) + "=" + String(msg));
     if (! meshConnect) {
-        mqtt_publish(topic, msg, msgType);
+        return mqtt_publish(topic, msg, msgType, msgLen);
+    }
+    return send_message(0, topic, msg, msgType, msgLen, id) ? 1 : 0;
+}
+
+bool ESP8266MQTTMesh::needs_ack(uint8_t msgType) {
+    return msgType == MSG_TYPE_QOS_1 || msgType == MSG_TYPE_QOS_2
+        || msgType == MSG_TYPE_RETAIN_QOS_1 || msgType == MSG_TYPE_RETAIN_QOS_2;
+}
+
+bool ESP8266MQTTMesh::hold_message(const char *subtopic, const char *msg, uint8_t msgType) {
+    int topicLen = strlen(subtopic);
+    int msgLen = strlen(msg);
+    bool ack = needs_ack(msgType);
+    size_t len = MESH_FRAME_HEADER_LEN + topicLen + 1 + msgLen + 1 + (ack ? 2 : 0);
+    if (topicLen > 255 || len > MQTT_MAX_PACKET_SIZE) {
+        dbgPrintln(EMMDBG_MSG, "Message too long to hold: " + String(subtopic));
+        return false;
+    }
+#if ESP8266_OUTBOX_POLICY == OUTBOX_COALESCE
+    //Only the latest message on a topic is kept
+    for (size_t pos = 0; pos < outboxLen; pos += frame_size((const uint8_t *)outbox + pos)) {
+        if (strcmp(outbox + pos + MESH_FRAME_HEADER_LEN, subtopic) == 0) {
+            drop_held(pos);
+            break;
+        }
+    }
+#endif
+    while (outboxLen + len > ESP8266_OUTBOX_LEN) {
+#if ESP8266_OUTBOX_POLICY == OUTBOX_DROP_NEWEST
+        dbgPrintln(EMMDBG_MSG, "Outbox full, dropping message: " + String(subtopic));
+        return false;
+#else
+        dbgPrintln(EMMDBG_MSG, "Outbox full, dropping oldest message");
+        drop_held(0);
+#endif
+    }
+    if (! outbox) {
+        outbox = (char *)malloc(ESP8266_OUTBOX_LEN);
+        if (! outbox) {
+            dbgPrintln(EMMDBG_MSG, "No memory to hold message: " + String(subtopic));
+            return false;
+        }
+    }
+    uint8_t *p = (uint8_t *)outbox + outboxLen;
+    p[0] = MESH_FRAME_VERSION;
+    p[1] = msgType;
+    p[2] = ack ? MESH_FLAG_ID : 0;
+    p[3] = topicLen;
+    p[4] = msgLen & 0xff;
+    p[5] = msgLen >> 8;
+    memcpy(p + MESH_FRAME_HEADER_LEN, subtopic, topicLen + 1);
+    memcpy(p + MESH_FRAME_HEADER_LEN + topicLen + 1, msg, msgLen + 1);
+    if (ack) {
+        if (! ++nextMsgId) {
+            nextMsgId = 1;
+        }
+        p[len - 2] = nextMsgId & 0xff;
+        p[len - 1] = nextMsgId >> 8;
+    }
+    outboxLen += len;
+    return true;
+}
+
+void ESP8266MQTTMesh::drop_held(size_t offset) {
+    size_t len = frame_size((const uint8_t *)outbox + offset);
+    memmove(outbox + offset, outbox + offset + len, outboxLen - offset - len);
+    outboxLen -= len;
+    if (offset == 0) {
+        ackWait = 0;
+    }
+}
+
+void ESP8266MQTTMesh::start_replay() {
+    if (outboxLen && ! timers[TIMER_OUTBOX].armed) {
+        timer_every(TIMER_OUTBOX, 1.0 / ESP8266_OUTBOX_RATE, replay_outbox);
+    }
+}
+
+//Send the oldest held message.  One per tick, so that a node coming back doesn't flood the
+//path to the broker along with the rest of its subtree.  A message to be acked stays at the
+//head until it is, and is sent again if the ack is late
+void ESP8266MQTTMesh::replay_outbox() {
+    if (outboxLen && ! can_publish()) {
+        //announce_AP() starts us again once we are back
+        timer_cancel(TIMER_OUTBOX);
+        ackWait = 0;
+        return;
+    }
+    mesh_frame_t frame;
+    if (! outboxLen) {
+        //The last message has been acked
+    } else if (parse_frame((const uint8_t *)outbox, outboxLen, &frame) <= 0) {
+        dbgPrintln(EMMDBG_MSG, "Outbox corrupt, dropping " + String(outboxLen) + " bytes");
+        outboxLen = 0;
+        ackWait = 0;
     } else {
-        send_message(0, topic, msg, msgType);
+        if (ackWait) {
+            if (millis() - ackSent < ESP8266_ACK_TIMEOUT) {
+                return;
+            }
+            dbgPrintln(EMMDBG_MQTT, "No ack for message " + String(frame.id) + ", resending");
+        }
+        uint16_t sent = send_publish(frame.topic, frame.payload, frame.type, frame.payload_len, frame.id);
+        if (! sent) {
+            //No room upstream, try again next tick
+            return;
+        }
+        if (frame.id) {
+            ackWait = meshConnect ? frame.id : sent;
+            ackSent = millis();
+            return;
+        }
+        drop_held(0);
+    }
+    if (! outboxLen) {
+        timer_cancel(TIMER_OUTBOX);
+        save_outbox();
+        free(outbox);
+        outbox = NULL;
+    }
+}
+
+void ESP8266MQTTMesh::load_outbox() {
+#ifdef ESP8266_OUTBOX_FILE
+    File f = SPIFFS.open(ESP8266_OUTBOX_FILE, "r");
+    if (! f || ! (outbox = (char *)malloc(ESP8266_OUTBOX_LEN))) {
+        return;
+    }
+    size_t len = f.read((uint8_t *)outbox, ESP8266_OUTBOX_LEN);
+    f.close();
+    //Keep the whole messages
+    mesh_frame_t frame;
+    int frameLen;
+    outboxLen = 0;
+    while ((frameLen = parse_frame((const uint8_t *)outbox + outboxLen, len - outboxLen, &frame)) > 0) {
+        outboxLen += frameLen;
+    }
+    if (! outboxLen) {
+        free(outbox);
+        outbox = NULL;
     }
+    dbgPrintln(EMMDBG_MSG_EXTRA, "Loaded " + String(outboxLen) + " bytes of held messages");
+#endif
+}
+
+void ESP8266MQTTMesh::save_outbox() {
+#ifdef ESP8266_OUTBOX_FILE
+    if (! outboxLen) {
+        if (SPIFFS.exists(ESP8266_OUTBOX_FILE)) {
+            SPIFFS.remove(ESP8266_OUTBOX_FILE);
+        }
+        return;
+    }
+    File f = SPIFFS.open(ESP8266_OUTBOX_FILE, "w");
+    if (! f || f.write((const uint8_t *)outbox, outboxLen) != outboxLen) {
+        dbgPrintln(EMMDBG_MSG, "Failed to write " ESP8266_OUTBOX_FILE);
+    }
+    f.close();
+#endif
 }
 
 void ESP8266MQTTMesh::shutdown_AP() {
@@ -517,19 +1039,34 @@ void ESP8266MQTTMesh::shutdown_AP() {
             delete espClient[i];
             espClient[i] = NULL;
         }
+        close_queue(i);
+        reset_recv(i);
+    }
+    memset(routes, 0, sizeof(routes));
+    memset(subtreeFw, 0, sizeof(subtreeFw));
+    if (failover) {
+        failover = false;
+        close_queue(0);
     }
     WiFi.softAPdisconnect(true);
     WiFi.mode(WIFI_STA);
     AP_ready = false;
 }
 
+//Tell scanning nodes how far we are from the broker and how many children we have room for
+void ESP8266MQTTMesh::advertise_AP() {
+    uint8_t oui[3] = MESH_IE_OUI;
+    int children = WiFi.softAPgetStationNum();
+    uint8_t ie[MESH_IE_LEN] = { 'E', 'M', depth, (uint8_t)children,
+                                (uint8_t)(children < MESH_AP_MAX_CONN ? MESH_AP_MAX_CONN - children : 0) };
+    wifi_set_user_ie(true, oui, USER_IE_BEACON, ie, sizeof(ie));
+    wifi_set_user_ie(true, oui, USER_IE_PROBE_RESP, ie, sizeof(ie));
+}
+
 void ESP8266MQTTMesh::setup_AP() {
     if (AP_ready)
         return;
-    char filename[32];
-    strlcpy(filename, "/bssid/", sizeof(filename));
-    strlcat(filename, WiFi.softAPmacAddress().c_str(), sizeof(filename));
-    int subdomain = read_subdomain(filename);
+    int subdomain = get_subdomain(WiFi.softAPmacAddress().c_str());
     if (subdomain == -1) {
         return;
     }
@@ -542,154 +1079,1427 @@ void ESP8266MQTTMesh::setup_AP() {
     IPAddress apSubmask(255, 255, 255, 0);
     WiFi.mode(WIFI_AP_STA);
     WiFi.softAPConfig(apIP, apGateway, apSubmask);
-    WiFi.softAP(mySSID, mesh_password, WiFi.channel(), 1);
+    WiFi.softAP(mySSID, mesh_password, WiFi.channel(), 1, MESH_AP_MAX_CONN);
     dbgPrintln(EMMDBG_WIFI, "Initialized AP as '" + String(mySSID) + "'  IP '" + apIP.toString() + "'");
     strlcat(mySSID, "/", sizeof(mySSID));
     if (meshConnect) {
-        publish("mesh_cmd", "request_bssid");
+        request_bssids();
     }
+    announce_AP();
     connecting = false; //Connection complete
     AP_ready = true;
+    if (ESP8266_STANDBY_SCAN) {
+        timer_every(TIMER_STANDBY_SCAN, ESP8266_STANDBY_SCAN, refresh_aps);
+    }
+}
+
+//Tell the nodes between us and the broker that we live behind them, and which firmware we run,
+//and have our children do the same
+void ESP8266MQTTMesh::announce_AP() {
+    advertise_AP();
+    if (meshConnect) {
+        //Ahead of anything held in the outbox
+        char announce[16];
+        strlcpy(announce, "route:", sizeof(announce));
+        itoa(firmware_id, announce + 6, 16);
+        send_publish("mesh_cmd", announce, MSG_TYPE_NONE);
+    }
+    //An ack on its way over the old path may be lost, so send the head of the outbox again
+    ackWait = 0;
+    start_replay();
+    char topic[TOPIC_LEN];
+    char msg[4];
+    strlcpy(topic, inTopic, sizeof(topic));
+    strlcat(topic, MESH_REJOIN_TOPIC, sizeof(topic));
+    itoa(depth, msg, 10);
+    for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+        if (espClient[i]) {
+            send_message(i, topic, msg);
+        }
+    }
 }
-int ESP8266MQTTMesh::read_subdomain(const char *fileName) {
+int ESP8266MQTTMesh::read_subdomain(File &f) {
       char subdomain[4];
-      File f = SPIFFS.open(fileName, "r");
       if (! f) {
-          dbgPrintln(EMMDBG_MSG_EXTRA, "Failed to read " + String(fileName));
+          dbgPrintln(EMMDBG_MSG_EXTRA, "Failed to read " + String(f.name()));
           return -1;
       }
       subdomain[f.readBytesUntil('\n', subdomain, sizeof(subdomain)-1)] = 0;
       f.close();
       unsigned int value = strtoul(subdomain, NULL, 10);
       if (value < 0 || value > 255) {
-          dbgPrintln(EMMDBG_MSG, "Illegal value '" + String(subdomain) + "' from " + String(fileName));
+          dbgPrintln(EMMDBG_MSG, "Illegal value '" + String(subdomain) + "'");
           return -1;
       }
       return value;
 }
-void ESP8266MQTTMesh::assign_subdomain() {
-    char seen[256];
-    if (match_bssid(WiFi.softAPmacAddress().c_str())) {
-        return;
+
+//Load the mesh map once, so that scans and connects never have to touch the filesystem.
+///bssid/<MAC> files, from older versions or uploaded to pre-populate the map, are merged in
+//and removed
+void ESP8266MQTTMesh::load_bssids() {
+    File f = SPIFFS.open(MESHMAP_FILE, "r");
+    if (! f && SPIFFS.rename(MESHMAP_TMP, MESHMAP_FILE)) {
+        //We were interrupted while compacting, after the table had been written
+        f = SPIFFS.open(MESHMAP_FILE, "r");
     }
-    memset(seen, 0, sizeof(seen));
+    bool loaded = false;
+    if (f) {
+        uint8_t header[MESHMAP_HEADER_LEN];
+        if (f.read(header, sizeof(header)) == MESHMAP_HEADER_LEN && memcmp(header, "EMM", 3) == 0 &&
+            header[3] == MESHMAP_VERSION) {
+            bssidEpoch = header[4] | (header[5] << 8);
+            read_bssids(f);
+            loaded = true;
+        } else {
+            dbgPrintln(EMMDBG_MSG, "Ignoring " MESHMAP_FILE " with unknown format");
+        }
+        f.close();
+    }
+    if (loaded) {
+        f = SPIFFS.open(MESHMAP_LOG, "r");
+        if (f) {
+            bssidLogLen = read_bssids(f);
+            f.close();
+        }
+    }
+    int migrated = 0;
     Dir dir = SPIFFS.openDir("/bssid/");
     while(dir.next()) {
-      int value = read_subdomain(dir.fileName().c_str());
-      if (value == -1) {
+      dbgPrintln(EMMDBG_FS, " ==> '" + dir.fileName() + "'");
+      uint8_t mac[6];
+      File f = dir.openFile("r");
+      int subdomain = read_subdomain(f);
+      if (subdomain == -1 || ! parse_mac(dir.fileName().c_str() + 7, mac)) {
           continue;
       }
-      dbgPrintln(EMMDBG_WIFI_EXTRA, "Mapping " + dir.fileName() + " to " + String(value) + " ");
-      seen[value] = 1;
+      map_bssid(mac, subdomain, 0);
+      migrated++;
     }
-    for (int i = 4; i < 256; i++) {
-        if (! seen[i]) {
-            File f = SPIFFS.open("/bssid/" +  WiFi.softAPmacAddress(), "w");
-            if (! f) {
-                dbgPrintln(EMMDBG_MSG, "Couldn't write "  + WiFi.softAPmacAddress());
-                die();
+    if (! bssidEpoch) {
+        //A new map
+        bssidEpoch = (micros() ^ ESP.getChipId() ^ (ESP.getChipId() >> 16)) & 0xffff;
+        bssidEpoch += ! bssidEpoch;
+    }
+    if (! migrated && loaded) {
+        return;
+    }
+    renumber_bssids();
+    if (save_bssids() && migrated) {
+        dbgPrintln(EMMDBG_FS, "Migrated " + String(migrated) + " /bssid/ files to " MESHMAP_FILE);
+        while (1) {
+            dir = SPIFFS.openDir("/bssid/");
+            if (! dir.next()) {
+                break;
             }
-            f.print(i);
-            f.print("\n");
-            f.close();
-            //Yes this is meant to be inTopic.  That allows all other nodes to see this message
-            char topic[TOPIC_LEN];
-            char msg[4];
-            itoa(i, msg, 10);
-            strlcpy(topic, inTopic, sizeof(topic));
-            strlcat(topic, "bssid/", sizeof(topic));
-            strlcat(topic, WiFi.softAPmacAddress().c_str(), sizeof(topic));
-            dbgPrintln(EMMDBG_MQTT_EXTRA, "Publishing " + String(topic) + " == " + String(i));
-            mqttClient.publish(topic, 0, true, msg);
-            setup_AP();
-            return;
+            SPIFFS.remove(dir.fileName());
         }
     }
 }
 
-bool ESP8266MQTTMesh::send_message(int index, const char *topicOrMsg, const char *msg, uint8_t msgType) {
-    int topicLen = strlen(topicOrMsg);
-    int msgLen = 0;
-    int len = topicLen;
-    char msgTypeStr[2];
-    if (msgType == 0) {
-        msgType = MSG_TYPE_INVALID;
+//Read records into the table.  Returns the number read
+int ESP8266MQTTMesh::read_bssids(File &f) {
+    int count = 0;
+    bssid_map_t entry;
+    while (f.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry)) {
+        map_bssid(entry.mac, entry.subdomain, entry.version);
+        if (entry.version > bssidVersion) {
+            bssidVersion = entry.version;
+        }
+        count++;
+    }
+    return count;
+}
+
+//Compact the map: write the whole table and drop the log.  The table is written to a
+//temporary file first, so it is never left partially written
+bool ESP8266MQTTMesh::save_bssids() {
+    File f = SPIFFS.open(MESHMAP_TMP, "w");
+    if (! f) {
+        dbgPrintln(EMMDBG_MSG, "Failed to write " MESHMAP_TMP);
+        return false;
     }
-    msgTypeStr[0] = msgType;
-    msgTypeStr[1] = 0;
-    if (index == 0) {
-        //We only send the msgType upstream
-        espClient[index]->write(msgTypeStr,1);
+    const uint8_t header[MESHMAP_HEADER_LEN] = { 'E', 'M', 'M', MESHMAP_VERSION,
+                                                 (uint8_t)(bssidEpoch & 0xff), (uint8_t)(bssidEpoch >> 8) };
+    size_t len = bssidMapLen * sizeof(bssid_map_t);
+    bool ok = f.write(header, sizeof(header)) == sizeof(header) && f.write((const uint8_t *)bssidMap, len) == len;
+    f.close();
+    if (! ok) {
+        dbgPrintln(EMMDBG_MSG, "Failed to write " MESHMAP_TMP);
+        SPIFFS.remove(MESHMAP_TMP);
+        return false;
     }
-    espClient[index]->write(topicOrMsg);
-    if (msg) {
-        espClient[index]->write("=", 1);
-        espClient[index]->write(msg);
+    SPIFFS.remove(MESHMAP_FILE);
+    if (! SPIFFS.rename(MESHMAP_TMP, MESHMAP_FILE)) {
+        dbgPrintln(EMMDBG_MSG, "Failed to rename " MESHMAP_TMP);
+        return false;
     }
-    espClient[index]->write("\0", 1);
+    SPIFFS.remove(MESHMAP_LOG);
+    bssidLogLen = 0;
     return true;
 }
 
-void ESP8266MQTTMesh::broadcast_message(const char *topicOrMsg, const char *msg) {
+//Give the entries that have no version (migrated from /bssid/, or reset for a new epoch) the next versions
+void ESP8266MQTTMesh::renumber_bssids() {
+    for (int i = 0; i < bssidMapLen; i++) {
+        if (! bssidMap[i].version) {
+            bssidMap[i].version = ++bssidVersion;
+        }
+    }
+}
+
+//Returns the index of mac in the table, or where it would be inserted
+int ESP8266MQTTMesh::bssid_index(const uint8_t *mac) {
+    int lo = 0, hi = bssidMapLen;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (memcmp(bssidMap[mid].mac, mac, 6) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int ESP8266MQTTMesh::get_subdomain(const uint8_t *mac) {
+    int i = bssid_index(mac);
+    if (i < bssidMapLen && memcmp(bssidMap[i].mac, mac, 6) == 0) {
+        return bssidMap[i].subdomain;
+    }
+    return -1;
+}
+
+int ESP8266MQTTMesh::get_subdomain(const char *bssid) {
+    uint8_t mac[6];
+    return parse_mac(bssid, mac) ? get_subdomain(mac) : -1;
+}
+
+bool ESP8266MQTTMesh::set_subdomain(const char *bssid, int subdomain) {
+    uint8_t mac[6];
+    if (subdomain < 0 || subdomain > 255 || ! parse_mac(bssid, mac)) {
+        dbgPrintln(EMMDBG_MSG, "Illegal subdomain " + String(subdomain) + " for " + String(bssid));
+        return false;
+    }
+    return set_subdomain(mac, subdomain);
+}
+
+//Change an entry and record the change on the filesystem
+bool ESP8266MQTTMesh::set_subdomain(const uint8_t *mac, uint8_t subdomain) {
+    uint16_t since = bssidVersion;
+    return bump_bssid(mac, subdomain) && write_bssids(since);
+}
+
+//Update the table in RAM under the next map version
+bool ESP8266MQTTMesh::bump_bssid(const uint8_t *mac, uint8_t subdomain) {
+    if (bssidVersion == 0xffff) {
+        //Start a new epoch rather than wrap, children will then resync the whole map.  The
+        //table has to be rewritten
+        for (int i = 0; i < bssidMapLen; i++) {
+            bssidMap[i].version = 0;
+        }
+        bssidVersion = 0;
+        bssidEpoch = bssidEpoch == 0xffff ? 1 : bssidEpoch + 1;
+        renumber_bssids();
+        bssidLogLen = ESP8266_MESHMAP_LOG_LEN;
+    }
+    if (! map_bssid(mac, subdomain, bssidVersion + 1)) {
+        return false;
+    }
+    bssidVersion++;
+    return true;
+}
+
+//Append the entries changed after version 'since' to the log in one write, compacting the
+//map instead once the log is full
+bool ESP8266MQTTMesh::write_bssids(uint16_t since) {
+    int count = 0;
+    for (int i = 0; i < bssidMapLen; i++) {
+        count += bssidMap[i].version > since;
+    }
+    if (bssidLogLen + count > ESP8266_MESHMAP_LOG_LEN) {
+        return save_bssids();
+    }
+    File f = SPIFFS.open(MESHMAP_LOG, "a");
+    bool ok = f;
+    for (int i = 0; ok && i < bssidMapLen; i++) {
+        if (bssidMap[i].version > since) {
+            ok = f.write((const uint8_t *)&bssidMap[i], sizeof(bssid_map_t)) == sizeof(bssid_map_t);
+        }
+    }
+    f.close();
+    if (! ok) {
+        dbgPrintln(EMMDBG_MSG, "Failed to write " MESHMAP_LOG);
+        return false;
+    }
+    bssidLogLen += count;
+    return true;
+}
+
+//Add or update an entry in the in-RAM table
+bool ESP8266MQTTMesh::map_bssid(const uint8_t *mac, uint8_t subdomain, uint16_t version) {
+    int i = bssid_index(mac);
+    if (i < bssidMapLen && memcmp(bssidMap[i].mac, mac, 6) == 0) {
+        bssidMap[i].subdomain = subdomain;
+        bssidMap[i].version = version;
+        return true;
+    }
+    if (bssidMapLen == bssidMapSize) {
+        bssid_map_t *map = (bssid_map_t *)realloc(bssidMap, (bssidMapSize + 8) * sizeof(bssid_map_t));
+        if (! map) {
+            dbgPrintln(EMMDBG_MSG, "Not enough memory for BSSID table");
+            return false;
+        }
+        bssidMap = map;
+        bssidMapSize += 8;
+    }
+    memmove(&bssidMap[i + 1], &bssidMap[i], (bssidMapLen - i) * sizeof(bssid_map_t));
+    memcpy(bssidMap[i].mac, mac, 6);
+    bssidMap[i].subdomain = subdomain;
+    bssidMap[i].version = version;
+    bssidMapLen++;
+    return true;
+}
+
+//Parse a MAC in the form AA:BB:CC:DD:EE:FF
+bool ESP8266MQTTMesh::parse_mac(const char *str, uint8_t *mac) {
+    for (int i = 0; i < 6; i++) {
+        char *end;
+        unsigned long byte = strtoul(str, &end, 16);
+        if (end != str + 2 || byte > 255 || *end != (i == 5 ? 0 : ':')) {
+            return false;
+        }
+        mac[i] = byte;
+        str = end + 1;
+    }
+    return true;
+}
+
+void ESP8266MQTTMesh::assign_subdomain() {
+    char seen[256];
+    if (match_bssid(WiFi.softAPmacAddress().c_str()) || ! mqttClient.connected()) {
+        //Mapped meanwhile, or we lost the broker and will be back here once it reconnects
+        return;
+    }
+    memset(seen, 0, sizeof(seen));
+    for (int i = 0; i < bssidMapLen; i++) {
+      seen[bssidMap[i].subdomain] = 1;
+    }
+    for (int i = 4; i < 256; i++) {
+        if (! seen[i]) {
+            if (! set_subdomain(WiFi.softAPmacAddress().c_str(), i)) {
+                dbgPrintln(EMMDBG_MSG, "Couldn't write "  + WiFi.softAPmacAddress());
+                die();
+            }
+            //Yes this is meant to be inTopic.  That allows all other nodes to see this message
+            char topic[TOPIC_LEN];
+            char msg[4];
+            itoa(i, msg, 10);
+            strlcpy(topic, inTopic, sizeof(topic));
+            strlcat(topic, "bssid/", sizeof(topic));
+            strlcat(topic, WiFi.softAPmacAddress().c_str(), sizeof(topic));
+            dbgPrintln(EMMDBG_MQTT_EXTRA, "Publishing " + String(topic) + " == " + String(i));
+            mqttClient.publish(topic, 0, true, msg);
+            setup_AP();
+            return;
+        }
+    }
+}
+
+//Compresses the payload where that is worth it (see ESP8266_COMPRESS_MIN)
+bool ESP8266MQTTMesh::send_message(int index, const char *topic, const char *msg, uint8_t msgType, int msgLen, uint16_t id) {
+    if (msgLen < 0) {
+        msgLen = msg ? strlen(msg) : 0;
+    }
+    char *packed = ESP8266_COMPRESS_MIN && msgLen >= ESP8266_COMPRESS_MIN ? alloc_recv_buf() : NULL;
+    size_t packedLen = packed ? pack_payload(msg, msgLen, packed) : 0;
+    bool ret = packedLen ? send_encoded(index, topic, packed, msgType, packedLen, id, MESH_FLAG_LZ)
+                         : send_encoded(index, topic, msg, msgType, msgLen, id, 0);
+    if (packed) {
+        free_recv_buf(packed);
+    }
+    return ret;
+}
+
+//Compress a payload into buf (MQTT_MAX_PACKET_SIZE bytes) as its length (2 bytes, little endian)
+//followed by the compressed bytes.  Returns the packed length, 0 if that would not be shorter.
+//A payload too long for a frame is left alone, as the receiver could not unpack it
+size_t ESP8266MQTTMesh::pack_payload(const char *msg, size_t msgLen, char *buf) {
+    if (msgLen < 4 || msgLen + MESH_FRAME_HEADER_LEN + 2 > MQTT_MAX_PACKET_SIZE) {
+        return 0;
+    }
+    size_t maxLen = msgLen - 3 < MQTT_MAX_PACKET_SIZE - 2 ? msgLen - 3 : MQTT_MAX_PACKET_SIZE - 2;
+    size_t len = lz_compress((const uint8_t *)msg, msgLen, (uint8_t *)buf + 2, maxLen);
+    if (! len) {
+        return 0;
+    }
+    buf[0] = msgLen & 0xff;
+    buf[1] = msgLen >> 8;
+    return len + 2;
+}
+
+//Undo pack_payload() into buf, NUL terminated.  Returns the payload length, or -1 if the frame
+//is corrupt or too long for buf
+int ESP8266MQTTMesh::unpack_payload(const mesh_frame_t *frame, char *buf, size_t bufLen) {
+    if (frame->payload_len < 2) {
+        return -1;
+    }
+    size_t len = (uint8_t)frame->payload[0] | ((uint8_t)frame->payload[1] << 8);
+    if (len + 1 > bufLen
+        || lz_decompress((const uint8_t *)frame->payload + 2, frame->payload_len - 2, (uint8_t *)buf, len) != len) {
+        return -1;
+    }
+    buf[len] = 0;
+    return len;
+}
+
+//Build a frame and send it.  flags may have MESH_FLAG_LZ for a payload that is already packed
+bool ESP8266MQTTMesh::send_encoded(int index, const char *topic, const char *msg, uint8_t msgType, int msgLen, uint16_t id, uint8_t flags) {
+    int topicLen = strlen(topic);
+    if (msgType == 0) {
+        msgType = MSG_TYPE_INVALID;
+    }
+    size_t len = MESH_FRAME_HEADER_LEN + topicLen + 1 + msgLen + 1 + (id ? 2 : 0);
+    if (topicLen > 255 || len > MQTT_MAX_PACKET_SIZE) {
+        dbgPrintln(EMMDBG_MSG, "Message too long for mesh: " + String(topic));
+        return false;
+    }
+    bool known = false;
+    int alias = index == 0 && meshConnect && ! failover ? find_alias(topic, &known) : 0;
+    char *aliasTopic = NULL;
+    if (alias && ! known && ! (aliasTopic = strdup(topic))) {
+        alias = 0;
+    }
+    uint8_t header[MESH_FRAME_HEADER_LEN];
+    header[0] = MESH_FRAME_VERSION;
+    header[1] = msgType;
+    header[2] = flags | (id ? MESH_FLAG_ID : 0) | (alias ? MESH_FLAG_ALIAS : 0);
+    header[3] = alias ? (known ? 1 : topicLen + 1) : topicLen;
+    header[4] = msgLen & 0xff;
+    header[5] = msgLen >> 8;
+    uint8_t aliasByte = alias;
+    uint8_t idBytes[2] = { (uint8_t)(id & 0xff), (uint8_t)(id >> 8) };
+    const char *part[6];
+    size_t partLen[6];
+    int parts = 0;
+    part[parts] = (const char *)header;    partLen[parts++] = sizeof(header);
+    if (alias) {
+        part[parts] = (const char *)&aliasByte; partLen[parts++] = 1;
+    }
+    if (known) {
+        part[parts] = "\0";                  partLen[parts++] = 1;
+    } else {
+        part[parts] = topic;                 partLen[parts++] = topicLen + 1;
+    }
+    part[parts] = msg;                       partLen[parts++] = msgLen;
+    part[parts] = "\0";                      partLen[parts++] = 1;
+    if (id) {
+        part[parts] = (const char *)idBytes; partLen[parts++] = sizeof(idBytes);
+    }
+    if (! send_frame(index, part, partLen, parts)) {
+        free(aliasTopic);
+        return false;
+    }
+    if (alias) {
+        //Only once the frame is on its way does our parent know the alias
+        topic_alias_t *a = &topicAlias[alias - 1];
+        if (aliasTopic) {
+            free(a->topic);
+            a->topic = aliasTopic;
+        }
+        a->used = ++aliasClock;
+    }
+    return true;
+}
+
+//Returns the alias to send a topic upstream with, 0 for none.  known is set if our parent has it
+//already.  An alias in use is only given a new topic while nothing is queued for our parent, so
+//that the queue can always be spelled out again with the current aliases (see unalias_queue())
+int ESP8266MQTTMesh::find_alias(const char *topic, bool *known) {
+    if (ESP8266_TOPIC_ALIASES == 0 || strlen(topic) >= TOPIC_LEN - 1) {
+        return 0;
+    }
+    int lru = 0;
+    for (int i = 0; i < ESP8266_TOPIC_ALIASES; i++) {
+        topic_alias_t *a = &topicAlias[i];
+        if (a->topic && strcmp(a->topic, topic) == 0) {
+            *known = true;
+            return i + 1;
+        }
+        if (topicAlias[lru].topic && (! a->topic || (uint16_t)(aliasClock - a->used) > (uint16_t)(aliasClock - topicAlias[lru].used))) {
+            lru = i;
+        }
+    }
+    if (topicAlias[lru].topic && sendQueue[0].len) {
+        return 0;
+    }
+    return lru + 1;
+}
+
+//Resolve the alias of a frame from a child.  Returns false if the alias is unknown
+bool ESP8266MQTTMesh::expand_alias(int idx, mesh_frame_t *frame) {
+    if (! (frame->flags & MESH_FLAG_ALIAS)) {
+        return true;
+    }
+    uint8_t alias = frame->topic_len ? frame->topic[0] : 0;
+    if (idx == 0 || alias == 0 || alias > ESP8266_TOPIC_ALIASES) {
+        return false;
+    }
+    recv_state_t *r = &recvState[idx];
+    if (frame->topic_len > 1) {
+        if (! r->aliases) {
+            r->aliases = (char **)calloc(ESP8266_TOPIC_ALIASES, sizeof(char *));
+        }
+        if (r->aliases) {
+            free(r->aliases[alias - 1]);
+            r->aliases[alias - 1] = strdup(frame->topic + 1);
+        }
+        frame->topic++;
+        frame->topic_len--;
+    } else {
+        if (! r->aliases || ! r->aliases[alias - 1]) {
+            dbgPrintln(EMMDBG_MSG, "Unknown topic alias " + String(alias) + " on link " + String(idx));
+            return false;
+        }
+        frame->topic = r->aliases[alias - 1];
+        frame->topic_len = strlen(frame->topic);
+    }
+    frame->flags &= ~MESH_FLAG_ALIAS;
+    return true;
+}
+
+//A frame we have no buffer for may still give its topic an alias, and the child will use it from
+//now on.  Pick the topic out of the bytes being skipped
+void ESP8266MQTTMesh::keep_alias(int idx, const uint8_t *data, size_t len) {
+    recv_state_t *r = &recvState[idx];
+    size_t topicLen = r->header[3];
+    for (size_t i = 0; i < len && r->skipped + i < topicLen; i++) {
+        size_t pos = r->skipped + i;
+        if (pos == 0) {
+            r->alias = data[i];
+            if (topicLen < 2 || r->alias == 0 || r->alias > ESP8266_TOPIC_ALIASES) {
+                return;
+            }
+            if (! r->aliases) {
+                r->aliases = (char **)calloc(ESP8266_TOPIC_ALIASES, sizeof(char *));
+            }
+            if (r->aliases) {
+                //The topic follows the alias byte, up to and including its NUL
+                free(r->aliases[r->alias - 1]);
+                if ((r->aliases[r->alias - 1] = (char *)malloc(topicLen))) {
+                    r->aliases[r->alias - 1][0] = 0;
+                }
+            }
+            continue;
+        }
+        if (! r->aliases || r->alias == 0 || r->alias > ESP8266_TOPIC_ALIASES || ! r->aliases[r->alias - 1]) {
+            return;
+        }
+        r->aliases[r->alias - 1][pos - 1] = data[i];
+        r->aliases[r->alias - 1][pos] = 0;
+    }
+}
+
+//Our parent is gone.  The frames still queued for it may use aliases it knew, so spell their
+//topics out for whoever we send them to next
+void ESP8266MQTTMesh::unalias_queue() {
+    send_queue_t *q = &sendQueue[0];
+    char *buf = q->len ? alloc_recv_buf() : NULL;
+    if (q->len && ! buf) {
+        dbgPrintln(EMMDBG_MSG, "No buffer to rewrite the queue, dropping " + String(q->len) + " bytes");
+        q->len = 0;
+    }
+    //Each frame is taken from the head and put back at the tail
+    size_t left = q->len;
+    while (left >= MESH_FRAME_HEADER_LEN) {
+        uint8_t header[MESH_FRAME_HEADER_LEN];
+        queue_copy(q, 0, header, sizeof(header));
+        size_t size = frame_size(header);
+        queue_copy(q, 0, buf, size);
+        q->head = (q->head + size) % ESP8266_SEND_QUEUE_LEN;
+        q->len -= size;
+        left -= size;
+        mesh_frame_t frame;
+        if (parse_frame((const uint8_t *)buf, size, &frame) <= 0) {
+            continue;
+        }
+        if (frame.flags & MESH_FLAG_ALIAS) {
+            uint8_t alias = frame.topic[0];
+            if (frame.topic_len > 1) {
+                frame.topic++;
+            } else if (alias && alias <= ESP8266_TOPIC_ALIASES && topicAlias[alias - 1].topic) {
+                frame.topic = topicAlias[alias - 1].topic;
+            } else {
+                continue;
+            }
+        }
+        if (! send_encoded(0, frame.topic, frame.payload, frame.type, frame.payload_len, frame.id, frame.flags & MESH_FLAG_LZ)) {
+            q->dropped++;
+        }
+    }
+    if (buf) {
+        free_recv_buf(buf);
+    }
+    clear_aliases();
+}
+
+//Forget the topics our parent knows by alias
+void ESP8266MQTTMesh::clear_aliases() {
+    for (int i = 0; i < ESP8266_TOPIC_ALIASES; i++) {
+        free(topicAlias[i].topic);
+        topicAlias[i].topic = NULL;
+    }
+}
+
+//Relay a received frame unchanged.  A frame that came up with the child's alias for its topic is
+//encoded again, as our parent only knows our own aliases
+bool ESP8266MQTTMesh::forward_frame(int index, const mesh_frame_t *frame) {
+    if (index == 0 && (frame->raw[2] & MESH_FLAG_ALIAS)) {
+        return send_encoded(0, frame->topic, frame->payload, frame->type, frame->payload_len, frame->id, frame->flags & MESH_FLAG_LZ);
+    }
+    const char *part[] = { frame->raw };
+    const size_t partLen[] = { frame->size };
+    return send_frame(index, part, partLen, 1);
+}
+
+//Send a frame given as a list of parts.  When the AsyncClient has no room the frame is queued
+//instead, and queued frames are coalesced into as few writes as possible as the link acks (see
+//send_queued()).  A frame that does not fit in the queue is dropped whole, so the stream never
+//contains a partial frame
+bool ESP8266MQTTMesh::send_frame(int index, const char *part[], const size_t partLen[], int parts) {
+    AsyncClient *c = espClient[index];
+    send_queue_t *q = &sendQueue[index];
+    size_t len = 0;
+    for (int i = 0; i < parts; i++) {
+        len += partLen[i];
+    }
+    //After losing our parent the old connection may not have noticed yet, hold everything for the next
+    bool up = c && c->connected() && ! (index == 0 && failover);
+    if (! up && ! (index == 0 && failover)) {
+        return false;
+    }
+    if (up && q->len == 0 && c->space() >= len) {
+        for (int i = 0; i < parts; i++) {
+            if (partLen[i]) {
+                c->add(part[i], partLen[i]);
+            }
+        }
+        q->inflight += len;
+        return c->send();
+    }
+    if (! q->buf || ESP8266_SEND_QUEUE_LEN - q->len < len) {
+        q->dropped++;
+        dbgPrintln(EMMDBG_MSG, "Send queue full, dropping message on link " + String(index));
+        return false;
+    }
+    for (int i = 0; i < parts; i++) {
+        const char *data = part[i];
+        size_t remaining = partLen[i];
+        while (remaining) {
+            size_t tail = (q->head + q->len) % ESP8266_SEND_QUEUE_LEN;
+            size_t chunk = ESP8266_SEND_QUEUE_LEN - tail;
+            if (chunk > remaining) {
+                chunk = remaining;
+            }
+            memcpy(q->buf + tail, data, chunk);
+            q->len += chunk;
+            data += chunk;
+            remaining -= chunk;
+        }
+    }
+    if (q->len > q->high_watermark) {
+        q->high_watermark = q->len;
+    }
+    if (up && q->inflight == 0) {
+        //Nothing is awaiting an ack, so onAck() will not drain the queue for us
+        send_queued(index);
+    }
+    return true;
+}
+
+//Hand as much of the send queue to the AsyncClient as it has room for, then send once
+void ESP8266MQTTMesh::send_queued(int index) {
+    AsyncClient *c = espClient[index];
+    send_queue_t *q = &sendQueue[index];
+    if (! c || ! c->connected() || (index == 0 && failover)) {
+        return;
+    }
+    size_t sent = 0;
+    while (q->len) {
+        size_t chunk = ESP8266_SEND_QUEUE_LEN - q->head;
+        if (chunk > q->len) {
+            chunk = q->len;
+        }
+        if (chunk > c->space()) {
+            chunk = c->space();
+        }
+        if (chunk) {
+            chunk = c->add(q->buf + q->head, chunk);
+        }
+        if (! chunk) {
+            break;
+        }
+        //Keep track of where the frame the AsyncClient has the start of ends
+        for (size_t pos = 0; pos < chunk; ) {
+            if (! q->partial) {
+                uint8_t header[MESH_FRAME_HEADER_LEN];
+                queue_copy(q, pos, header, sizeof(header));
+                q->partial = frame_size(header);
+            }
+            size_t step = chunk - pos < q->partial ? chunk - pos : q->partial;
+            pos += step;
+            q->partial -= step;
+        }
+        q->head = (q->head + chunk) % ESP8266_SEND_QUEUE_LEN;
+        q->len -= chunk;
+        q->inflight += chunk;
+        sent += chunk;
+    }
+    if (sent) {
+        c->send();
+    }
+}
+
+void ESP8266MQTTMesh::open_queue(int index) {
+    send_queue_t *q = &sendQueue[index];
+    if (! q->buf) {
+        q->buf = (char *)malloc(ESP8266_SEND_QUEUE_LEN);
+        if (! q->buf) {
+            dbgPrintln(EMMDBG_MSG, "Failed to allocate send queue for link " + String(index));
+        }
+    }
+    q->head = 0;
+    q->len = 0;
+    q->inflight = 0;
+    q->partial = 0;
+}
+
+void ESP8266MQTTMesh::close_queue(int index) {
+    send_queue_t *q = &sendQueue[index];
+    free(q->buf);
+    q->buf = NULL;
+    q->head = 0;
+    q->len = 0;
+    q->inflight = 0;
+    q->partial = 0;
+}
+
+//On the gateway the last free buffer is kept for messages from the broker
+char *ESP8266MQTTMesh::alloc_recv_buf(bool reserve) {
+    int avail = 0;
+    for (int i = 0; i < ESP8266_RECV_POOL_LEN; i++) {
+        if (! (recvPoolUsed & (1 << i))) {
+            avail++;
+        }
+    }
+    if (avail == 0 || (reserve && avail == 1 && ! meshConnect)) {
+        return NULL;
+    }
+    for (int i = 0; i < ESP8266_RECV_POOL_LEN; i++) {
+        if (! (recvPoolUsed & (1 << i))) {
+            recvPoolUsed |= 1 << i;
+            return recvPool[i];
+        }
+    }
+    return NULL;
+}
+
+void ESP8266MQTTMesh::free_recv_buf(char *buf) {
+    for (int i = 0; i < ESP8266_RECV_POOL_LEN; i++) {
+        if (buf == recvPool[i]) {
+            recvPoolUsed &= ~(1 << i);
+        }
+    }
+}
+
+//Drop any partially received frame and return its buffer to the pool
+void ESP8266MQTTMesh::reset_recv(int index) {
+    recv_state_t *r = &recvState[index];
+    free_recv_buf(r->buf);
+    r->buf = NULL;
+    r->len = 0;
+    r->discard = 0;
+    //Topic aliases only last as long as the connection
+    if (r->aliases) {
+        for (int i = 0; i < ESP8266_TOPIC_ALIASES; i++) {
+            free(r->aliases[i]);
+        }
+        free(r->aliases);
+        r->aliases = NULL;
+    }
+}
+
+//Make room for len bytes at the tail of the work queue, allocating it if it is not.  This runs in
+//the network callbacks, so nothing is handled here to free space: a message that does not fit is
+//dropped (OTA chunks are sent again when the sender asks what is missing)
+bool ESP8266MQTTMesh::reserve_work(size_t len) {
+    if (! workQueue) {
+        workQueue = (char *)malloc(ESP8266_WORK_QUEUE_LEN);
+        workHead = 0;
+        workLen = 0;
+    }
+    //The message being handled must stay where it is
+    if (workQueue && workHead + workLen + len > ESP8266_WORK_QUEUE_LEN && workLen + len <= ESP8266_WORK_QUEUE_LEN &&
+        ! workRunning) {
+        memmove(workQueue, workQueue + workHead, workLen);
+        workHead = 0;
+    }
+    if (! workQueue || workHead + workLen + len > ESP8266_WORK_QUEUE_LEN) {
+        dbgPrintln(EMMDBG_MSG, "Work queue full, dropping message");
+        recvState[0].dropped++;
+        return false;
+    }
+    return true;
+}
+
+//Messages for this node are not handled in the network callbacks, where writing flash or SPIFFS
+//would stall every link.  They are queued, and loop() handles them in order
+void ESP8266MQTTMesh::queue_work(const mesh_frame_t *frame) {
+    if (frame->flags & MESH_FLAG_LZ) {
+        queue_packed_work(frame);
+        return;
+    }
+    if (map_topic(frame->topic)) {
+        receive_map(frame->topic, frame->payload, frame->payload_len);
+        return;
+    }
+    if (! reserve_work(frame->size)) {
+        return;
+    }
+    memcpy(workQueue + workHead + workLen, frame->raw, frame->size);
+    workLen += frame->size;
+    if (! loopCalled) {
+        //The sketch doesn't call loop(), let the scheduler do it
+        timer_once(TIMER_WORK, 0.0, drain_work);
+    }
+}
+
+void ESP8266MQTTMesh::queue_work(const char *topic, const char *msg, int msgLen) {
+    int topicLen = strlen(topic);
+    size_t len = MESH_FRAME_HEADER_LEN + topicLen + 1 + msgLen + 1;
+    if (topicLen > 255 || len > MQTT_MAX_PACKET_SIZE) {
+        dbgPrintln(EMMDBG_MSG, "Dropping oversized message [" + String(topic) + "]");
+        recvState[0].dropped++;
+        return;
+    }
+    if (map_topic(topic)) {
+        receive_map(topic, msg, msgLen);
+        return;
+    }
+    if (! reserve_work(len)) {
+        return;
+    }
+    uint8_t *p = (uint8_t *)workQueue + workHead + workLen;
+    p[0] = MESH_FRAME_VERSION;
+    p[1] = MSG_TYPE_INVALID;
+    p[2] = 0;
+    p[3] = topicLen;
+    p[4] = msgLen & 0xff;
+    p[5] = msgLen >> 8;
+    memcpy(p + MESH_FRAME_HEADER_LEN, topic, topicLen + 1);
+    memcpy(p + MESH_FRAME_HEADER_LEN + topicLen + 1, msg, msgLen);
+    p[len - 1] = 0;
+    workLen += len;
+    if (! loopCalled) {
+        timer_once(TIMER_WORK, 0.0, drain_work);
+    }
+}
+
+//A compressed message is queued unpacked, as if it had come that way
+void ESP8266MQTTMesh::queue_packed_work(const mesh_frame_t *frame) {
+    size_t msgLen = frame->payload_len >= 2 ? (uint8_t)frame->payload[0] | ((uint8_t)frame->payload[1] << 8) : 0;
+    size_t len = MESH_FRAME_HEADER_LEN + frame->topic_len + 1 + msgLen + 1;
+    if (len > MQTT_MAX_PACKET_SIZE) {
+        dbgPrintln(EMMDBG_MSG, "Dropping oversized message: " + String(frame->topic));
+        recvState[0].dropped++;
+        return;
+    }
+    if (map_topic(frame->topic)) {
+        char *buf = (char *)malloc(msgLen + 1);
+        if (buf && unpack_payload(frame, buf, msgLen + 1) >= 0) {
+            receive_map(frame->topic, buf, msgLen);
+        } else {
+            dbgPrintln(EMMDBG_MSG, "Dropping compressed message: " + String(frame->topic));
+        }
+        free(buf);
+        return;
+    }
+    if (! reserve_work(len)) {
+        return;
+    }
+    uint8_t *p = (uint8_t *)workQueue + workHead + workLen;
+    if (unpack_payload(frame, (char *)p + MESH_FRAME_HEADER_LEN + frame->topic_len + 1, msgLen + 1) < 0) {
+        dbgPrintln(EMMDBG_MSG, "Dropping compressed message: " + String(frame->topic));
+        return;
+    }
+    p[0] = MESH_FRAME_VERSION;
+    p[1] = frame->type;
+    p[2] = 0;
+    p[3] = frame->topic_len;
+    p[4] = msgLen & 0xff;
+    p[5] = msgLen >> 8;
+    memcpy(p + MESH_FRAME_HEADER_LEN, frame->topic, frame->topic_len + 1);
+    workLen += len;
+    if (! loopCalled) {
+        timer_once(TIMER_WORK, 0.0, drain_work);
+    }
+}
+
+//Mesh map traffic (bssid/ updates from the broker, syncs from our parent) is never sent again, so
+//it doesn't go through the work queue, where a burst of it could be dropped.  The table in RAM is
+//updated as it arrives and the filesystem is written from loop() (see save_map())
+bool ESP8266MQTTMesh::map_topic(const char *topic) {
+    if (strstr(topic, inTopic) != topic) {
+        return false;
+    }
+    const char *subtopic = topic + strlen(inTopic);
+    return strcmp(subtopic, MESHMAP_SYNC_TOPIC) == 0 || strstr(subtopic, "bssid/") == subtopic;
+}
+
+void ESP8266MQTTMesh::receive_map(const char *topic, const char *msg, int msgLen) {
+    const char *subtopic = topic + strlen(inTopic);
+    if (strcmp(subtopic, MESHMAP_SYNC_TOPIC) == 0) {
+        receive_bssids((const uint8_t *)msg, msgLen);
+    } else {
+        receive_bssid(subtopic + 6, msg);
+    }
+}
+
+//Handle the message at the head of the work queue
+void ESP8266MQTTMesh::run_work() {
+    mesh_frame_t frame;
+    if (parse_frame((const uint8_t *)workQueue + workHead, workLen, &frame) <= 0) {
+        dbgPrintln(EMMDBG_MSG, "Work queue corrupt, dropping " + String(workLen) + " bytes");
+        workHead = workLen = 0;
+        return;
+    }
+    workRunning = true;
+    parse_message(frame.topic, frame.payload, frame.payload_len);
+    workRunning = false;
+    workHead += frame.size;
+    workLen -= frame.size;
+    if (! workLen) {
+        workHead = 0;
+    }
+}
+
+void ESP8266MQTTMesh::drain_work(uint32_t start, uint32_t budget_us) {
+    if (parentChanged) {
+        save_parent();
+    }
+    if (mapChanged) {
+        save_map();
+    }
+    //Stop early for a timer that is due, so that the sector erase ahead of OTA data runs
+    //before the data needs it
+    while (workLen && (uint32_t)(micros() - start) < budget_us && ! timer_due()) {
+        run_work();
+    }
+    if (workLen && ! loopCalled) {
+        timer_once(TIMER_WORK, 0.0, drain_work);
+    }
+    if (! workLen && workQueue) {
+        free(workQueue);
+        workQueue = NULL;
+        workHead = 0;
+    }
+}
+
+//Call from the sketch's loop().  Runs the timers that are due, handles the messages received
+//for this node and tops up the links from their send queues, stopping once budget_us has been
+//used (a message or timer job is never split, so a call can run over).  Returns the
+//microseconds used
+uint32_t ESP8266MQTTMesh::loop(uint32_t budget_us) {
+    uint32_t start = micros();
+    loopCalled = true;
+    if (! timersRunning && timer_due()) {
+        run_timers();
+    }
+    drain_work(start, budget_us);
+    for (int i = 0; i <= ESP8266_NUM_CLIENTS && (uint32_t)(micros() - start) < budget_us; i++) {
+        //Normally sent from onAck(), this catches room freed up by other connections
+        if (sendQueue[i].len && ! (i == 0 && failover)) {
+            send_queued(i);
+        }
+    }
+    return micros() - start;
+}
+
+mesh_link_stats_t ESP8266MQTTMesh::getLinkStats(int link) {
+    mesh_link_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    if (link >= 0 && link <= ESP8266_NUM_CLIENTS) {
+        stats.queued = sendQueue[link].len;
+        stats.high_watermark = sendQueue[link].high_watermark;
+        stats.dropped = sendQueue[link].dropped;
+        stats.recv_dropped = recvState[link].dropped;
+    }
+    return stats;
+}
+
+//Send a message from the broker on down the mesh
+void ESP8266MQTTMesh::route_message(const char *topic, const char *msg, int msgLen) {
+    uint16_t links = route_links(topic);
+    if (msgLen < 0) {
+        msgLen = strlen(msg);
+    }
+    //Compressed once for all the links
+    char *packed = ESP8266_COMPRESS_MIN && msgLen >= ESP8266_COMPRESS_MIN ? alloc_recv_buf() : NULL;
+    size_t packedLen = packed ? pack_payload(msg, msgLen, packed) : 0;
     for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
-        if (espClient[i]) {
-            send_message(i, topicOrMsg, msg);
+        if (espClient[i] && (links & (1 << i))) {
+            if (packedLen) {
+                send_encoded(i, topic, packed, MSG_TYPE_NONE, packedLen, 0, MESH_FLAG_LZ);
+            } else {
+                send_encoded(i, topic, msg, MSG_TYPE_NONE, msgLen, 0, 0);
+            }
         }
     }
+    if (packed) {
+        free_recv_buf(packed);
+    }
 }
 
-void ESP8266MQTTMesh::send_bssids(int idx) {
-    Dir dir = SPIFFS.openDir("/bssid/");
-    char msg[TOPIC_LEN];
-    char subdomainStr[4];
-    while(dir.next()) {
-        int subdomain = read_subdomain(dir.fileName().c_str());
-        if (subdomain == -1) {
-            continue;
+//Returns the subdomain of the node a subtopic is addressed to (e.g. 'mesh_esp8266-6/...' or
+//'ota/mesh_esp8266-6/...'), or -1 if it is not addressed to a single node
+int ESP8266MQTTMesh::topic_subdomain(const char *subtopic) {
+    if (strstr(subtopic, "ota/") == subtopic) {
+        subtopic += 4;
+    }
+    int len = strlen(base_ssid);
+    if (strncmp(subtopic, base_ssid, len) != 0) {
+        return -1;
+    }
+    char *end;
+    unsigned long subdomain = strtoul(subtopic + len, &end, 10);
+    if (end == subtopic + len || *end != '/' || subdomain > 255) {
+        return -1;
+    }
+    return subdomain;
+}
+
+//Returns a bitmask of the child links a message from upstream should go down: the one branch
+//a node lives behind, the branches running a firmware ID, or all of them for anything else
+uint16_t ESP8266MQTTMesh::route_links(const char *topic) {
+    uint16_t all = ((1 << (ESP8266_NUM_CLIENTS + 1)) - 1) & ~1;
+    if (strstr(topic, inTopic) != topic) {
+        return all;
+    }
+    const char *subtopic = topic + strlen(inTopic);
+    if (strcmp(subtopic, MESHMAP_SYNC_TOPIC) == 0 || strcmp(subtopic, MESH_REJOIN_TOPIC) == 0) {
+        //Map syncs and rejoins are between a node and its parent only
+        return 0;
+    }
+    int subdomain = topic_subdomain(subtopic);
+    if (subdomain >= 0) {
+        if (AP_ready && subdomain == topic_subdomain(mySSID)) {
+            return 0;
+        }
+        //Every node announces itself up the tree when its AP comes up, so a node we have no
+        //route for is not below us
+        return get_route(subdomain) ? 1 << get_route(subdomain) : 0;
+    }
+    if (strstr(subtopic, "ota/") == subtopic) {
+        char *end;
+        unsigned int id = strtoul(subtopic + 4, &end, 16);
+        if (end == subtopic + 4 || *end != '/') {
+            return all;
+        }
+        uint16_t links = 0;
+        for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+            subtree_fw_t *fw = &subtreeFw[i];
+            bool found = fw->count == SUBTREE_FW_ALL;
+            for (int j = 0; j < fw->count && ! found; j++) {
+                found = fw->id[j] == id;
+            }
+            if (found) {
+                links |= 1 << i;
+            }
+        }
+        return links;
+    }
+    return all;
+}
+
+void ESP8266MQTTMesh::add_subtree_fw(int idx, unsigned int id) {
+    subtree_fw_t *fw = &subtreeFw[idx];
+    if (fw->count == SUBTREE_FW_ALL) {
+        return;
+    }
+    for (int i = 0; i < fw->count; i++) {
+        if (fw->id[i] == id) {
+            return;
+        }
+    }
+    if (fw->count == ESP8266_SUBTREE_FW_IDS) {
+        dbgPrintln(EMMDBG_MSG_EXTRA, "Too many firmware IDs behind link " + String(idx));
+        fw->count = SUBTREE_FW_ALL;
+        return;
+    }
+    fw->id[fw->count++] = id;
+}
+
+void ESP8266MQTTMesh::set_route(int subdomain, int idx) {
+    int shift = subdomain % 2 * 4;
+    routes[subdomain / 2] = (routes[subdomain / 2] & ~(0xf << shift)) | (idx << shift);
+}
+
+void ESP8266MQTTMesh::clear_routes(int idx) {
+    for (int i = 0; i < 256; i++) {
+        if (get_route(i) == idx) {
+            set_route(i, 0);
+        }
+    }
+    subtreeFw[idx].count = 0;
+}
+
+//Ask our parent for the map entries that changed since we last synced with it
+void ESP8266MQTTMesh::request_bssids() {
+    uint8_t parent[6];
+    if (! parse_mac(ap[ap_idx].bssid, parent) || memcmp(parent, syncParent, 6) != 0) {
+        memcpy(syncParent, parent, 6);
+        syncEpoch = 0;
+        syncVersion = 0;
+    }
+    char msg[32];
+    snprintf(msg, sizeof(msg), "request_bssid:%u:%u", syncEpoch, syncVersion);
+    //Straight to the parent, ahead of anything held in the outbox
+    send_publish("mesh_cmd", msg, MSG_TYPE_NONE);
+}
+
+//Send a child the entries that changed after version 'since' of our map, packed into as few
+//frames as possible.  A child that last synced with another map gets all of it
+void ESP8266MQTTMesh::send_bssids(int idx, uint16_t epoch, uint16_t since) {
+    if (epoch != bssidEpoch || since > bssidVersion) {
+        since = 0;
+    }
+    if (since == bssidVersion) {
+        return;
+    }
+    char topic[TOPIC_LEN];
+    strlcpy(topic, inTopic, sizeof(topic));
+    strlcat(topic, MESHMAP_SYNC_TOPIC, sizeof(topic));
+    int perFrame = (MQTT_MAX_PACKET_SIZE - MESH_FRAME_HEADER_LEN - strlen(topic) - 2 - MESHMAP_SYNC_HEADER) / MESHMAP_SYNC_ENTRY;
+    uint8_t *buf = (uint8_t *)malloc(MESHMAP_SYNC_HEADER + perFrame * MESHMAP_SYNC_ENTRY);
+    if (! buf) {
+        dbgPrintln(EMMDBG_MSG, "Not enough memory to sync link " + String(idx));
+        return;
+    }
+    auto changed = [this] (uint16_t from, uint16_t to) {
+        int count = 0;
+        for (int i = 0; i < bssidMapLen; i++) {
+            count += bssidMap[i].version > from && bssidMap[i].version <= to;
+        }
+        return count;
+    };
+    while (since < bssidVersion) {
+        //Each frame carries the versions (since, upto].  Versions are unique, so the largest
+        //range that fits can be found by bisection
+        uint16_t upto = bssidVersion;
+        if (changed(since, upto) > perFrame) {
+            uint16_t lo = since + 1, hi = bssidVersion;
+            while (lo < hi) {
+                uint16_t mid = lo + (hi - lo + 1) / 2;
+                if (changed(since, mid) <= perFrame) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            upto = lo;
+        }
+        uint8_t *p = buf + MESHMAP_SYNC_HEADER;
+        for (int i = 0; i < bssidMapLen; i++) {
+            if (bssidMap[i].version > since && bssidMap[i].version <= upto) {
+                memcpy(p, bssidMap[i].mac, 6);
+                p[6] = bssidMap[i].subdomain;
+                p += MESHMAP_SYNC_ENTRY;
+            }
+        }
+        buf[0] = bssidEpoch & 0xff;
+        buf[1] = bssidEpoch >> 8;
+        buf[2] = since & 0xff;
+        buf[3] = since >> 8;
+        buf[4] = upto & 0xff;
+        buf[5] = upto >> 8;
+        if (! send_message(idx, topic, (const char *)buf, MSG_TYPE_NONE, p - buf)) {
+            break;
+        }
+        since = upto;
+    }
+    free(buf);
+}
+
+//Apply a sync frame from our parent.  Whatever changed is passed on to our own children
+void ESP8266MQTTMesh::receive_bssids(const uint8_t *msg, int msgLen) {
+    if (msgLen < MESHMAP_SYNC_HEADER || (msgLen - MESHMAP_SYNC_HEADER) % MESHMAP_SYNC_ENTRY) {
+        dbgPrintln(EMMDBG_MSG, "Ignoring malformed map sync");
+        return;
+    }
+    uint16_t epoch = msg[0] | (msg[1] << 8);
+    uint16_t since = msg[2] | (msg[3] << 8);
+    uint16_t upto = msg[4] | (msg[5] << 8);
+    if (epoch != syncEpoch) {
+        syncEpoch = epoch;
+        syncVersion = 0;
+    }
+    uint16_t oldEpoch = bssidEpoch, oldVersion = bssidVersion;
+    uint8_t myMAC[6];
+    bool moved = false;
+    parse_mac(WiFi.softAPmacAddress().c_str(), myMAC);
+    for (int pos = MESHMAP_SYNC_HEADER; pos < msgLen; pos += MESHMAP_SYNC_ENTRY) {
+        const uint8_t *mac = msg + pos;
+        if (get_subdomain(mac) != mac[6] && bump_bssid(mac, mac[6]) && memcmp(mac, myMAC, 6) == 0) {
+            moved = true;
+        }
+    }
+    if (bssidEpoch != oldEpoch || bssidVersion != oldVersion) {
+        map_changed(oldEpoch, oldVersion, moved, true);
+    }
+    //A frame after one that was lost does not bring us up to date
+    if (since <= syncVersion && upto > syncVersion) {
+        syncVersion = upto;
+    }
+}
+
+//Apply a bssid/<MAC> message from the broker
+void ESP8266MQTTMesh::receive_bssid(const char *bssid, const char *msg) {
+    uint8_t mac[6];
+    int subdomain = strtoul(msg, NULL, 10);
+    if (subdomain < 0 || subdomain > 255 || ! parse_mac(bssid, mac)) {
+        dbgPrintln(EMMDBG_MSG, "Illegal subdomain " + String(subdomain) + " for " + String(bssid));
+        return;
+    }
+    if (get_subdomain(mac) == subdomain) {
+        // The new value matches the stored value
+        return;
+    }
+    uint16_t oldEpoch = bssidEpoch, oldVersion = bssidVersion;
+    if (bump_bssid(mac, subdomain)) {
+        map_changed(oldEpoch, oldVersion, strcmp(WiFi.softAPmacAddress().c_str(), bssid) == 0, false);
+    }
+}
+
+//Note that the table in RAM changed after version 'version' of 'epoch'.  moved is set if our own
+//subdomain changed, sync if our children are to be sent the changes
+void ESP8266MQTTMesh::map_changed(uint16_t epoch, uint16_t version, bool moved, bool sync) {
+    if (! mapChanged) {
+        mapChanged = true;
+        mapEpoch = epoch;
+        mapVersion = version;
+    }
+    mapMoved |= moved;
+    mapSync |= sync;
+    if (! loopCalled) {
+        timer_once(TIMER_WORK, 0.0, drain_work);
+    }
+}
+
+//Write the map changes noted since the last call, then move our AP or pass them on to our children
+void ESP8266MQTTMesh::save_map() {
+    write_bssids(mapVersion);
+    bool moved = mapMoved, sync = mapSync;
+    mapChanged = mapMoved = mapSync = false;
+    if (moved) {
+        shutdown_AP();
+        setup_AP();
+        return;
+    }
+    if (sync) {
+        for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+            if (espClient[i]) {
+                send_bssids(i, mapEpoch, mapVersion);
+            }
         }
-        itoa(subdomain, subdomainStr, 10);
-        strlcpy(msg, inTopic, sizeof(msg));
-        strlcat(msg, "bssid/", sizeof(msg));
-        strlcat(msg, dir.fileName().substring(7).c_str(), sizeof(msg)); // bssid
-        strlcat(msg, "=", sizeof(msg));
-        strlcat(msg, subdomainStr, sizeof(msg));
-        send_message(idx, msg);
     }
 }
 
+size_t ESP8266MQTTMesh::frame_size(const uint8_t *header) {
+    return MESH_FRAME_HEADER_LEN + header[3] + 1 + (header[4] | (header[5] << 8)) + 1 +
+           (header[2] & MESH_FLAG_ID ? 2 : 0);
+}
+
+//Returns the length of the frame at the start of data, 0 if more data is needed,
+//or -1 if the data is not a valid frame
+int ESP8266MQTTMesh::parse_frame(const uint8_t *data, size_t len, mesh_frame_t *frame) {
+    if (len < MESH_FRAME_HEADER_LEN) {
+        return 0;
+    }
+    size_t size = frame_size(data);
+    if (data[0] != MESH_FRAME_VERSION || size > MQTT_MAX_PACKET_SIZE) {
+        return -1;
+    }
+    if (len < size) {
+        return 0;
+    }
+    frame->type = data[1];
+    frame->flags = data[2];
+    frame->topic_len = data[3];
+    frame->payload_len = data[4] | (data[5] << 8);
+    frame->raw = (const char *)data;
+    frame->size = size;
+    frame->topic = (const char *)data + MESH_FRAME_HEADER_LEN;
+    frame->payload = frame->topic + frame->topic_len + 1;
+    if (frame->topic[frame->topic_len] != 0 || frame->payload[frame->payload_len] != 0) {
+        return -1;
+    }
+    frame->id = frame->flags & MESH_FLAG_ID ? data[size - 2] | (data[size - 1] << 8) : 0;
+    return size;
+}
 
-void ESP8266MQTTMesh::handle_client_data(int idx, char *rawdata) {
+void ESP8266MQTTMesh::handle_client_data(int idx, const mesh_frame_t *frame) {
             dbgPrintln(EMMDBG_MQTT, "Received: msg from " + espClient[idx]->remoteIP().toString() + " on " + (idx == 0 ? "STA" : "AP"));
-            const char *data = rawdata + (idx ? 1 : 0);
-            dbgPrintln(EMMDBG_MQTT_EXTRA, "--> '" + String(data) + "'");
-            char topic[64];
-            const char *msg;
-            if (! keyValue(data, '=', topic, sizeof(topic), &msg)) {
-                dbgPrintln(EMMDBG_MQTT, "Failed to handle message");
+            dbgPrintln(EMMDBG_MQTT_EXTRA, "--> '" + String(frame->topic) + "=" + String(frame->payload) + "'");
+            const char *topic = frame->topic;
+            const char *msg = frame->payload;
+            if (frame->flags & MESH_FLAG_ACK) {
+                //Acks only travel down the mesh
+                if (idx == 0) {
+                    handle_ack(frame);
+                }
                 return;
             }
             if (idx == 0) {
-                //This is a packet from MQTT, need to rebroadcast to each connected station
-                broadcast_message(data);
-                parse_message(topic, msg);
+                if (strstr(topic, inTopic) == topic && strcmp(topic + strlen(inTopic), MESHMAP_SYNC_TOPIC) == 0) {
+                    queue_work(frame);
+                    return;
+                }
+                if (strstr(topic, inTopic) == topic && strcmp(topic + strlen(inTopic), MESH_REJOIN_TOPIC) == 0) {
+                    //Our parent moved, and we with it
+                    int parentDepth = atoi(msg);
+                    depth = parentDepth < MESH_DEPTH_UNKNOWN - 1 ? parentDepth + 1 : MESH_DEPTH_UNKNOWN;
+                    announce_AP();
+                    return;
+                }
+                //This is a packet from MQTT, pass it down the branches it is meant for
+                uint16_t links = route_links(topic);
+                for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+                    if (espClient[i] && (links & (1 << i))) {
+                        forward_frame(i, frame);
+                    }
+                }
+                queue_work(frame);
             } else {
-                unsigned char msgType = rawdata[0];
-                if (strstr(topic,"/mesh_cmd")  == topic + strlen(topic) - 9) {
+                //Whatever a node sends upstream tells us which child link leads to it
+                int subdomain = strstr(topic, outTopic) == topic ? topic_subdomain(topic + strlen(outTopic)) : -1;
+                if (subdomain >= 0) {
+                    set_route(subdomain, idx);
+                }
+                if (frame->topic_len >= 9 && strcmp(topic + frame->topic_len - 9, "/mesh_cmd") == 0) {
                     // We will handle this packet locally
-                    if (0 == strcmp(msg, "request_bssid")) {
-                        send_bssids(idx);
+                    if (strstr(msg, "route:") == msg) {
+                        //A node in this subtree announcing its firmware ID, pass it on to every
+                        //node between it and the broker
+                        add_subtree_fw(idx, strtoul(msg + 6, NULL, 16));
+                        if (meshConnect && ! failover) {
+                            forward_frame(0, frame);
+                        }
+                    } else if (strstr(msg, "request_bssid") == msg) {
+                        //'request_bssid:<epoch>:<version>' names the map version the node has
+                        //from us, if it synced with us before
+                        unsigned long epoch = 0, since = 0;
+                        char *end;
+                        if (msg[13] == ':') {
+                            epoch = strtoul(msg + 14, &end, 10);
+                            if (*end == ':') {
+                                since = strtoul(end + 1, NULL, 10);
+                            }
+                        }
+                        send_bssids(idx, epoch, since);
                     }
+                } else if (! meshConnect && ! failover) {
+                    relay_publish(frame);
                 } else {
-                    if (! meshConnect) {
-                        mqtt_publish(topic, msg, msgType);
-                    } else {
-                        send_message(0, data, NULL, msgType);
-                    }
+                    //Cut-through, unless the frame uses the child's topic alias
+                    forward_frame(0, frame);
                 }
             }
 }
 
-uint16_t ESP8266MQTTMesh::mqtt_publish(const char *topic, const char *msg, uint8_t msgType)
+//Publish a message another node sent up the mesh.  One with a message ID is acked back to its
+//sender once the broker has acked it, and a copy resent because the ack was lost is acked again
+//rather than published twice
+void ESP8266MQTTMesh::relay_publish(const mesh_frame_t *frame) {
+    if (frame->flags & MESH_FLAG_LZ) {
+        char *buf = alloc_recv_buf();
+        mesh_frame_t unpacked = *frame;
+        int msgLen = buf ? unpack_payload(frame, buf, MQTT_MAX_PACKET_SIZE) : -1;
+        if (msgLen < 0) {
+            dbgPrintln(EMMDBG_MSG, "Dropping compressed message: " + String(frame->topic));
+        } else {
+            unpacked.flags &= ~MESH_FLAG_LZ;
+            unpacked.payload = buf;
+            unpacked.payload_len = msgLen;
+            relay_publish(&unpacked);
+        }
+        if (buf) {
+            free_recv_buf(buf);
+        }
+        return;
+    }
+    int subdomain = -1;
+    if (frame->flags & MESH_FLAG_ID && strstr(frame->topic, outTopic) == frame->topic) {
+        subdomain = topic_subdomain(frame->topic + strlen(outTopic));
+    }
+    if (subdomain <= 0) {
+        mqtt_publish(frame->topic, frame->payload, frame->type, frame->payload_len);
+        return;
+    }
+    for (int i = 0; i < ESP8266_ACK_SLOTS; i++) {
+        relayed_msg_t *r = &relayed[i];
+        if (r->subdomain == subdomain && r->id == frame->id) {
+            if (! r->packetId) {
+                send_ack(subdomain, frame->id);
+            }
+            //Otherwise the broker has yet to ack the first copy
+            return;
+        }
+    }
+    uint16_t packetId = mqtt_publish(frame->topic, frame->payload, frame->type, frame->payload_len);
+    if (! packetId) {
+        //The sender will try again
+        return;
+    }
+    relayed_msg_t *r = &relayed[relayedNext];
+    relayedNext = (relayedNext + 1) % ESP8266_ACK_SLOTS;
+    r->subdomain = subdomain;
+    r->id = frame->id;
+    r->packetId = packetId;
+}
+
+void ESP8266MQTTMesh::send_ack(uint8_t subdomain, uint16_t id) {
+    int idx = get_route(subdomain);
+    if (! idx || ! espClient[idx]) {
+        //The sender will resend once it has found its way back
+        return;
+    }
+    dbgPrintln(EMMDBG_MQTT_EXTRA, "Acking message " + String(id) + " from subdomain " + String(subdomain));
+    uint8_t header[MESH_FRAME_HEADER_LEN] = { MESH_FRAME_VERSION, MSG_TYPE_INVALID, MESH_FLAG_ACK | MESH_FLAG_ID, 0, 1, 0 };
+    uint8_t body[5] = { 0, subdomain, 0, (uint8_t)(id & 0xff), (uint8_t)(id >> 8) };
+    const char *part[] = { (const char *)header, (const char *)body };
+    const size_t partLen[] = { sizeof(header), sizeof(body) };
+    send_frame(idx, part, partLen, 2);
+}
+
+//An ack from upstream: ours, or pass it down towards its sender
+void ESP8266MQTTMesh::handle_ack(const mesh_frame_t *frame) {
+    if (frame->payload_len != 1) {
+        return;
+    }
+    uint8_t subdomain = frame->payload[0];
+    if (AP_ready && subdomain == topic_subdomain(mySSID)) {
+        if (ackWait && frame->id == ackWait) {
+            drop_held(0);
+        }
+        return;
+    }
+    int idx = get_route(subdomain);
+    if (idx && espClient[idx]) {
+        forward_frame(idx, frame);
+    }
+}
+
+uint16_t ESP8266MQTTMesh::mqtt_publish(const char *topic, const char *msg, uint8_t msgType, int msgLen)
 {
     uint8_t qos = 0;
     bool retain = false;
@@ -706,7 +2516,7 @@ uint16_t ESP8266MQTTMesh::mqtt_publish(const char *topic, const char *msg, uint8
     {
         qos = msgType - MSG_TYPE_QOS_0;
     }
-    mqttClient.publish(topic, qos, retain, msg);
+    return mqttClient.publish(topic, qos, retain, msg, msgLen < 0 ? strlen(msg) : msgLen);
 }
 
 bool ESP8266MQTTMesh::keyValue(const char *data, char separator, char *key, int keylen, const char **value) {
@@ -773,6 +2583,12 @@ ota_info_t ESP8266MQTTMesh::parse_ota_info(const char *str) {
         dbgPrintln(EMMDBG_OTA_EXTRA, "Key: " + String(key) + " Value: " + String(value));
         if (0 == strcmp(key, "len")) {
             ota_info.len = strtoul(value, NULL, 10);
+        } else if (0 == strcmp(key, "chunk")) {
+            ota_info.chunk = strtoul(value, NULL, 10);
+        } else if (0 == strcmp(key, "raw")) {
+            ota_info.raw = strtoul(value, NULL, 10) == 1;
+        } else if (0 == strcmp(key, "verified")) {
+            ota_info.verified = strtoul(value, NULL, 10) == 1;
         } else if (0 == strcmp(key, "md5")) {
             if(strlen(value) == 24 && base64_dec_len(value, 24) == 16) {
               base64_decode((char *)ota_info.md5, value,  24);
@@ -783,6 +2599,8 @@ ota_info_t ESP8266MQTTMesh::parse_ota_info(const char *str) {
     }
     return ota_info;
 }
+//The MD5 is kept up to date while the image arrives in order, so normally only what is missing
+//from the running digest is read back from flash.  The result is recorded in /ota
 bool ESP8266MQTTMesh::check_ota_md5() {
     uint8_t buf[128];
     File f = SPIFFS.open("/ota", "r");
@@ -790,46 +2608,227 @@ bool ESP8266MQTTMesh::check_ota_md5() {
     f.close();
     dbgPrintln(EMMDBG_OTA_EXTRA, "Read /ota: " + String((char *)buf));
     ota_info_t ota_info = parse_ota_info((char *)buf);
+    if (ota_info.verified) {
+        return true;
+    }
     if (ota_info.len > freeSpaceEnd - freeSpaceStart) {
         return false;
     }
-    MD5Builder _md5;
-    _md5.begin();
-    uint32_t address = freeSpaceStart;
-    unsigned int len = ota_info.len;
-    while(len) {
-        int size = len > sizeof(buf) ? sizeof(buf) : len;
-        if (! ESP.flashRead(address, (uint32_t *)buf, (size + 3) & ~3)) {
+    if (ota.len != ota_info.len) {
+        //No digest in progress for this image (e.g. we rebooted since 'start')
+        otaMD5.begin();
+        ota.len = ota_info.len;
+        ota.hashed = 0;
+    }
+    dbgPrintln(EMMDBG_OTA, "Reading " + String(ota_info.len - ota.hashed) + " bytes to complete MD5");
+    if (! ota_hash_flash(ota_info.len)) {
+        return false;
+    }
+    byte md5[16];
+    otaMD5.calculate();
+    otaMD5.getBytes(md5);
+    //The digest is final now, any later check has to start over
+    otaMD5.begin();
+    ota.hashed = 0;
+    if (memcmp(md5, ota_info.md5, 16) != 0) {
+        return false;
+    }
+    f = SPIFFS.open("/ota", "w");
+    f.print((char *)buf);
+    f.print(",verified:1\n");
+    f.close();
+    return true;
+}
+
+//Extend the running MD5 up to 'end' from what has already been written to flash
+bool ESP8266MQTTMesh::ota_hash_flash(uint32_t end) {
+    uint8_t data[128];
+    while(ota.hashed < end) {
+        //flashRead() needs a word aligned address
+        uint32_t skip = ota.hashed & 3;
+        uint32_t size = end - ota.hashed + skip > sizeof(data) ? sizeof(data) : end - ota.hashed + skip;
+        if (! ESP.flashRead(freeSpaceStart + ota.hashed - skip, (uint32_t *)data, (size + 3) & ~3)) {
             return false;
         }
-        _md5.add(buf, size);
-        address += size;
-        len -= size;
+        otaMD5.add(data + skip, size - skip);
+        ota.hashed += size - skip;
+    }
+    return true;
+}
+
+//Erase the sector just ahead of the write cursor, so it is ready by the time the data arrives
+void ESP8266MQTTMesh::erase_sector() {
+    uint32_t next = (ota.page_addr + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    if (ota.len && next < ota.len) {
+        ota_erase(next, 1);
+    }
+}
+
+void ESP8266MQTTMesh::ota_reboot() {
+    for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+        if (espClient[i] && espClient[i]->connected() && (sendQueue[i].len || sendQueue[i].inflight) &&
+            (int32_t)(millis() - ota.reboot_at) < 0) {
+            timer_once(TIMER_OTA_REBOOT, 0.1, ota_reboot);
+            return;
+        }
     }
-    _md5.calculate();
-    _md5.getBytes(buf);
-    for (int i = 0; i < 16; i++) {
-        if (buf[i] != ota_info.md5[i]) {
+    shutdown_AP();
+    mqttClient.disconnect();
+    delay(100);
+    ESP.restart();
+    die();
+}
+
+//Make sure the sectors covering 'len' bytes at 'address' are erased.  Sectors are tracked
+//individually, so data arriving out of order only costs the sectors it lands in
+bool ESP8266MQTTMesh::ota_erase(uint32_t address, uint32_t len) {
+    for (uint32_t sector = address / FLASH_SECTOR_SIZE; sector * FLASH_SECTOR_SIZE < address + len; sector++) {
+        if (sector >= OTA_MAX_SECTORS) {
+            return false;
+        }
+        if (ota.erased[sector / 8] & (1 << (sector % 8))) {
+            continue;
+        }
+        if (! ESP.flashEraseSector(freeSpaceStart / FLASH_SECTOR_SIZE + sector)) {
+            dbgPrintln(EMMDBG_MSG, "Failed to erase firmware sector at " + String(freeSpaceStart + sector * FLASH_SECTOR_SIZE, HEX));
             return false;
         }
+        ota.erased[sector / 8] |= 1 << (sector % 8);
     }
     return true;
 }
 
-void ESP8266MQTTMesh::erase_sector() {
-    int start = freeSpaceStart / FLASH_SECTOR_SIZE;
-    //erase flash area here
-    ESP.flashEraseSector(nextErase--);
-    if (nextErase >= start) {
-        schedule.once(0.0, erase_sector, this);
-    } else {
-        nextErase = 0;
-        dbgPrintln(EMMDBG_OTA, "Erase complete in " +  String((micros() - startTime) / 1000000.0, 6) + " seconds");
+//Write the buffered page.  spi_flash_write() needs a word aligned length, padding with 0xff
+//leaves the flash untouched since writes can only clear bits
+bool ESP8266MQTTMesh::ota_flush() {
+    if (ota.page_len == ota.page_pad) {
+        return true;
+    }
+    uint32_t len = (ota.page_len + 3) & ~3;
+    memset(ota.page + ota.page_len, 0xff, len - ota.page_len);
+    bool ok = ota_erase(ota.page_addr, len) &&
+              ESP.flashWrite(freeSpaceStart + ota.page_addr, (uint32_t *)ota.page, len);
+    if (! ok) {
+        dbgPrintln(EMMDBG_MSG, "Failed to write firmware at " + String(freeSpaceStart + ota.page_addr, HEX) + " Length: " + String(len));
+        //Report these chunks as missing so they are sent again
+        ota_mark(ota.page_addr + ota.page_pad, ota.page_len - ota.page_pad, false);
+    } else if (ota.page_addr + ota.page_pad <= ota.hashed && ota.page_addr + ota.page_len > ota.hashed) {
+        uint32_t end = ota.page_addr + ota.page_len < ota.len ? ota.page_addr + ota.page_len : ota.len;
+        if (end > ota.hashed) {
+            otaMD5.add(ota.page + (ota.hashed - ota.page_addr), end - ota.hashed);
+            ota.hashed = end;
+        }
+    }
+    ota.written += ota.page_len - ota.page_pad;
+    //The next page starts on a word boundary too: a partial last word is kept and written again
+    //with the data that follows it, which leaves the bytes already written as they are
+    uint32_t end = ota.page_addr + ota.page_len;
+    uint32_t carry = end & 3;
+    memmove(ota.page, ota.page + ota.page_len - carry, carry);
+    ota.page_addr = end - carry;
+    ota.page_len = carry;
+    ota.page_pad = carry;
+    uint8_t progress = (uint64_t)(ota.written > ota.len ? ota.len : ota.written) * 100 / ota.len;
+    if (progress / 10 != ota.progress / 10) {
+        ota.progress = progress;
+        dbgPrintln(EMMDBG_OTA, "OTA progress: " + String(progress) + "%");
+        publish("ota/progress", String(progress).c_str());
+    }
+    uint32_t next = (ota.page_addr + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    if (next < ota.len && ! (ota.erased[next / FLASH_SECTOR_SIZE / 8] & (1 << (next / FLASH_SECTOR_SIZE % 8)))) {
+        timer_once(TIMER_OTA_ERASE, 0.0, erase_sector);
+    }
+    return ok;
+}
+
+//Record chunks as received, or clear every chunk the range touches
+void ESP8266MQTTMesh::ota_mark(uint32_t address, uint32_t len, bool received) {
+    if (! ota.chunks || ! len) {
+        return;
+    }
+    if (received) {
+        //Only whole chunks count
+        uint32_t i = address / ota.chunk;
+        if (address % ota.chunk == 0 && (len == ota.chunk || address + len == ota.len)
+            && i / 8 < (ota.len / ota.chunk + 8) / 8) {
+            ota.chunks[i / 8] |= 1 << (i % 8);
+        }
+        return;
+    }
+    for (uint32_t i = address / ota.chunk; i * ota.chunk < address + len && i * ota.chunk < ota.len; i++) {
+        ota.chunks[i / 8] &= ~(1 << (i % 8));
+    }
+}
+
+//Publish the addresses of the chunks below 'end' that have not been received, as a list of
+//ranges ('0,1536-3072'), or 'none'.  The list is cut short if it does not fit in one message;
+//the sender asks again once it has resent those
+void ESP8266MQTTMesh::ota_missing(uint32_t end) {
+    char msg[200];
+    msg[0] = 0;
+    if (end > ota.len) {
+        end = ota.len;
+    }
+    uint32_t count = (end + ota.chunk - 1) / ota.chunk;
+    for (uint32_t i = 0; i < count; i++) {
+        if (ota.chunks[i / 8] & (1 << (i % 8))) {
+            continue;
+        }
+        uint32_t last = i;
+        while (last + 1 < count && ! (ota.chunks[(last + 1) / 8] & (1 << ((last + 1) % 8)))) {
+            last++;
+        }
+        char range[24];
+        if (last == i) {
+            snprintf(range, sizeof(range), "%s%u", msg[0] ? "," : "", i * ota.chunk);
+        } else {
+            snprintf(range, sizeof(range), "%s%u-%u", msg[0] ? "," : "", i * ota.chunk, last * ota.chunk);
+        }
+        if (strlen(msg) + strlen(range) >= sizeof(msg)) {
+            break;
+        }
+        strlcat(msg, range, sizeof(msg));
+        i = last;
+    }
+    publish("ota/missing", msg[0] ? msg : "none");
+}
+
+//Collect firmware into sector sized pages so flash is written in aligned 4k blocks.
+//Data that is not contiguous with the current page (a resent or reordered chunk) starts a new one
+void ESP8266MQTTMesh::ota_write(uint32_t address, const uint8_t *data, size_t len) {
+    if (! ota.page) {
+        dbgPrintln(EMMDBG_MSG, "Ignoring firmware data, no OTA in progress");
+        return;
+    }
+    //A stale chunk of an earlier, larger image
+    if (address >= ota.len || address + len > ota.len) {
+        dbgPrintln(EMMDBG_MSG, "Ignoring firmware data past the end of the image @ " + String(address));
+        return;
+    }
+    ota_mark(address, len, true);
+    if (address != ota.page_addr + ota.page_len) {
+        ota_flush();
+        //Pages start on a word boundary, pad any leading bytes
+        ota.page_addr = address & ~3;
+        ota.page_len = address - ota.page_addr;
+        ota.page_pad = ota.page_len;
+        memset(ota.page, 0xff, ota.page_len);
+    }
+    while (len) {
+        uint32_t room = FLASH_SECTOR_SIZE - (ota.page_addr + ota.page_len) % FLASH_SECTOR_SIZE;
+        uint32_t copy = len < room ? len : room;
+        memcpy(ota.page + ota.page_len, data, copy);
+        ota.page_len += copy;
+        data += copy;
+        len -= copy;
+        if (copy == room || ota.page_addr + ota.page_len >= ota.len) {
+            ota_flush();
+        }
     }
 }
 
-void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
-    dbgPrintln(EMMDBG_OTA_EXTRA, "OTA cmd " + String(cmd) + " Length: " + String(strlen(msg)));
+void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg, int msgLen) {
+    dbgPrintln(EMMDBG_OTA_EXTRA, "OTA cmd " + String(cmd) + " Length: " + String(msgLen));
     if(strstr(cmd, mySSID) == cmd) {
         cmd += strlen(mySSID);
     } else {
@@ -862,11 +2861,49 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
             dbgPrintln(EMMDBG_MSG, "Not enough space for firmware: " + String(ota_info.len) + " > " + String(freeSpaceEnd - freeSpaceStart));
             return;
         }
-        uint32_t end = (freeSpaceStart + ota_info.len + FLASH_SECTOR_SIZE - 1) & (~(FLASH_SECTOR_SIZE - 1));
-        nextErase = end / FLASH_SECTOR_SIZE - 1;
-        startTime = micros();
-        dbgPrintln(EMMDBG_OTA, "Erasing " + String((end - freeSpaceStart)/ FLASH_SECTOR_SIZE) + " sectors");
-        schedule.once(0.0, erase_sector, this);
+        //Sectors are erased as the write cursor reaches them rather than all up front,
+        //so data can be sent as soon as 'start' has been published
+        uint16_t chunk = ota_info.chunk ? ota_info.chunk : OTA_DEFAULT_CHUNK;
+        //Binary chunks must fit in a mesh frame, base64 ones are decoded into a 768 byte buffer
+        if (chunk < OTA_MIN_CHUNK || chunk > (ota_info.raw ? MQTT_MAX_PACKET_SIZE - 128 : OTA_DEFAULT_CHUNK)) {
+            dbgPrintln(EMMDBG_MSG, "Illegal chunk size " + String(chunk));
+            return;
+        }
+        free(ota.chunks);
+        ota.chunks = (uint8_t *)calloc((ota_info.len / chunk + 8) / 8, 1);
+        if (! ota.page) {
+            ota.page = (uint8_t *)malloc(FLASH_SECTOR_SIZE);
+        }
+        if (! ota.page || ! ota.chunks) {
+            dbgPrintln(EMMDBG_MSG, "Not enough memory for OTA");
+            return;
+        }
+        ota.len = ota_info.len;
+        ota.chunk = chunk;
+        ota.raw = ota_info.raw;
+        memset(ota.erased, 0, sizeof(ota.erased));
+        ota.page_addr = 0;
+        ota.page_len = 0;
+        ota.page_pad = 0;
+        ota.hashed = 0;
+        ota.written = 0;
+        ota.progress = 0;
+        otaMD5.begin();
+        timer_once(TIMER_OTA_ERASE, 0.0, erase_sector);
+    }
+    else if(0 == strcmp(cmd, "missing")) {
+        if (! ota.chunks) {
+            dbgPrintln(EMMDBG_OTA, "Ignoring 'missing', no OTA in progress");
+            return;
+        }
+        ota_flush();
+        //Chunks that arrived out of order may have closed the gap in the running MD5
+        uint32_t end = ota.hashed;
+        while (end < ota.len && (ota.chunks[end / ota.chunk / 8] & (1 << (end / ota.chunk % 8)))) {
+            end = (end / ota.chunk + 1) * ota.chunk;
+        }
+        ota_hash_flash(end < ota.len ? end : ota.len);
+        ota_missing(strlen(msg) ? strtoul(msg, NULL, 10) : ota.len);
     }
     else if(0 == strcmp(cmd, "check")) {
         if (strlen(msg) > 0) {
@@ -878,12 +2915,14 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
             _md5.getChars(out);
             publish("check", out);
         } else {
+            ota_flush();
             const char *md5ok = check_ota_md5() ? "MD5 Passed" : "MD5 Failed";
             dbgPrintln(EMMDBG_OTA, md5ok);
             publish("check", md5ok);
         }
     }
     else if(0 == strcmp(cmd, "flash")) {
+        ota_flush();
         if (! check_ota_md5()) {
             dbgPrintln(EMMDBG_MSG, "Flash failed due to md5 mismatch");
             publish("flash", "Failed");
@@ -903,11 +2942,9 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
         eboot_command_write(&ebcmd);
         //publish("flash", "Success");
 
-        shutdown_AP();
-        mqttClient.disconnect();
-        delay(100);
-        ESP.restart();
-        die();
+        //The command has already been relayed to our children, let it reach them before the AP goes down
+        ota.reboot_at = millis() + 2000;
+        ota_reboot();
     }
     else {
         char *end;
@@ -916,28 +2953,38 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
             dbgPrintln(EMMDBG_MSG, "Illegal address " + String(address) + " specified");
             return;
         }
-        int msglen = strlen(msg);
-        if (msglen > 1024) {
-            dbgPrintln(EMMDBG_MSG, "Message length " + String(msglen) + " too long");
-            return;
-        }
-        byte data[768];
         long t = micros();
-        int len = base64_decode((char *)data, msg, msglen);
-        if (address + len > freeSpaceEnd) {
+        const uint8_t *data = (const uint8_t *)msg;
+        int len = msgLen;
+        byte decoded[OTA_DEFAULT_CHUNK + 1];  //base64_decode() adds a NUL
+        if (! ota.raw) {
+            if (msgLen > base64_enc_len(OTA_DEFAULT_CHUNK)) {
+                dbgPrintln(EMMDBG_MSG, "Message length " + String(msgLen) + " too long");
+                return;
+            }
+            len = base64_decode((char *)decoded, msg, msgLen);
+            data = decoded;
+        }
+        if (address + len > freeSpaceEnd - freeSpaceStart) {
             dbgPrintln(EMMDBG_MSG, "Message length would run past end of free space");
             return;
         }
         dbgPrintln(EMMDBG_OTA_EXTRA, "Got " + String(len) + " bytes FW @ " + String(address, HEX));
-        bool ok = ESP.flashWrite(freeSpaceStart + address, (uint32_t*) data, len);
-        dbgPrintln(EMMDBG_OTA, "Wrote " + String(len) + " bytes in " +  String((micros() - t) / 1000000.0, 6) + " seconds");
-        if (! ok) {
-            dbgPrintln(EMMDBG_MSG, "Failed to write firmware at " + String(freeSpaceStart + address, HEX) + " Length: " + String(len));
-        }
+        ota_write(address, data, len);
+        dbgPrintln(EMMDBG_OTA, "Handled " + String(len) + " bytes in " +  String((micros() - t) / 1000000.0, 6) + " seconds");
     }
 }
 
 void ESP8266MQTTMesh::onWifiConnect(const WiFiEventStationModeGotIP& event) {
+    note_parent();
+    parentTries = ESP8266_PARENT_TRIES;
+    if (! meshConnect) {
+        depth = 1;
+    } else if (ap[ap_idx].depth < MESH_DEPTH_UNKNOWN - 1) {
+        depth = ap[ap_idx].depth + 1;
+    } else {
+        depth = MESH_DEPTH_UNKNOWN;
+    }
     if (meshConnect) {
         dbgPrintln(EMMDBG_WIFI, "Connecting to mesh: " + WiFi.gatewayIP().toString() + " on port: " + String(mesh_port));
 #if ASYNC_TCP_SSL_ENABLED
@@ -945,7 +2992,7 @@ void ESP8266MQTTMesh::onWifiConnect(const WiFiEventStationModeGotIP& event) {
 #else
         espClient[0]->connect(WiFi.gatewayIP(), mesh_port);
 #endif
-        bufptr[0] = inbuffer[0];
+        reset_recv(0);
     } else {
         dbgPrintln(EMMDBG_WIFI, "Connecting to mqtt");
         connect_mqtt();
@@ -956,16 +3003,25 @@ void ESP8266MQTTMesh::onWifiDisconnect(const WiFiEventStationModeDisconnected& e
     //Reasons are here: ESP8266WiFiType.h-> WiFiDisconnectReason 
     dbgPrintln(EMMDBG_WIFI, "Disconnected from Wi-Fi: " + event.ssid + " because: " + String(event.reason));
     WiFi.disconnect();
-    if (! connecting) {
+    bool quick = ! connecting || parentConnect || failover;
+    if (! connecting && AP_ready) {
+        //Our children stay attached while we move on to the next best parent
+        start_failover();
+        ap_idx++;
+        retry_connect = 1;
+    } else if (! connecting) {
         ap_idx = LAST_AP;
-    } else if (event.reason == WIFI_DISCONNECT_REASON_ASSOC_TOOMANY  && retry_connect) {
+    } else if (event.reason == WIFI_DISCONNECT_REASON_ASSOC_TOOMANY  && retry_connect && ! failover) {
         // If we rebooted without a clean shutdown, we may still be associated with this AP, in which case
         // we'll be booted and should try again
         retry_connect--;
     } else {
         ap_idx++;
+        retry_connect = 1;
     }
-    schedule_connect();
+    //Losing a link, we go straight back to the same parent, and if that fails we scan right away.
+    //Our children are waiting on us during a failover, so we don't wait at all
+    schedule_connect(failover ? 0.0 : quick ? 0.5 : 5.0);
 }
 
 //void ESP8266MQTTMesh::onDHCPTimeout() {
@@ -974,10 +3030,16 @@ void ESP8266MQTTMesh::onWifiDisconnect(const WiFiEventStationModeDisconnected& e
 
 void ESP8266MQTTMesh::onAPConnect(const WiFiEventSoftAPModeStationConnected& ip) {
     dbgPrintln(EMMDBG_WIFI, "Got connection from Station");
+    if (AP_ready) {
+        advertise_AP();
+    }
 }
 
 void ESP8266MQTTMesh::onAPDisconnect(const WiFiEventSoftAPModeStationDisconnected& ip) {
     dbgPrintln(EMMDBG_WIFI, "Got disconnection from Station");
+    if (AP_ready) {
+        advertise_AP();
+    }
 }
 
 void ESP8266MQTTMesh::onMqttConnect(bool sessionPresent) {
@@ -994,11 +3056,13 @@ void ESP8266MQTTMesh::onMqttConnect(bool sessionPresent) {
     strlcat(subscribe, "#", sizeof(subscribe));
     mqttClient.subscribe(subscribe, 0);
 
-    if (match_bssid(WiFi.softAPmacAddress().c_str())) {
+    if (failover) {
+        rejoin();
+    } else if (match_bssid(WiFi.softAPmacAddress().c_str())) {
         setup_AP();
     } else {
         //If we don't get a mapping for our BSSID within 10 seconds, define one
-        schedule.once(10.0, assign_subdomain, this);
+        timer_once(TIMER_ASSIGN_SUBDOMAIN, 10.0, assign_subdomain);
     }
 }
 
@@ -1014,7 +3078,16 @@ void ESP8266MQTTMesh::onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
         return;
     }
 #endif
-    shutdown_AP();
+    //Relayed messages the broker never acked will be resent by their senders
+    for (int i = 0; i < ESP8266_ACK_SLOTS; i++) {
+        if (relayed[i].packetId) {
+            relayed[i].subdomain = 0;
+        }
+    }
+    start_failover();
+    if (failover && millis() - failoverStart > ESP8266_FAILOVER_TIME * 1000UL) {
+        shutdown_AP();
+    }
     if (WiFi.isConnected()) {
         connect_mqtt();
     }
@@ -1035,17 +3108,37 @@ void ESP8266MQTTMesh::onMqttUnsubscribe(uint16_t packetId) {
 }
 
 void ESP8266MQTTMesh::onMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
-  memcpy(inbuffer[0], payload, len);
-  inbuffer[0][len]= 0;
-  dbgPrintln(EMMDBG_MQTT_EXTRA, "Message arrived [" + String(topic) + "] '" + String(inbuffer[0]) + "'");
-  broadcast_message(topic, inbuffer[0]);
-  parse_message(topic, inbuffer[0]);
+  if (len != total || len >= MQTT_MAX_PACKET_SIZE) {
+      dbgPrintln(EMMDBG_MQTT, "Dropping oversized message [" + String(topic) + "]");
+      return;
+  }
+  char *buf = alloc_recv_buf();
+  if (! buf) {
+      dbgPrintln(EMMDBG_MQTT, "No receive buffer free, dropping message [" + String(topic) + "]");
+      recvState[0].dropped++;
+      return;
+  }
+  memcpy(buf, payload, len);
+  buf[len]= 0;
+  dbgPrintln(EMMDBG_MQTT_EXTRA, "Message arrived [" + String(topic) + "] '" + String(buf) + "'");
+  route_message(topic, buf, len);
+  queue_work(topic, buf, len);
+  free_recv_buf(buf);
 }
 
 void ESP8266MQTTMesh::onMqttPublish(uint16_t packetId) {
-  //Serial.println("Publish acknowledged.");
-  //Serial.print("  packetId: ");
-  //Serial.println(packetId);
+    dbgPrintln(EMMDBG_MQTT_EXTRA, "Publish acknowledged: " + String(packetId));
+    for (int i = 0; i < ESP8266_ACK_SLOTS; i++) {
+        relayed_msg_t *r = &relayed[i];
+        if (r->subdomain && r->packetId == packetId) {
+            r->packetId = 0;
+            send_ack(r->subdomain, r->id);
+            return;
+        }
+    }
+    if (ackWait && ackWait == packetId) {
+        drop_held(0);
+    }
 }
 
 #if ASYNC_TCP_SSL_ENABLED
@@ -1078,7 +3171,8 @@ void ESP8266MQTTMesh::onClient(AsyncClient* c) {
             espClient[i]->onAck(       [this](void * arg, AsyncClient *c, size_t len, uint32_t time){ this->onAck(c, len, time);  }, this);
             espClient[i]->onTimeout(   [this](void * arg, AsyncClient *c, uint32_t time)            { this->onTimeout(c, time);   }, this);
             espClient[i]->onData(      [this](void * arg, AsyncClient *c, void* data, size_t len)   { this->onData(c, data, len); }, this);
-            bufptr[i] = inbuffer[i];
+            reset_recv(i);
+            open_queue(i);
             return;
         }
     }
@@ -1088,6 +3182,11 @@ void ESP8266MQTTMesh::onClient(AsyncClient* c) {
 
 void ESP8266MQTTMesh::onConnect(AsyncClient* c) {
     dbgPrintln(EMMDBG_WIFI, "Connected to mesh");
+    if (! failover) {
+        open_queue(0);
+    }
+    //A new parent knows none of our topic aliases
+    clear_aliases();
 #if ASYNC_TCP_SSL_ENABLED
     if (mesh_secure) {
         SSL* clientSsl = c->getSSL();
@@ -1110,7 +3209,9 @@ void ESP8266MQTTMesh::onConnect(AsyncClient* c) {
     }
 #endif
 
-    if (match_bssid(WiFi.softAPmacAddress().c_str())) {
+    if (failover) {
+        rejoin();
+    } else if (match_bssid(WiFi.softAPmacAddress().c_str())) {
         setup_AP();
     }
 }
@@ -1118,8 +3219,15 @@ void ESP8266MQTTMesh::onConnect(AsyncClient* c) {
 void ESP8266MQTTMesh::onDisconnect(AsyncClient* c) {
     if (c == espClient[0]) {
         dbgPrintln(EMMDBG_WIFI, "Disconnected from mesh");
-        shutdown_AP();
-        WiFi.disconnect();
+        reset_recv(0);
+        if (AP_ready) {
+            start_failover();
+        } else {
+            close_queue(0);
+        }
+        if (WiFi.isConnected()) {
+            WiFi.disconnect();
+        }
         return;
     }
     for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
@@ -1127,6 +3235,10 @@ void ESP8266MQTTMesh::onDisconnect(AsyncClient* c) {
             dbgPrintln(EMMDBG_WIFI, "Disconnected from AP");
             delete espClient[i];
             espClient[i] = NULL;
+            close_queue(i);
+            reset_recv(i);
+            clear_routes(i);
+            return;
         }
     }
     dbgPrintln(EMMDBG_WIFI, "Disconnected unknown client");
@@ -1136,6 +3248,14 @@ void ESP8266MQTTMesh::onError(AsyncClient* c, int8_t error) {
 }
 void ESP8266MQTTMesh::onAck(AsyncClient* c, size_t len, uint32_t time) {
     dbgPrintln(EMMDBG_WIFI_EXTRA, "Got ack on " + c->remoteIP().toString() + ": " + String(len) + " / " + String(time));
+    for (int i = 0; i <= ESP8266_NUM_CLIENTS; i++) {
+        if (c == espClient[i]) {
+            send_queue_t *q = &sendQueue[i];
+            q->inflight = len < q->inflight ? q->inflight - len : 0;
+            send_queued(i);
+            return;
+        }
+    }
 }
 
 void ESP8266MQTTMesh::onTimeout(AsyncClient* c, uint32_t time) {
@@ -1147,12 +3267,89 @@ void ESP8266MQTTMesh::onData(AsyncClient* c, void* data, size_t len) {
     dbgPrintln(EMMDBG_WIFI_EXTRA, "Got data from " + c->remoteIP().toString());
     for (int idx = meshConnect ? 0 : 1; idx <= ESP8266_NUM_CLIENTS; idx++) {
         if (espClient[idx] == c) {
-            char *dptr = (char *)data;
-            for (int i = 0; i < len; i++) {
-                *bufptr[idx]++ = dptr[i];
-                if(! dptr[i]) {
-                    handle_client_data(idx, inbuffer[idx]);
-                    bufptr[idx] = inbuffer[idx];
+            const uint8_t *dptr = (const uint8_t *)data;
+            recv_state_t *r = &recvState[idx];
+            mesh_frame_t frame;
+            while (len && espClient[idx] == c) {
+                int frameLen;
+                if (r->discard) {
+                    size_t skip = len < r->discard ? len : r->discard;
+                    if (r->header[2] & MESH_FLAG_ALIAS) {
+                        keep_alias(idx, dptr, skip);
+                    }
+                    r->skipped += skip;
+                    r->discard -= skip;
+                    dptr += skip;
+                    len -= skip;
+                    continue;
+                }
+                if (r->len == 0) {
+                    //Frames that arrived whole are handled in place
+                    frameLen = parse_frame(dptr, len, &frame);
+                    if (frameLen < 0) {
+                        dbgPrintln(EMMDBG_MSG, "Dropping connection due to invalid frame");
+                        c->close(true);
+                        return;
+                    }
+                    if (frameLen > 0) {
+                        if (expand_alias(idx, &frame)) {
+                            handle_client_data(idx, &frame);
+                        }
+                        dptr += frameLen;
+                        len -= frameLen;
+                        continue;
+                    }
+                }
+                if (r->len < MESH_FRAME_HEADER_LEN) {
+                    //The header is collected separately so a buffer is only taken once the frame is known to be valid
+                    size_t copy = MESH_FRAME_HEADER_LEN - r->len;
+                    copy = len < copy ? len : copy;
+                    memcpy(r->header + r->len, dptr, copy);
+                    r->len += copy;
+                    dptr += copy;
+                    len -= copy;
+                    if (r->len < MESH_FRAME_HEADER_LEN) {
+                        continue;
+                    }
+                    if (parse_frame(r->header, MESH_FRAME_HEADER_LEN, &frame) < 0) {
+                        dbgPrintln(EMMDBG_MSG, "Dropping connection due to invalid frame");
+                        c->close(true);
+                        return;
+                    }
+                    r->buf = alloc_recv_buf(true);
+                    if (! r->buf) {
+                        //Skip the frame but stay in sync with the stream
+                        dbgPrintln(EMMDBG_MSG, "No receive buffer free, dropping message on link " + String(idx));
+                        r->dropped++;
+                        r->discard = frame_size(r->header) - MESH_FRAME_HEADER_LEN;
+                        r->skipped = 0;
+                        r->len = 0;
+                        continue;
+                    }
+                    memcpy(r->buf, r->header, MESH_FRAME_HEADER_LEN);
+                }
+                //Collect the rest of a frame that is split across packets
+                size_t copy = frame_size(r->header) - r->len;
+                copy = len < copy ? len : copy;
+                memcpy(r->buf + r->len, dptr, copy);
+                r->len += copy;
+                dptr += copy;
+                len -= copy;
+                frameLen = parse_frame((const uint8_t *)r->buf, r->len, &frame);
+                if (frameLen < 0) {
+                    dbgPrintln(EMMDBG_MSG, "Dropping connection due to invalid frame");
+                    c->close(true);
+                    return;
+                }
+                if (frameLen > 0) {
+                    //Detach the buffer first, handling the frame may reset the link
+                    char *buf = r->buf;
+                    r->buf = NULL;
+                    r->len = 0;
+                    if (expand_alias(idx, &frame)) {
+                        handle_client_data(idx, &frame);
+                    }
+                    free_recv_buf(buf);
                 }
             }
             return;
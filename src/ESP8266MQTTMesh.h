@@ -5,9 +5,10 @@
     #define MQTT_MAX_PACKET_SIZE 1152
 #endif
 #if  ! defined(ESP8266MESHMQTT_DISABLE_OTA)
-    //By default we support OTA
-    #if ! defined(MQTT_MAX_PACKET_SIZE) || MQTT_MAX_PACKET_SIZE < (1024+128)
-        #error "Must define MQTT_MAX_PACKET_SIZE >= 1152"
+    //By default we support OTA.  Firmware arrives in binary chunks of 768 bytes plus topic.
+    //Senders that base64 encode the chunks need MQTT_MAX_PACKET_SIZE >= 1152
+    #if ! defined(MQTT_MAX_PACKET_SIZE) || MQTT_MAX_PACKET_SIZE < (768+128)
+        #error "Must define MQTT_MAX_PACKET_SIZE >= 896"
     #endif
     #define HAS_OTA 1
 #else
@@ -44,6 +45,127 @@
 #ifndef ESP8266_NUM_CLIENTS
   #define ESP8266_NUM_CLIENTS 4
 #endif
+#if ESP8266_NUM_CLIENTS > 15
+  #error "ESP8266_NUM_CLIENTS must be <= 15"
+#endif
+
+//Firmware IDs tracked per child link.  A subtree running more distinct firmwares than this
+//gets every firmware-ID OTA message
+#ifndef ESP8266_SUBTREE_FW_IDS
+  #define ESP8266_SUBTREE_FW_IDS 4
+#endif
+
+//Per-link outbound queue, allocated while the link is connected, for what the AsyncClient has
+//no room for.  One frame of the largest size by default
+#ifndef ESP8266_SEND_QUEUE_LEN
+  #define ESP8266_SEND_QUEUE_LEN MQTT_MAX_PACKET_SIZE
+#endif
+#if ESP8266_SEND_QUEUE_LEN < MQTT_MAX_PACKET_SIZE
+  #error "ESP8266_SEND_QUEUE_LEN must be >= MQTT_MAX_PACKET_SIZE"
+#endif
+
+//Topics sent up a mesh link are replaced by a 1 byte alias once the parent has seen them, in the
+//spirit of MQTT 5 topic aliases.  A node keeps ESP8266_TOPIC_ALIASES topics for its parent link,
+//and as many for each child link that uses them (a pointer each, and a copy of each topic in use).
+//0 disables them
+#ifndef ESP8266_TOPIC_ALIASES
+  #define ESP8266_TOPIC_ALIASES 8
+#endif
+#if ESP8266_TOPIC_ALIASES > 255
+  #error "ESP8266_TOPIC_ALIASES must be <= 255"
+#endif
+
+//Payloads of ESP8266_COMPRESS_MIN bytes or more are compressed on mesh links where that makes them
+//smaller (see MeshLZ.h).  Every node reads compressed frames, so turn this on once all of them run
+//a version of the library that has it.  0, the default, disables it
+#ifndef ESP8266_COMPRESS_MIN
+  #define ESP8266_COMPRESS_MIN 0
+#endif
+#if ESP8266_COMPRESS_MIN > 0 && ESP8266_COMPRESS_MIN < 64
+  #error "ESP8266_COMPRESS_MIN must be 0 or >= 64"
+#endif
+
+//Receive buffers shared by all links, lent to a link while it assembles a split frame
+#ifndef ESP8266_RECV_POOL_LEN
+  #define ESP8266_RECV_POOL_LEN 2
+#endif
+#if ESP8266_RECV_POOL_LEN < 1 || ESP8266_RECV_POOL_LEN > 8
+  #error "ESP8266_RECV_POOL_LEN must be between 1 and 8"
+#endif
+
+//Messages for this node are queued by the network callbacks and handled from loop(), in a queue
+//allocated while any are waiting.  A message that does not fit is dropped; the default holds the
+//first window of 4 binary OTA chunks utils/send_ota.py sends, and the window only grows while
+//nothing is lost.  ESP8266_LOOP_BUDGET_US is the time loop() may take when the sketch doesn't
+//pass a budget
+#ifndef ESP8266_WORK_QUEUE_LEN
+  #define ESP8266_WORK_QUEUE_LEN (3 * MQTT_MAX_PACKET_SIZE)
+#endif
+#if ESP8266_WORK_QUEUE_LEN < MQTT_MAX_PACKET_SIZE
+  #error "ESP8266_WORK_QUEUE_LEN must be >= MQTT_MAX_PACKET_SIZE"
+#endif
+#ifndef ESP8266_LOOP_BUDGET_US
+  #define ESP8266_LOOP_BUDGET_US 10000
+#endif
+
+//Our own messages published while we can't reach the broker are held, up to ESP8266_OUTBOX_LEN
+//bytes, and replayed in order at ESP8266_OUTBOX_RATE messages a second once we are back.  When
+//the outbox is full ESP8266_OUTBOX_POLICY decides what is lost: OUTBOX_DROP_OLDEST,
+//OUTBOX_DROP_NEWEST, or OUTBOX_COALESCE, which replaces a held message on the same topic and
+//otherwise drops the oldest.  Define ESP8266_OUTBOX_FILE (e.g. "/outbox") to keep held messages
+//across a reboot; a reboot during the replay may then send some twice
+#define OUTBOX_DROP_OLDEST 0
+#define OUTBOX_DROP_NEWEST 1
+#define OUTBOX_COALESCE    2
+#ifndef ESP8266_OUTBOX_LEN
+  #define ESP8266_OUTBOX_LEN 2048
+#endif
+#if ESP8266_OUTBOX_LEN < MQTT_MAX_PACKET_SIZE
+  #error "ESP8266_OUTBOX_LEN must be >= MQTT_MAX_PACKET_SIZE"
+#endif
+#ifndef ESP8266_OUTBOX_POLICY
+  #define ESP8266_OUTBOX_POLICY OUTBOX_DROP_OLDEST
+#endif
+#ifndef ESP8266_OUTBOX_RATE
+  #define ESP8266_OUTBOX_RATE 20
+#endif
+
+//QoS 1 and 2 messages are acked end to end: the gateway node acks each one back down the mesh
+//once the broker has, and the sender resends it if no ack came within ESP8266_ACK_TIMEOUT ms.
+//The gateway remembers the last ESP8266_ACK_SLOTS messages it relayed, to drop resent copies
+#ifndef ESP8266_ACK_TIMEOUT
+  #define ESP8266_ACK_TIMEOUT 3000
+#endif
+#ifndef ESP8266_ACK_SLOTS
+  #define ESP8266_ACK_SLOTS 16
+#endif
+
+//Attempts to go straight back to the last parent, before falling back to a scan.  After a
+//power cut the parent may take a few seconds to come back
+#ifndef ESP8266_PARENT_TRIES
+  #define ESP8266_PARENT_TRIES 4
+#endif
+
+//Parents are ranked by cost: -RSSI, plus ESP8266_HOP_COST for each hop between the parent and
+//the broker, plus ESP8266_LOAD_COST for each child the parent already has
+#ifndef ESP8266_HOP_COST
+  #define ESP8266_HOP_COST 15
+#endif
+#ifndef ESP8266_LOAD_COST
+  #define ESP8266_LOAD_COST 5
+#endif
+
+//Seconds between scans that keep the ranked list of parents fresh while we are connected, so
+//that losing our parent we can switch to the next best one straight away.  0 disables them
+#ifndef ESP8266_STANDBY_SCAN
+  #define ESP8266_STANDBY_SCAN 60
+#endif
+
+//Seconds our AP stays up for our children after we lose our parent.  If we have not found a
+//new one by then, the AP is shut down so that the children look elsewhere
+#ifndef ESP8266_FAILOVER_TIME
+  #define ESP8266_FAILOVER_TIME 30
+#endif
 
 #ifndef USE_EXTENDED_NETWORKS
   #define USE_EXTENDED_NETWORKS 0
@@ -63,15 +185,209 @@ enum MSG_TYPE {
 typedef struct {
     unsigned int len;
     byte         md5[16];
+    bool         verified;   //The staged image has already passed its MD5 check
+    unsigned int chunk;      //Size of the chunks the sender splits the image into
+    bool         raw;        //Chunks are sent as binary rather than base64
 } ota_info_t;
 
+//Firmware is staged one flash sector at a time.  Offsets are relative to freeSpaceStart
+#define OTA_MAX_SECTORS 256  //Firmware is limited to the 1MB flash mapping
+#define OTA_DEFAULT_CHUNK 768
+#define OTA_MIN_CHUNK 256
+
+typedef struct {
+    uint32_t len;            //Image length, 0 when no OTA is in progress
+    uint8_t  erased[OTA_MAX_SECTORS / 8];  //Bitmap of sectors erased for this image
+    uint32_t page_addr;      //Offset of the first byte in page
+    uint16_t page_len;
+    uint16_t page_pad;       //Leading bytes of page that are padding or already written
+    uint32_t hashed;         //Bytes fed to the running MD5, always a prefix of the image
+    uint8_t  progress;       //Last progress reported, in percent
+    uint32_t written;        //Bytes written to flash
+    uint32_t reboot_at;      //millis() by which to reboot once 'flash' is received
+    uint8_t  *page;          //FLASH_SECTOR_SIZE bytes, allocated while an OTA is in progress
+    uint16_t chunk;
+    bool     raw;            //Chunks are binary, not base64
+    uint8_t  *chunks;        //Bitmap of the chunks that have been received
+} ota_state_t;
+
+//Mesh links carry length-prefixed binary frames:
+//  version(1) type(1) flags(1) topic_len(1) payload_len(2, little endian) topic '\0' payload '\0' [id(2)]
+//The terminators let a receiver use the topic and payload in place as C strings;
+//the payload length is authoritative, so payloads may contain NUL bytes
+#define MESH_FRAME_VERSION    1
+#define MESH_FRAME_HEADER_LEN 6
+//Flags: MESH_FLAG_ID adds a message ID (little endian) to a message to be acked.  A MESH_FLAG_ACK
+//frame acks that ID; it has no topic and its payload is the sender's subdomain
+#define MESH_FLAG_ID          0x01
+#define MESH_FLAG_ACK         0x02
+//MESH_FLAG_ALIAS: the first byte of the topic is an alias.  Alone it stands for the topic last
+//given that alias on this link, otherwise the rest of the topic is given the alias
+#define MESH_FLAG_ALIAS       0x04
+//MESH_FLAG_LZ: the payload is its length (2 bytes, little endian) followed by the compressed bytes
+#define MESH_FLAG_LZ          0x08
+
+#define SUBTREE_FW_ALL 0xff
+
+typedef struct {
+    uint8_t      count;      //SUBTREE_FW_ALL once more than ESP8266_SUBTREE_FW_IDS were seen
+    unsigned int id[ESP8266_SUBTREE_FW_IDS];
+} subtree_fw_t;
+
+typedef struct {
+    uint8_t     type;
+    uint8_t     flags;
+    uint8_t     topic_len;
+    uint16_t    payload_len;
+    const char *topic;
+    const char *payload;
+    const char *raw;        //The complete frame as received, for relaying
+    uint16_t    size;
+    uint16_t    id;         //Message ID, 0 if there is none
+} mesh_frame_t;
+
+//A message the gateway relayed to the broker for another node, kept to ack it and to spot copies
+typedef struct {
+    uint8_t  subdomain;      //Sender, 0 if the slot is free
+    uint16_t id;             //Sender's message ID
+    uint16_t packetId;       //MQTT packet ID, 0 once the broker has acked
+} relayed_msg_t;
+
+typedef struct {
+    char     *buf;
+    uint16_t head;
+    uint16_t len;
+    uint16_t inflight;       //Bytes handed to the AsyncClient and not yet acked
+    uint16_t partial;        //Bytes left of a frame the AsyncClient has only been given part of
+    uint16_t high_watermark;
+    uint32_t dropped;
+} send_queue_t;
+
+typedef struct {
+    char     *buf;           //Pool buffer holding the frame being assembled
+    uint8_t  header[MESH_FRAME_HEADER_LEN];
+    uint16_t len;            //Bytes of the current frame received so far
+    uint16_t discard;        //Bytes of a dropped frame still to be skipped
+    uint16_t skipped;        //Bytes of a dropped frame skipped so far
+    uint8_t  alias;          //Alias a dropped frame gives its topic
+    uint32_t dropped;
+    char     **aliases;      //Topics by alias, allocated when the link first uses one
+} recv_state_t;
+
+typedef struct {
+    char     *topic;            //NULL while the alias is unused
+    uint16_t used;              //When last sent, to replace the least recently used
+} topic_alias_t;
+
+typedef struct {
+    uint16_t queued;         //Bytes waiting in the send queue
+    uint16_t high_watermark; //Most bytes ever waiting
+    uint32_t dropped;        //Frames dropped because the queue was full
+    uint32_t recv_dropped;   //Frames dropped because no receive buffer was free, or on link 0 no room in the work queue
+} mesh_link_stats_t;
+
 typedef struct {
     char bssid[19];
     int  ssid_idx;
     int  rssi;
+    int  channel;
+    uint8_t depth;   //Hops from the AP to the broker: 0 for a network, MESH_DEPTH_UNKNOWN if not advertised
+    int  cost;
 } ap_t;
+
+//Mesh nodes advertise 'E' 'M' depth children free-slots in a vendor IE in their beacons and probe
+//responses, so that a scanning node can rank them without connecting.  A node on a network
+//has depth 1
+#define MESH_IE_OUI        {0x18, 0xFE, 0x34}
+#define MESH_IE_LEN        5
+#define MESH_IE_MAX        64  //APs whose IE we keep from one scan
+#define MESH_DEPTH_UNKNOWN 0xff
+#define MESH_UNKNOWN_HOPS  4   //Depth assumed for a node that doesn't advertise
+#define MESH_FULL_COST     100 //Added for a node with no free slot
+//Vendor IEs heard during a scan, by the BSSID that sent them
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t depth;
+    uint8_t children;
+    uint8_t free;
+} mesh_ie_t;
+
+typedef struct {
+    mesh_ie_t *ie;           //Allocated while a scan is running
+    uint8_t   len;
+    uint8_t   size;
+} mesh_ie_table_t;
+
+//The SDK allows at most 8 stations on the soft-AP
+#define MESH_AP_MAX_CONN   (ESP8266_NUM_CLIENTS < 8 ? ESP8266_NUM_CLIENTS : 8)
+
+//The AP we last connected through, tried before scanning at boot and after a disconnect
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;         //0 if there is none
+    uint8_t depth;           //As advertised by the parent
+    bool    mesh;            //A mesh node rather than one of the networks
+    char    ssid[33];
+} parent_t;
+#define PARENT_FILE "/parent"
+
+//Subdomain of a known mesh node.  The table is kept sorted by MAC.  'version' is the map
+//version at which the entry last changed, so a parent can send a child just what is newer
+//than the child has seen
+typedef struct {
+    uint8_t  mac[6];
+    uint8_t  subdomain;
+    uint16_t version;
+} __attribute__((packed)) bssid_map_t;
+
+//The mesh map is stored as a table of bssid_map_t records after a 6 byte header ('EMM',
+//format, epoch), plus a log of records appended since the table was written.  The epoch is
+//picked when the map is created and changes if the version wraps, so a version is only
+//compared with versions from the same map
+#define MESHMAP_FILE    "/meshmap"
+#define MESHMAP_LOG     "/meshmap.log"
+#define MESHMAP_TMP     "/meshmap.tmp"
+#define MESHMAP_VERSION 2
+#define MESHMAP_HEADER_LEN 6
+
+//A parent syncs a child with frames on inTopic + MESHMAP_SYNC_TOPIC carrying
+//  epoch(2) since(2) upto(2), then mac(6) subdomain(1) per entry changed in (since, upto]
+#define MESHMAP_SYNC_TOPIC  "bssid_sync"
+#define MESHMAP_SYNC_HEADER 6
+#define MESHMAP_SYNC_ENTRY  7
+
+//A node that found a new parent sends its depth to its children on inTopic + MESH_REJOIN_TOPIC.
+//They announce themselves to their new ancestors, and pass it on with their own depth
+#define MESH_REJOIN_TOPIC   "rejoin"
+
+//Log records kept before the table is rewritten
+#ifndef ESP8266_MESHMAP_LOG_LEN
+  #define ESP8266_MESHMAP_LOG_LEN 32
+#endif
 #define LAST_AP 5
 
+class ESP8266MQTTMesh;
+
+//Jobs run by the scheduler.  Each has a timer of its own, so arming one never cancels another
+enum MESH_TIMER {
+    TIMER_CONNECT = 0,
+    TIMER_ASSIGN_SUBDOMAIN,
+    TIMER_STANDBY_SCAN,
+    TIMER_SCAN_POLL,
+    TIMER_OTA_ERASE,
+    TIMER_OTA_REBOOT,
+    TIMER_WORK,
+    TIMER_OUTBOX,
+    TIMER_LAST,
+};
+
+typedef struct {
+    void (*fn)(ESP8266MQTTMesh *e);
+    uint32_t due;      //millis() at which the job runs next
+    uint32_t period;   //ms between runs, 0 for a one-shot job
+    bool     armed;
+} mesh_timer_t;
+
 #if USE_EXTENDED_NETWORKS
 typedef struct {
     const char *ssid;
@@ -103,8 +419,8 @@ private:
 #if HAS_OTA
     uint32_t freeSpaceStart;
     uint32_t freeSpaceEnd;
-    uint32_t nextErase;
-    uint32_t startTime;
+    ota_state_t ota = {};
+    MD5Builder otaMD5;
 #endif
 #if ASYNC_TCP_SSL_ENABLED
     bool mqtt_secure;
@@ -114,16 +430,59 @@ private:
     AsyncServer     espServer;
     AsyncClient     *espClient[ESP8266_NUM_CLIENTS+1] = {0};
     uint8           espMAC[ESP8266_NUM_CLIENTS+1][6];
+    send_queue_t    sendQueue[ESP8266_NUM_CLIENTS+1] = {};
     AsyncMqttClient mqttClient;
 
+    //One Ticker, armed for whichever timer is due first
     Ticker schedule;
+    mesh_timer_t timers[TIMER_LAST] = {};
+    bool timersRunning = false;
 
     int retry_connect;
     ap_t ap[LAST_AP];
+    mesh_ie_table_t seenIE = {};
     int ap_idx = 0;
+    parent_t lastParent = {};
+    bool parentChanged = false;    //lastParent has not been written to PARENT_FILE yet
+    uint8_t parentTries = ESP8266_PARENT_TRIES;  //Attempts at lastParent left before we scan
+    bool parentConnect = false;    //ap[] holds lastParent rather than scan results
+    uint8_t depth = MESH_DEPTH_UNKNOWN;  //Hops from us to the broker
     char mySSID[20];
-    char inbuffer[ESP8266_NUM_CLIENTS+1][MQTT_MAX_PACKET_SIZE];
-    char *bufptr[ESP8266_NUM_CLIENTS+1];
+    bssid_map_t *bssidMap = NULL;  //Loaded from the mesh map at begin(), changes are written through
+    uint16_t bssidMapLen = 0;
+    uint16_t bssidMapSize = 0;
+    uint16_t bssidLogLen = 0;      //Records in MESHMAP_LOG
+    uint16_t bssidEpoch = 0;
+    uint16_t bssidVersion = 0;     //Highest entry version
+    uint8_t syncParent[6] = {};    //Parent whose map we last synced with, and how far
+    uint16_t syncEpoch = 0;
+    uint16_t syncVersion = 0;
+    bool mapChanged = false;       //The table has changes not yet written, since mapVersion of mapEpoch
+    bool mapMoved = false;         //One of them is our own subdomain
+    bool mapSync = false;          //They came from our parent and are to be passed on to our children
+    uint16_t mapEpoch = 0;
+    uint16_t mapVersion = 0;
+    char recvPool[ESP8266_RECV_POOL_LEN][MQTT_MAX_PACKET_SIZE];
+    uint8_t recvPoolUsed = 0;
+    recv_state_t recvState[ESP8266_NUM_CLIENTS+1] = {};
+    topic_alias_t topicAlias[ESP8266_TOPIC_ALIASES ? ESP8266_TOPIC_ALIASES : 1] = {};  //Ours for the parent link
+    uint16_t aliasClock = 0;
+    //Messages for this node waiting for loop(), as mesh frames
+    char *workQueue = NULL;
+    uint16_t workHead = 0;
+    uint16_t workLen = 0;
+    bool workRunning = false;
+    bool loopCalled = false;
+    //Our messages held until we can reach the broker, as mesh frames with the subtopic as topic
+    char *outbox = NULL;           //Allocated while messages are held
+    uint16_t outboxLen = 0;
+    uint16_t nextMsgId = 0;
+    uint16_t ackWait = 0;          //ID (MQTT packet ID on the gateway) the outbox head was sent with, 0 if not sent
+    unsigned long ackSent = 0;
+    relayed_msg_t relayed[ESP8266_ACK_SLOTS] = {};
+    uint8_t relayedNext = 0;
+    uint8_t routes[128] = {};  //Child link each subdomain in our subtree lives behind, 4 bits each, 0 if unknown
+    subtree_fw_t subtreeFw[ESP8266_NUM_CLIENTS+1] = {};  //Firmware IDs running behind each child link
     long lastMsg = 0;
     char msg[50];
     int value = 0;
@@ -133,40 +492,137 @@ private:
     bool connecting = 0;
     bool scanning = 0;
     bool AP_ready = false;
+    bool refreshing = false;       //A standby scan is running
+    bool failover = false;         //Upstream is lost but our AP is up, see start_failover()
+    unsigned long failoverStart = 0;
     std::function<void(const char *topic, const char *msg)> callback;
 
     bool wifiConnected() { return (WiFi.status() == WL_CONNECTED); }
     void die() { while(1) {} }
 
+    void start_timer(int id, float seconds, void (*fn)(ESP8266MQTTMesh *e), bool repeat);
+    void timer_once(int id, float seconds, void (*fn)(ESP8266MQTTMesh *e)) { start_timer(id, seconds, fn, false); };
+    void timer_every(int id, float seconds, void (*fn)(ESP8266MQTTMesh *e)) { start_timer(id, seconds, fn, true); };
+    void timer_cancel(int id);
+    void arm_timers();
+    bool timer_due();
+    void run_timers();
+    static void run_timers(ESP8266MQTTMesh *e) { e->run_timers(); };
+
     bool match_bssid(const char *bssid);
     int match_networks(const char *ssid, const char *bssid);
     void scan();
+    void start_scan();
+    int scan_complete();
+    void rank_aps(int numberOfNetworksFound);
+    void refresh_aps();
+    static void refresh_aps(ESP8266MQTTMesh *e) { e->refresh_aps(); };
+    void start_failover();
+    void rejoin();
+    bool use_parent();
+    void load_parent();
+    void note_parent();
+    void save_parent();
+    bool can_publish();
+    uint16_t send_publish(const char *subtopic, const char *msg, uint8_t msgType, int msgLen = -1, uint16_t id = 0);
+    static bool needs_ack(uint8_t msgType);
+    bool hold_message(const char *subtopic, const char *msg, uint8_t msgType);
+    void drop_held(size_t offset);
+    void start_replay();
+    void replay_outbox();
+    static void replay_outbox(ESP8266MQTTMesh *e) { e->replay_outbox(); };
+    void load_outbox();
+    void save_outbox();
     void connect();
     static void connect(ESP8266MQTTMesh *e) { e->connect(); };
     void schedule_connect(float delay = 5.0);
     void connect_mqtt();
     void shutdown_AP();
     void setup_AP();
-    int read_subdomain(const char *fileName);
-    void send_bssids(int idx);
-    void handle_client_data(int idx, char *data);
-    void parse_message(const char *topic, const char *msg);
+    void advertise_AP();
+    void announce_AP();
+    int read_subdomain(File &f);
+    void load_bssids();
+    int read_bssids(File &f);
+    bool save_bssids();
+    void renumber_bssids();
+    int bssid_index(const uint8_t *mac);
+    int get_subdomain(const uint8_t *mac);
+    int get_subdomain(const char *bssid);
+    bool set_subdomain(const char *bssid, int subdomain);
+    bool set_subdomain(const uint8_t *mac, uint8_t subdomain);
+    bool bump_bssid(const uint8_t *mac, uint8_t subdomain);
+    bool write_bssids(uint16_t since);
+    bool map_bssid(const uint8_t *mac, uint8_t subdomain, uint16_t version);
+    static bool parse_mac(const char *str, uint8_t *mac);
+    void request_bssids();
+    void send_bssids(int idx, uint16_t epoch, uint16_t since);
+    void receive_bssids(const uint8_t *msg, int msgLen);
+    void receive_bssid(const char *bssid, const char *msg);
+    void map_changed(uint16_t epoch, uint16_t version, bool moved, bool sync);
+    void save_map();
+    void handle_client_data(int idx, const mesh_frame_t *frame);
+    static int parse_frame(const uint8_t *data, size_t len, mesh_frame_t *frame);
+    static size_t frame_size(const uint8_t *header);
+    void parse_message(const char *topic, const char *msg, int msgLen = -1);
     void mqtt_callback(const char* topic, const byte* payload, unsigned int length);
-    uint16_t mqtt_publish(const char *topic, const char *msg, uint8_t msgType);
-    bool send_message(int index, const char *topicOrMsg, const char *msg = NULL, uint8_t msgType = MSG_TYPE_NONE);
+    uint16_t mqtt_publish(const char *topic, const char *msg, uint8_t msgType, int msgLen = -1);
+    bool send_message(int index, const char *topic, const char *msg, uint8_t msgType = MSG_TYPE_NONE, int msgLen = -1, uint16_t id = 0);
+    bool send_encoded(int index, const char *topic, const char *msg, uint8_t msgType, int msgLen, uint16_t id, uint8_t flags);
+    static size_t pack_payload(const char *msg, size_t msgLen, char *buf);
+    static int unpack_payload(const mesh_frame_t *frame, char *buf, size_t bufLen);
+    int find_alias(const char *topic, bool *known);
+    bool expand_alias(int idx, mesh_frame_t *frame);
+    void keep_alias(int idx, const uint8_t *data, size_t len);
+    void unalias_queue();
+    void clear_aliases();
+    void relay_publish(const mesh_frame_t *frame);
+    void send_ack(uint8_t subdomain, uint16_t id);
+    void handle_ack(const mesh_frame_t *frame);
+    bool forward_frame(int index, const mesh_frame_t *frame);
+    bool send_frame(int index, const char *part[], const size_t partLen[], int parts);
+    void send_queued(int index);
+    void open_queue(int index);
+    void close_queue(int index);
+    char *alloc_recv_buf(bool reserve = false);
+    void free_recv_buf(char *buf);
+    void reset_recv(int index);
+    bool reserve_work(size_t len);
+    void queue_work(const mesh_frame_t *frame);
+    void queue_work(const char *topic, const char *msg, int msgLen);
+    void queue_packed_work(const mesh_frame_t *frame);
+    bool map_topic(const char *topic);
+    void receive_map(const char *topic, const char *msg, int msgLen);
+    void run_work();
+    void drain_work(uint32_t start, uint32_t budget_us);
+    static void drain_work(ESP8266MQTTMesh *e) { e->drain_work(micros(), ESP8266_LOOP_BUDGET_US); };
     void send_messages();
-    void broadcast_message(const char *topicOrMsg, const char *msg = NULL);
+    void route_message(const char *topic, const char *msg, int msgLen = -1);
+    int topic_subdomain(const char *subtopic);
+    uint16_t route_links(const char *topic);
+    void add_subtree_fw(int idx, unsigned int id);
+    int get_route(int subdomain) { return (routes[subdomain / 2] >> (subdomain % 2 * 4)) & 0xf; };
+    void set_route(int subdomain, int idx);
+    void clear_routes(int idx);
     void get_fw_string(char *msg, int len, const char *prefix);
     void handle_fw(const char *cmd);
-    void handle_ota(const char *cmd, const char *msg);
+    void handle_ota(const char *cmd, const char *msg, int msgLen);
     ota_info_t parse_ota_info(const char *str);
     bool check_ota_md5();
+    void ota_write(uint32_t address, const uint8_t *data, size_t len);
+    bool ota_flush();
+    bool ota_erase(uint32_t address, uint32_t len);
+    void ota_mark(uint32_t address, uint32_t len, bool received);
+    void ota_missing(uint32_t end);
+    bool ota_hash_flash(uint32_t end);
     bool isAPConnected(uint8 *mac);
     void getMAC(IPAddress ip, uint8 *mac);
     void assign_subdomain();
     static void assign_subdomain(ESP8266MQTTMesh *e) { e->assign_subdomain(); };
     void erase_sector();
     static void erase_sector(ESP8266MQTTMesh *e) { e->erase_sector(); };
+    void ota_reboot();
+    static void ota_reboot(ESP8266MQTTMesh *e) { e->ota_reboot(); };
 
     WiFiEventHandler wifiConnectHandler;
     WiFiEventHandler wifiDisconnectHandler;
@@ -219,8 +675,10 @@ public:
     
     void setCallback(std::function<void(const char *topic, const char *msg)> _callback);
     void begin();
+    uint32_t loop(uint32_t budget_us = ESP8266_LOOP_BUDGET_US);
     void publish(const char *subtopic, const char *msg, uint8_t msgCmd = MSG_TYPE_NONE);
     bool connected();
+    mesh_link_stats_t getLinkStats(int link);
     static bool keyValue(const char *data, char separator, char *key, int keylen, const char **value);
 };
 
@@ -0,0 +1,108 @@
+#include "MeshLZ.h"
+
+#include <string.h>
+
+#define LZ_HASH_BITS 8
+#define LZ_MAX_LIT   32
+#define LZ_MAX_OFF   8192
+#define LZ_MAX_REF   (7 + 255 + 2)
+
+static inline unsigned lz_hash(const uint8_t *p) {
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static bool lz_literals(const uint8_t *lit, size_t len, uint8_t *out, size_t *op, size_t outLen) {
+    while (len) {
+        size_t run = len < LZ_MAX_LIT ? len : LZ_MAX_LIT;
+        if (*op + 1 + run > outLen) {
+            return false;
+        }
+        out[(*op)++] = run - 1;
+        memcpy(out + *op, lit, run);
+        *op += run;
+        lit += run;
+        len -= run;
+    }
+    return true;
+}
+
+size_t lz_compress(const uint8_t *in, size_t inLen, uint8_t *out, size_t outLen) {
+    //Last position + 1 of each 3 byte sequence, 0 if not seen
+    static uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t ip = 0, op = 0, lit = 0;
+    while (ip + 2 < inLen) {
+        unsigned h = lz_hash(in + ip);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+        if (! ref || ip - (ref - 1) > LZ_MAX_OFF || memcmp(in + ref - 1, in + ip, 3) != 0) {
+            ip++;
+            continue;
+        }
+        ref--;
+        size_t len = 3;
+        size_t maxLen = inLen - ip < LZ_MAX_REF ? inLen - ip : LZ_MAX_REF;
+        while (len < maxLen && in[ref + len] == in[ip + len]) {
+            len++;
+        }
+        if (! lz_literals(in + lit, ip - lit, out, &op, outLen) || op + 3 > outLen) {
+            return 0;
+        }
+        size_t off = ip - ref - 1;
+        if (len - 2 < 7) {
+            out[op++] = ((len - 2) << 5) | (off >> 8);
+        } else {
+            out[op++] = (7 << 5) | (off >> 8);
+            out[op++] = len - 2 - 7;
+        }
+        out[op++] = off & 0xff;
+        //Index what the copy covered, so that later repeats of it are found
+        for (size_t i = ip + 1; i < ip + len && i + 2 < inLen; i++) {
+            table[lz_hash(in + i)] = i + 1;
+        }
+        ip += len;
+        lit = ip;
+    }
+    if (! lz_literals(in + lit, inLen - lit, out, &op, outLen)) {
+        return 0;
+    }
+    return op;
+}
+
+size_t lz_decompress(const uint8_t *in, size_t inLen, uint8_t *out, size_t outLen) {
+    size_t ip = 0, op = 0;
+    while (ip < inLen) {
+        unsigned ctrl = in[ip++];
+        if (ctrl < LZ_MAX_LIT) {
+            size_t run = ctrl + 1;
+            if (ip + run > inLen || op + run > outLen) {
+                return 0;
+            }
+            memcpy(out + op, in + ip, run);
+            ip += run;
+            op += run;
+            continue;
+        }
+        size_t len = ctrl >> 5;
+        if (len == 7) {
+            if (ip >= inLen) {
+                return 0;
+            }
+            len += in[ip++];
+        }
+        len += 2;
+        if (ip >= inLen) {
+            return 0;
+        }
+        size_t off = (((ctrl & 0x1f) << 8) | in[ip++]) + 1;
+        if (off > op || op + len > outLen) {
+            return 0;
+        }
+        //Byte by byte: the copy may overlap what it produces
+        for (size_t i = 0; i < len; i++, op++) {
+            out[op] = out[op - off];
+        }
+    }
+    return op;
+}
@@ -0,0 +1,20 @@
+#ifndef _MESH_LZ_H
+#define _MESH_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//A small LZ77 codec (the LZF format) for mesh payloads: an 8kB window, no allocation, and 512
+//bytes of static state for the compressor.  The stream is a sequence of
+//  000LLLLL <L+1 literal bytes>                   a literal run of 1 to 32 bytes
+//  LLLooooo [extra length] oooooooo               a copy of L+2 bytes (L=7: 9 + extra length)
+//                                                 from offset o+1 back in the output
+
+//Compress inLen bytes into out.  Returns the compressed length, or 0 if it would exceed outLen
+size_t lz_compress(const uint8_t *in, size_t inLen, uint8_t *out, size_t outLen);
+
+//Decompress inLen bytes into out.  Returns the decompressed length, or 0 if the stream is invalid
+//or would exceed outLen
+size_t lz_decompress(const uint8_t *in, size_t inLen, uint8_t *out, size_t outLen);
+
+#endif //_MESH_LZ_H
@@ -16,6 +16,8 @@ inTopic = topic + "in"
 outTopic = topic + "out"
 name=""
 passw=""
+chunk_size = 768
+missing = {}
 
 def on_connect(client, userdata, flags, rc):
     print("Connected with result code "+str(rc))
@@ -27,8 +29,70 @@ def on_connect(client, userdata, flags, rc):
 # The callback for when a PUBLISH message is received from the server.
 def on_message(client, userdata, msg):
     #esp8266-out/mesh_esp8266-6/check=MD5 Passed
+    #esp8266-out/mesh_esp8266-6/ota/missing=0,1536-3072
+    if msg.topic.endswith("/ota/missing"):
+        node = msg.topic[len(outTopic) + 1:-len("/ota/missing")]
+        missing[node] = msg.payload.decode()
+        return
     print("%s   %-30s = %s" % (str(datetime.datetime.now()), msg.topic, str(msg.payload)));
 
+def parse_missing(payload):
+    chunks = set()
+    if payload == "none":
+        return chunks
+    for r in payload.split(","):
+        first, _, last = r.partition("-")
+        for pos in range(int(first), int(last or first) + 1, chunk_size):
+            chunks.add(pos)
+    return chunks
+
+def query_missing(client, send_topic, end, nodes):
+    # Ask every node which chunks below 'end' it is missing.  Nodes that answer are added
+    # to 'nodes'; the first query waits longer, since it also discovers who is taking part
+    missing.clear()
+    client.publish("{}missing".format(send_topic), str(end))
+    deadline = time.time() + (2 if nodes else 3)
+    while time.time() < deadline and not (nodes and nodes <= set(missing.keys())):
+        time.sleep(0.01)
+    replies = dict(missing)
+    for node in nodes - set(replies.keys()):
+        print("No reply from {}".format(node))
+    nodes.update(replies.keys())
+    chunks = set()
+    for payload in replies.values():
+        chunks |= parse_missing(payload)
+    return chunks, set(replies.keys())
+
+def send_chunks(client, send_topic, data, nodes):
+    # Send chunks in windows.  After each window the nodes report what they are missing; lost
+    # chunks are resent first, and the window grows while nothing is lost and halves on loss
+    todo = list(range(0, len(data), chunk_size))
+    window = 4
+    end = 0
+    sent = 0
+    silent = {}
+    while True:
+        burst = todo[:window]
+        todo = todo[window:]
+        for pos in burst:
+            client.publish("{}{}".format(send_topic, str(pos)), bytearray(data[pos:pos + chunk_size]))
+            end = max(end, min(pos + chunk_size, len(data)))
+        sent += len(burst)
+        lost, replied = query_missing(client, send_topic, end, nodes)
+        for node in list(nodes):
+            silent[node] = 0 if node in replied else silent.get(node, 0) + 1
+            if silent[node] >= 3:
+                print("Giving up on {}".format(node))
+                nodes.discard(node)
+        window = max(1, window // 2) if lost & set(burst) else min(64, window + 2)
+        todo = sorted(lost - set(todo)) + todo
+        if not todo and not lost and nodes <= replied:
+            break
+        if end == len(data) and not todo:
+            continue
+        print("Transmitted {} of {} bytes, window {}, {} chunks to resend".format(end, len(data), window, len(lost)))
+    print("Sent {} chunks for {} in the image to {} node(s)".format(sent, (len(data) + chunk_size - 1) // chunk_size, len(nodes)))
+
 def main():
     global inTopic, outTopic, name, passw
     parser = argparse.ArgumentParser()
@@ -92,23 +156,16 @@ def main():
     payload = "md5:%s,len:%d" %(md5.decode(), len(data))
     print(payload)
     client.connect(args.broker, args.port, 60)
-    b64data = base64.b64encode(data);
-    print("Erasing...")
-    client.publish("{}start".format(send_topic), payload)
-    time.sleep(10)
-    pos = 0
-    while len(b64data):
-        d = b64data[0: 1024]
-        b64data = b64data[1024:]
-        client.publish("{}{}".format(send_topic, str(pos)), d)
-        pos += int(len(d) * 3 / 4);
-        time.sleep(0.2)
-        if pos % (768 * 13) == 0:
-            print("Transmitted %d bytes" % (pos))
+    client.loop_start()
+    # Nodes erase flash just ahead of the data as it arrives, so there is no need to wait for an erase
+    client.publish("{}start".format(send_topic), payload + ",chunk:{},raw:1".format(chunk_size))
+    nodes = set([args.node]) if args.node else set()
+    send_chunks(client, send_topic, data, nodes)
     print("Completed send")
     client.publish("{}check".format(send_topic), "")
     time.sleep(5);
     client.publish("{}flash".format(send_topic), "")
+    client.loop_stop()
     client.loop_forever()
     client.disconnect()
 main()